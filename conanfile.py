@@ -27,10 +27,12 @@ class CuraEngineOnlyFansConan(ConanFile):
     options = {
         "shared": [True, False],
         "fPIC": [True, False],
+        "track_allocations": [True, False],
     }
     default_options = {
         "shared": False,
         "fPIC": True,
+        "track_allocations": False,
     }
 
     def set_version(self):
@@ -155,6 +157,8 @@ class CuraEngineOnlyFansConan(ConanFile):
         self.requires("ctre/3.7.2")
         self.requires("neargye-semver/0.3.0")
         self.requires("grpc/1.54.3")
+        self.requires("xxhash/0.8.2")
+        self.requires("zlib/[>=1.2.11 <2]")
         self.requires("curaengine_grpc_definitions/latest@ultimaker/testing")
 
     def build_requirements(self):
@@ -185,6 +189,7 @@ class CuraEngineOnlyFansConan(ConanFile):
         if is_msvc(self):
             tc.variables["USE_MSVC_RUNTIME_LIBRARY_DLL"] = not is_msvc_static_runtime(self)
         tc.cache_variables["CMAKE_POLICY_DEFAULT_CMP0077"] = "NEW"
+        tc.cache_variables["ONLYFANS_TRACK_ALLOCATIONS"] = bool(self.options.track_allocations)
         tc.generate()
 
         tc = CMakeDeps(self)
@@ -202,9 +207,21 @@ class CuraEngineOnlyFansConan(ConanFile):
         copy(self, pattern="LICENSE", dst=os.path.join(self.package_folder, "licenses"), src=self.source_folder)
         ext = ".exe" if self.settings.os == "Windows" else ""
         copy(self, pattern=f"curaengine_onlyfans{ext}", dst=os.path.join(self.package_folder, "bin"), src=os.path.join(self.build_folder))
+        copy(self, pattern=f"curaengine_onlyfans_convert{ext}", dst=os.path.join(self.package_folder, "bin"), src=os.path.join(self.build_folder))
+        copy(self, pattern=f"curaengine_onlyfans_replay{ext}", dst=os.path.join(self.package_folder, "bin"), src=os.path.join(self.build_folder))
+        copy(self, pattern=f"curaengine_onlyfans_emulate{ext}", dst=os.path.join(self.package_folder, "bin"), src=os.path.join(self.build_folder))
+        for library in ("*.a", "*.so*", "*.dylib", "*.lib"):
+            copy(self, pattern=f"*curaengine_onlyfans_converter{library}", dst=os.path.join(self.package_folder, "lib"), src=os.path.join(self.build_folder), keep_path=False)
+        copy(self, pattern="*curaengine_onlyfans_converter.dll", dst=os.path.join(self.package_folder, "bin"), src=os.path.join(self.build_folder), keep_path=False)
+        copy(self, pattern="onlyfans.h", dst=os.path.join(self.package_folder, "include", "onlyfans"), src=os.path.join(self.source_folder, "include", "onlyfans"))
 
         copy(self, pattern="*", dst=os.path.join(self.package_folder, "res", "plugins", self._cura_plugin_name), src=os.path.join(self.source_folder, self._cura_plugin_name))
 
+    def package_info(self):
+        self.cpp_info.libs = ["curaengine_onlyfans_converter"]
+        if self.options.shared:
+            self.cpp_info.defines = ["ONLYFANS_SHARED"]
+
     def deploy(self):
         ext = ".exe" if self.settings.os == "Windows" else ""
         copy(self, pattern=f"curaengine_onlyfans{ext}", dst=self.install_folder, src=os.path.join(self.package_folder, "bin"))
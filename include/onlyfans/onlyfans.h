@@ -0,0 +1,118 @@
+#ifndef ONLYFANS_ONLYFANS_H
+#define ONLYFANS_ONLYFANS_H
+
+/*
+ * C interface of the layer converter, for programs that convert layers
+ * themselves instead of going through CuraEngine and the gRPC plugin.
+ *
+ * A profile holds the printer settings, a cache the converted layers. Both
+ * are immutable or locked inside, so one of each may be shared by any number
+ * of threads converting at the same time. A cache directory can be shared
+ * with the plugin, layers converted by either are found by the other.
+ *
+ * Functions that can fail return an onlyfans_status. The message of the last
+ * failure on the calling thread is available from onlyfans_last_error().
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#if defined(ONLYFANS_BUILDING)
+#define ONLYFANS_API __declspec(dllexport)
+#elif defined(ONLYFANS_SHARED)
+#define ONLYFANS_API __declspec(dllimport)
+#else
+#define ONLYFANS_API
+#endif
+#else
+#define ONLYFANS_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Changes only when a function or type of this header changes incompatibly */
+#define ONLYFANS_API_VERSION 1
+
+typedef enum onlyfans_status
+{
+    ONLYFANS_OK = 0,
+    ONLYFANS_INVALID_ARGUMENT = 1, /* a null pointer, an unknown setting value or an invalid printer */
+    ONLYFANS_BUFFER_TOO_SMALL = 2, /* the output needs more room, its size was returned */
+    ONLYFANS_ABORTED = 3, /* the write callback asked to stop */
+    ONLYFANS_CONVERSION_FAILED = 4 /* the layer cannot be converted, onlyfans_last_error() tells why */
+} onlyfans_status;
+
+typedef struct onlyfans_profile onlyfans_profile;
+typedef struct onlyfans_cache onlyfans_cache;
+
+/* Receives the converted layer piece by piece, returns 0 to continue and anything else to stop */
+typedef int (*onlyfans_write_fn)(void* user_data, const char* data, size_t size);
+
+ONLYFANS_API uint32_t onlyfans_api_version(void);
+
+/* Version of the converter, the same as the version of the plugin */
+ONLYFANS_API const char* onlyfans_version(void);
+
+/* Message of the last failure on this thread, empty when there was none */
+ONLYFANS_API const char* onlyfans_last_error(void);
+
+/*
+ * Creates a profile from count settings with the names of the Cura settings,
+ * e.g. "onlyfans_valve_spacing" = "5.02". Settings not given keep their
+ * default. The profile is released with onlyfans_profile_destroy().
+ */
+ONLYFANS_API onlyfans_status onlyfans_profile_create(const char* const* names, const char* const* values, size_t count, onlyfans_profile** profile);
+
+ONLYFANS_API void onlyfans_profile_destroy(onlyfans_profile* profile);
+
+/* Upper bound of the converted size of any layer for this profile, a buffer of this size is never too small */
+ONLYFANS_API size_t onlyfans_profile_max_output(const onlyfans_profile* profile);
+
+/*
+ * Creates a cache of at most memory_bytes of converted layers. When directory
+ * is not null, every layer is also written there and the directory is kept
+ * under disk_bytes, 0 is unlimited.
+ */
+ONLYFANS_API onlyfans_status onlyfans_cache_create(size_t memory_bytes, const char* directory, size_t disk_bytes, onlyfans_cache** cache);
+
+ONLYFANS_API void onlyfans_cache_destroy(onlyfans_cache* cache);
+
+/*
+ * Converts one layer of sliced g-code, starting at its ";LAYER:" line, into
+ * output. cache may be null. On ONLYFANS_OK and ONLYFANS_BUFFER_TOO_SMALL,
+ * output_size is set to the size of the converted layer, which is not
+ * terminated. A layer without a ";LAYER:" line converts to nothing.
+ */
+ONLYFANS_API onlyfans_status onlyfans_convert(
+    const onlyfans_profile* profile,
+    onlyfans_cache* cache,
+    const char* layer,
+    size_t layer_size,
+    char* output,
+    size_t output_capacity,
+    size_t* output_size);
+
+/*
+ * Same as onlyfans_convert(), but hands the converted layer to write instead
+ * of copying it to a buffer. The layer is still converted as a whole first and
+ * then written in chunks of 64 KiB, so this saves the output buffer, not the
+ * memory of the conversion; a nonzero return of write stops the remaining
+ * chunks with ONLYFANS_ABORTED.
+ */
+ONLYFANS_API onlyfans_status onlyfans_convert_stream(
+    const onlyfans_profile* profile,
+    onlyfans_cache* cache,
+    const char* layer,
+    size_t layer_size,
+    onlyfans_write_fn write,
+    void* user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ONLYFANS_ONLYFANS_H */
@@ -0,0 +1,312 @@
+#ifndef PLUGIN_ADMISSION_H
+#define PLUGIN_ADMISSION_H
+
+#include <agrpc/asio_grpc.hpp>
+#include <boost/asio/any_completion_handler.hpp>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/execution/context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/query.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#if __has_include(<coroutine>)
+#include <coroutine>
+#elif __has_include(<experimental/coroutine>)
+#include <experimental/coroutine>
+#define USE_EXPERIMENTAL_COROUTINE
+#endif
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace plugin
+{
+
+struct AdmissionLimits
+{
+    std::size_t max_conversions{ 0 }; // 0 is unlimited
+    std::size_t max_inflight_bytes{ 0 }; // 0 is unlimited
+    std::chrono::milliseconds queue_timeout{ 10000 };
+    bool queue{ true }; // when false calls over the limits are rejected right away
+};
+
+struct AdmissionStats
+{
+    std::size_t active{ 0 };
+    std::size_t inflight_bytes{ 0 };
+    std::size_t queue_depth{ 0 };
+    std::uint64_t admitted{ 0 };
+    std::uint64_t queued{ 0 };
+    std::uint64_t rejected{ 0 };
+    std::uint64_t timed_out{ 0 };
+    std::uint64_t withdrawn{ 0 }; // cancelled while they waited
+};
+
+/**
+ * Bounds the number of concurrent conversions and the memory they hold.
+ *
+ * Calls that do not fit wait in FIFO order until enough conversions finish, or
+ * are turned away once their queue timeout expires. A single call larger than
+ * the byte budget is still admitted when nothing else is running, otherwise it
+ * could never be served. A call cancelled while it waits is withdrawn from
+ * the queue, so its place and bytes go to the calls behind it.
+ * */
+class Admission : public std::enable_shared_from_this<Admission>
+{
+    struct Waiter;
+
+public:
+    // The place of one call in the queue, taken before the call arrives so its cancellation can withdraw it
+    using Ticket = std::shared_ptr<Waiter>;
+
+    // Holds the admitted budget and hands it back on destruction
+    class Permit
+    {
+    public:
+        Permit(std::shared_ptr<Admission> admission, std::size_t bytes)
+            : admission_{ std::move(admission) }
+            , bytes_{ bytes }
+        {
+        }
+
+        Permit(Permit&& other) noexcept
+            : admission_{ std::move(other.admission_) }
+            , bytes_{ other.bytes_ }
+        {
+        }
+
+        Permit& operator=(Permit&& other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                admission_ = std::move(other.admission_);
+                bytes_ = other.bytes_;
+            }
+            return *this;
+        }
+
+        Permit(const Permit&) = delete;
+        Permit& operator=(const Permit&) = delete;
+
+        ~Permit()
+        {
+            reset();
+        }
+
+    private:
+        void reset()
+        {
+            if (admission_)
+            {
+                admission_->release(bytes_);
+                admission_.reset();
+            }
+        }
+
+        std::shared_ptr<Admission> admission_;
+        std::size_t bytes_{ 0 };
+    };
+
+    explicit Admission(AdmissionLimits limits = {})
+        : limits_{ limits }
+    {
+    }
+
+    [[nodiscard]] static Ticket ticket()
+    {
+        return std::make_shared<Waiter>();
+    }
+
+    // Must be awaited from a coroutine running on a GrpcContext, returns std::nullopt when the call is rejected or withdrawn
+    boost::asio::awaitable<std::optional<Permit>> acquire(std::size_t bytes, Ticket waiter = ticket())
+    {
+        const auto executor = co_await boost::asio::this_coro::executor;
+        {
+            std::scoped_lock lock{ mutex_ };
+            if (waiter->done)
+            {
+                co_return std::nullopt; // withdrawn before it got here
+            }
+            waiter->bytes = bytes;
+            waiter->executor = executor;
+            if (queue_.empty() && fits(bytes))
+            {
+                admit(bytes);
+                waiter->done = true;
+                co_return Permit{ shared_from_this(), bytes };
+            }
+            if (! limits_.queue)
+            {
+                ++stats_.rejected;
+                waiter->done = true;
+                co_return std::nullopt;
+            }
+            ++stats_.queued;
+            queue_.push_back(waiter);
+
+            // Armed while holding the lock, so a release on another thread can only cancel an alarm that is already set
+            auto& grpc_context = static_cast<agrpc::GrpcContext&>(boost::asio::query(executor, boost::asio::execution::context));
+            waiter->alarm.emplace(grpc_context);
+            waiter->alarm->wait(
+                std::chrono::system_clock::now() + limits_.queue_timeout,
+                [self = shared_from_this(), waiter](bool expired)
+                {
+                    if (expired)
+                    {
+                        self->expire(waiter);
+                    }
+                });
+        }
+
+        // a named initiation, GCC destroys temporaries of a co_await expression twice
+        const auto initiation = [this, waiter](boost::asio::any_completion_handler<void(bool)> handler)
+        {
+            park(waiter, std::move(handler));
+        };
+        const bool granted = co_await boost::asio::async_initiate<const boost::asio::use_awaitable_t<>&, void(bool)>(initiation, boost::asio::use_awaitable);
+        if (! granted)
+        {
+            co_return std::nullopt;
+        }
+        co_return Permit{ shared_from_this(), bytes };
+    }
+
+    // Takes the call out of the queue, it resumes without a permit. A call that was already admitted keeps its permit.
+    void withdraw(const Ticket& waiter)
+    {
+        std::scoped_lock lock{ mutex_ };
+        if (waiter->done)
+        {
+            return;
+        }
+        ++stats_.withdrawn;
+        if (std::erase(queue_, waiter) > 0)
+        {
+            waiter->alarm->cancel();
+        }
+        complete(*waiter, false);
+        // the calls behind it may fit now
+        admit_waiting();
+    }
+
+    [[nodiscard]] AdmissionStats stats() const
+    {
+        std::scoped_lock lock{ mutex_ };
+        auto stats = stats_;
+        stats.queue_depth = queue_.size();
+        return stats;
+    }
+
+    [[nodiscard]] const AdmissionLimits& limits() const
+    {
+        return limits_;
+    }
+
+private:
+    struct Waiter
+    {
+        std::size_t bytes{ 0 };
+        bool done{ false };
+        bool granted{ false };
+        boost::asio::any_io_executor executor;
+        boost::asio::any_completion_handler<void(bool)> handler;
+        std::optional<agrpc::Alarm> alarm;
+    };
+
+    bool fits(std::size_t bytes) const
+    {
+        if (limits_.max_conversions > 0 && stats_.active >= limits_.max_conversions)
+        {
+            return false;
+        }
+        return limits_.max_inflight_bytes == 0 || stats_.active == 0 || stats_.inflight_bytes + bytes <= limits_.max_inflight_bytes;
+    }
+
+    void admit(std::size_t bytes)
+    {
+        ++stats_.active;
+        ++stats_.admitted;
+        stats_.inflight_bytes += bytes;
+    }
+
+    void release(std::size_t bytes)
+    {
+        std::scoped_lock lock{ mutex_ };
+        --stats_.active;
+        stats_.inflight_bytes -= bytes;
+        admit_waiting();
+    }
+
+    void admit_waiting()
+    {
+        while (! queue_.empty() && fits(queue_.front()->bytes))
+        {
+            auto waiter = std::move(queue_.front());
+            queue_.pop_front();
+            admit(waiter->bytes);
+            waiter->alarm->cancel();
+            complete(*waiter, true);
+        }
+    }
+
+    void expire(const std::shared_ptr<Waiter>& waiter)
+    {
+        std::scoped_lock lock{ mutex_ };
+        if (waiter->done)
+        {
+            return;
+        }
+        std::erase(queue_, waiter);
+        ++stats_.timed_out;
+        complete(*waiter, false);
+    }
+
+    void park(const std::shared_ptr<Waiter>& waiter, boost::asio::any_completion_handler<void(bool)> handler)
+    {
+        std::scoped_lock lock{ mutex_ };
+        waiter->handler = std::move(handler);
+        if (waiter->done)
+        {
+            resume(*waiter);
+        }
+    }
+
+    // Marks the waiter as done, it resumes now if it is already parked or as soon as it parks itself
+    void complete(Waiter& waiter, bool granted)
+    {
+        waiter.done = true;
+        waiter.granted = granted;
+        if (waiter.handler)
+        {
+            resume(waiter);
+        }
+    }
+
+    static void resume(Waiter& waiter)
+    {
+        boost::asio::post(
+            waiter.executor,
+            [handler = std::move(waiter.handler), granted = waiter.granted]() mutable
+            {
+                std::move(handler)(granted);
+            });
+    }
+
+    AdmissionLimits limits_;
+    mutable std::mutex mutex_;
+    std::deque<std::shared_ptr<Waiter>> queue_;
+    AdmissionStats stats_;
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_ADMISSION_H
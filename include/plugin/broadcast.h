@@ -3,7 +3,10 @@
 
 #include "cura/plugins/slots/broadcast/v0/broadcast.grpc.pb.h"
 #include "cura/plugins/v0/slot_id.pb.h"
+#include "plugin/capture.h"
+#include "plugin/logging.h"
 #include "plugin/metadata.h"
+#include "plugin/registry.h"
 #include "plugin/settings.h"
 
 #include <agrpc/asio_grpc.hpp>
@@ -18,7 +21,6 @@
 #endif
 #include <functional>
 #include <memory>
-#include <unordered_map>
 
 namespace plugin
 {
@@ -26,11 +28,12 @@ namespace plugin
 struct Broadcast
 {
     using service_t = std::shared_ptr<cura::plugins::slots::broadcast::v0::BroadcastService::AsyncService>;
-    using settings_t = std::unordered_map<std::string, Settings>;
+    using settings_t = SessionRegistry<Settings>;
     using shared_settings_t = std::shared_ptr<settings_t>;
     service_t broadcast_service{ std::make_shared<cura::plugins::slots::broadcast::v0::BroadcastService::AsyncService>() };
     shared_settings_t settings{ std::make_shared<settings_t>() };
     std::shared_ptr<Metadata> metadata{ std::make_shared<Metadata>() };
+    std::shared_ptr<Capture> capture; // requests are not captured when empty
 
     boost::asio::awaitable<void> run()
     {
@@ -47,15 +50,26 @@ struct Broadcast
                 writer,
                 boost::asio::use_awaitable);
             spdlog::info("Received broadcast settings request");
+            if (capture)
+            {
+                capture->record(CapturedRequest::BROADCAST, server_context, request);
+            }
 
             grpc::Status status = grpc::Status::OK;
             try
             {
-                settings->insert_or_assign(getUuid(server_context), Settings{ request, metadata });
+                Settings session{ request, metadata };
+                if (session.log_level.has_value() && session.log_level.value() != spdlog::get_level())
+                {
+                    spdlog::info("Log level set to {} by the Cura settings", spdlog::level::to_string_view(session.log_level.value()));
+                    spdlog::set_level(session.log_level.value());
+                }
+                settings->publish(getUuid(server_context), std::move(session));
             }
             catch (const std::exception& e)
             {
-                spdlog::error("Failed to parse broadcast settings request: {}", e.what());
+                static LogRateLimit parse_errors;
+                parse_errors.log(spdlog::level::err, "Failed to parse broadcast settings request: {}", e.what());
                 status = grpc::Status(grpc::StatusCode::INTERNAL, e.what());
             }
             if (! status.ok())
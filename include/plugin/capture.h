@@ -0,0 +1,164 @@
+#ifndef PLUGIN_CAPTURE_H
+#define PLUGIN_CAPTURE_H
+
+#include <google/protobuf/message_lite.h>
+#include <grpcpp/server_context.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace plugin
+{
+
+// One request as CuraEngine sent it
+struct CapturedRequest
+{
+    enum Kind : char
+    {
+        BROADCAST = 'B', // settings broadcast
+        CALL = 'C' // layer call
+    };
+
+    Kind kind{ CALL };
+    std::chrono::nanoseconds offset{}; // since the capture started
+    std::string uuid; // the cura-engine-uuid the request was sent with
+    std::string payload; // the serialized request message
+};
+
+/**
+ * Appends every request the plugin receives to a file, so a slice can be
+ * replayed later against a changed server.
+ *
+ * The file starts with MAGIC, followed by one record per request: the kind,
+ * the offset in nanoseconds, then the uuid and the payload, each preceded by
+ * its length. Integers are little-endian. Every record is flushed, a capture
+ * of a server that crashed is complete up to the crash. Records are written
+ * from the event loops under a lock, so capturing is meant for reproducing
+ * problems and adds a copy of each request to the call.
+ * */
+class Capture
+{
+public:
+    static constexpr std::string_view MAGIC = "ONLYFANS-CAPTURE-1\n";
+
+    explicit Capture(const std::filesystem::path& path)
+        : file_{ path, std::ios::binary | std::ios::trunc }
+    {
+        if (! file_)
+        {
+            throw std::runtime_error("Could not create the capture file " + path.string());
+        }
+        file_.write(MAGIC.data(), static_cast<std::streamsize>(MAGIC.size()));
+        file_.flush();
+    }
+
+    void record(CapturedRequest::Kind kind, const grpc::ServerContext& server_context, const google::protobuf::MessageLite& request)
+    {
+        std::string_view uuid;
+        const auto metadata = server_context.client_metadata().find("cura-engine-uuid");
+        if (metadata != server_context.client_metadata().end())
+        {
+            uuid = { metadata->second.data(), metadata->second.size() };
+        }
+        record(kind, uuid, request.SerializeAsString());
+    }
+
+    void record(CapturedRequest::Kind kind, std::string_view uuid, std::string_view payload)
+    {
+        const auto offset = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started_);
+        std::scoped_lock lock(mutex_);
+        file_.put(static_cast<char>(kind));
+        writeInteger(static_cast<std::uint64_t>(offset.count()));
+        writeInteger(uuid.size());
+        file_.write(uuid.data(), static_cast<std::streamsize>(uuid.size()));
+        writeInteger(payload.size());
+        file_.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+        file_.flush();
+    }
+
+private:
+    void writeInteger(std::uint64_t value)
+    {
+        std::array<char, 8> bytes;
+        for (auto& byte : bytes)
+        {
+            byte = static_cast<char>(value & 0xFFU);
+            value >>= 8;
+        }
+        file_.write(bytes.data(), bytes.size());
+    }
+
+    std::mutex mutex_;
+    std::ofstream file_;
+    const std::chrono::steady_clock::time_point started_{ std::chrono::steady_clock::now() };
+};
+
+// Reads a capture back, request by request
+class CaptureReader
+{
+public:
+    explicit CaptureReader(const std::filesystem::path& path)
+        : file_{ path, std::ios::binary }
+    {
+        std::string magic(Capture::MAGIC.size(), '\0');
+        if (! file_.read(magic.data(), static_cast<std::streamsize>(magic.size())) || magic != Capture::MAGIC)
+        {
+            throw std::runtime_error(path.string() + " is not a capture file");
+        }
+    }
+
+    // The next request, nullopt at the end of the capture. Throws when the capture is cut off in the middle of a request.
+    std::optional<CapturedRequest> next()
+    {
+        const auto kind = file_.get();
+        if (kind == std::ifstream::traits_type::eof())
+        {
+            return std::nullopt;
+        }
+        if (kind != CapturedRequest::BROADCAST && kind != CapturedRequest::CALL)
+        {
+            throw std::runtime_error("Corrupt capture file");
+        }
+        CapturedRequest request{ .kind = static_cast<CapturedRequest::Kind>(kind) };
+        request.offset = std::chrono::nanoseconds{ readInteger() };
+        request.uuid.resize(readInteger());
+        file_.read(request.uuid.data(), static_cast<std::streamsize>(request.uuid.size()));
+        request.payload.resize(readInteger());
+        file_.read(request.payload.data(), static_cast<std::streamsize>(request.payload.size()));
+        if (! file_)
+        {
+            throw std::runtime_error("Capture file ends in the middle of a request");
+        }
+        return request;
+    }
+
+private:
+    std::uint64_t readInteger()
+    {
+        std::array<unsigned char, 8> bytes{};
+        if (! file_.read(reinterpret_cast<char*>(bytes.data()), bytes.size()))
+        {
+            throw std::runtime_error("Capture file ends in the middle of a request");
+        }
+        std::uint64_t value = 0;
+        for (auto byte = bytes.rbegin(); byte != bytes.rend(); ++byte)
+        {
+            value = (value << 8) | *byte;
+        }
+        return value;
+    }
+
+    std::ifstream file_;
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_CAPTURE_H
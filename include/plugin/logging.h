@@ -0,0 +1,112 @@
+#ifndef PLUGIN_LOGGING_H
+#define PLUGIN_LOGGING_H
+
+#include <fmt/format.h>
+#include <spdlog/async.h>
+#include <spdlog/async_logger.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace plugin
+{
+
+// spdlog's level names, e.g. "debug" or "warning", nullopt for anything else
+inline std::optional<spdlog::level::level_enum> parseLogLevel(std::string_view name)
+{
+    const auto level = spdlog::level::from_str(std::string{ name });
+    if (level == spdlog::level::off && name != "off")
+    {
+        return std::nullopt;
+    }
+    return level;
+}
+
+/**
+ * Replaces the default logger by one that formats a message on the calling
+ * thread and hands it to a sink thread of its own, so the event loops never
+ * wait on the console. The queue holds queue_size messages; when the sink
+ * falls behind the oldest ones are dropped instead of blocking the caller.
+ * */
+inline void setupAsyncLogging(std::size_t queue_size, spdlog::level::level_enum level)
+{
+    spdlog::init_thread_pool(std::max<std::size_t>(queue_size, 1), 1);
+    auto logger = std::make_shared<spdlog::async_logger>(
+        "onlyfans",
+        std::make_shared<spdlog::sinks::stdout_color_sink_mt>(),
+        spdlog::thread_pool(),
+        spdlog::async_overflow_policy::overrun_oldest);
+    logger->set_level(level);
+    logger->flush_on(spdlog::level::err);
+    spdlog::set_default_logger(std::move(logger));
+}
+
+/**
+ * Lets one message through per interval and counts the ones it holds back,
+ * the next message that passes reports how many were suppressed. Meant as a
+ * static at a call site that can repeat for every layer, such as a parse
+ * error; a suppressed message is never formatted.
+ * */
+class LogRateLimit
+{
+public:
+    explicit LogRateLimit(std::chrono::steady_clock::duration interval = std::chrono::seconds{ 1 })
+        : interval_{ interval.count() }
+    {
+    }
+
+    LogRateLimit(const LogRateLimit&) = delete;
+    LogRateLimit& operator=(const LogRateLimit&) = delete;
+
+    template<class... Args>
+    void log(spdlog::level::level_enum level, fmt::format_string<Args...> format, Args&&... args)
+    {
+        if (! spdlog::should_log(level))
+        {
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+        auto next = next_.load(std::memory_order_relaxed);
+        if (now < next || ! next_.compare_exchange_strong(next, now + interval_, std::memory_order_relaxed))
+        {
+            suppressed_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        const auto message = fmt::format(format, std::forward<Args>(args)...);
+        const auto suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+        if (suppressed > 0)
+        {
+            spdlog::log(level, "{} ({} similar messages suppressed)", message, suppressed);
+        }
+        else
+        {
+            spdlog::log(level, "{}", message);
+        }
+    }
+
+    // messages held back since the last one that passed
+    std::uint64_t suppressed() const
+    {
+        return suppressed_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::chrono::steady_clock::rep interval_;
+    std::atomic<std::chrono::steady_clock::rep> next_{ std::numeric_limits<std::chrono::steady_clock::rep>::min() };
+    std::atomic<std::uint64_t> suppressed_{ 0 };
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_LOGGING_H
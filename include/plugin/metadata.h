@@ -18,7 +18,7 @@ struct Metadata
     std::string_view plugin_version{ cmdline::VERSION };
 };
 
-std::string getUuid(grpc::ServerContext& server_context)
+inline std::string getUuid(grpc::ServerContext& server_context)
 {
     auto c_uuid = server_context.client_metadata().find("cura-engine-uuid");
     if (c_uuid == server_context.client_metadata().end())
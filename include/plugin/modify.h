@@ -1,17 +1,28 @@
 #ifndef PLUGIN_MODIFY_H
 #define PLUGIN_MODIFY_H
 
+#include "plugin/admission.h"
 #include "plugin/broadcast.h"
+#include "plugin/capture.h"
+#include "plugin/logging.h"
 #include "plugin/metadata.h"
 #include "plugin/settings.h"
+#include "plugin/stats.h"
+#include "plugin/transfer.h"
+#include "plugin/workers.h"
 
 #include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/execution/context.hpp>
+#include <boost/asio/query.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/use_awaitable.hpp>
 #include <range/v3/view/join.hpp>
-#include <range/v3/view/tokenize.hpp>
 #include <spdlog/spdlog.h>
 
-#include <ctre.hpp>
 #include <cura/plugins/slots/postprocess/v0/modify.grpc.pb.h>
+#include <google/protobuf/arena.h>
 
 #if __has_include(<coroutine>)
 
@@ -22,137 +33,338 @@
 #define USE_EXPERIMENTAL_COROUTINE
 #endif
 
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <memory>
 #include <string_view>
 
+#include <processor/allocations.h>
+#include <processor/arena.h>
+#include <processor/cache.h>
+#include <processor/converter.h>
+#include <processor/layer.h>
 #include <processor/process.h>
+#include <processor/volume.h>
 
 namespace plugin::onlyfans
 {
 
-int get_layer_nr(std::string line)
+// Upper bound of the memory one conversion holds: the request, the spray pattern and the generated output
+inline std::size_t conversionBytes(std::string_view layer, const PrinterProfile& profile)
 {
-    // Create a stringstream from the string
-    std::stringstream ss(line);
+    const auto pattern_bytes = static_cast<std::size_t>(profile.bed_rows()) * profile.bytes_per_pass() * profile.parameters().nr_passes * sizeof(std::bitset<8>);
+    return layer.size() + pattern_bytes + profile.max_layer_bytes();
+}
+
+template<class T, class Rsp, class Req>
+struct Generate
+{
+    using service_t = std::shared_ptr<T>;
+    service_t generate_service{ std::make_shared<T>() };
+    Broadcast::shared_settings_t settings{ std::make_shared<Broadcast::settings_t>() };
+    std::shared_ptr<Metadata> metadata{ std::make_shared<Metadata>() };
+    std::shared_ptr<boost::asio::thread_pool> compute_pool{ std::make_shared<boost::asio::thread_pool>() }; // layers are converted here, off the gRPC event loop
+    std::shared_ptr<Admission> admission{ std::make_shared<Admission>() };
+    std::shared_ptr<const LayerConverter> converter{ std::make_shared<const LayerConverter>(nullptr, converter_version()) };
+    TransferOptions transfer{};
+    std::shared_ptr<TransferStats> transfer_stats{ std::make_shared<TransferStats>() };
+    std::shared_ptr<ConversionMetrics> metrics; // nothing is recorded when empty
+    std::shared_ptr<Capture> capture; // requests are not captured when empty
+    std::shared_ptr<VolumeDirectory> volumes; // rasterized layers are not kept when empty
+    std::shared_ptr<WorkerPool> workers; // layers are converted in this process when empty
 
-    // Check if the string starts with ";Layer:"
-    std::string prefix;
-    std::getline(ss, prefix, ':');
-    if (prefix == ";LAYER")
+    // Records the conversions in the registry, and reports the admission, cache and transfer state whenever it is rendered
+    void addMetrics(MetricsRegistry& registry)
     {
-        // Extract the number that follows
-        int layerNumber;
-        ss >> layerNumber;
+        metrics = std::make_shared<ConversionMetrics>(registry);
+
+        auto& active = registry.gauge("onlyfans_admission_active", "Layers being converted");
+        auto& queued = registry.gauge("onlyfans_admission_queue_depth", "Layers waiting for the conversion limits");
+        auto& inflight = registry.gauge("onlyfans_admission_inflight_bytes", "Memory budget held by the layers being converted");
+        auto& rejected = registry.counter("onlyfans_admission_rejected_total", "Layers rejected because of the conversion limits");
+        auto& withdrawn = registry.counter("onlyfans_admission_withdrawn_total", "Layers cancelled while they waited for the conversion limits");
+        registry.collect(
+            [admission = admission, &active, &queued, &inflight, &rejected, &withdrawn]()
+            {
+                const auto stats = admission->stats();
+                active.set(static_cast<double>(stats.active));
+                queued.set(static_cast<double>(stats.queue_depth));
+                inflight.set(static_cast<double>(stats.inflight_bytes));
+                rejected.set(stats.rejected);
+                withdrawn.set(stats.withdrawn);
+            });
 
-        if (! ss.fail())
+        if constexpr (AllocationTracker::enabled())
         {
-            // Extraction succeeded, layerNumber contains the extracted integer
-            return layerNumber;
+            auto& live_bytes = registry.gauge("onlyfans_heap_live_bytes", "Heap bytes allocated and not freed by the process");
+            auto& allocations = registry.counter("onlyfans_heap_allocations_total", "Heap allocations made by the process");
+            registry.collect(
+                [&live_bytes, &allocations]()
+                {
+                    live_bytes.set(static_cast<double>(AllocationTracker::process_live_bytes()));
+                    allocations.set(AllocationTracker::process_allocations());
+                });
         }
-        else
+
+        if (workers)
         {
-            // Extraction failed, handle the error
-            return -2;
+            auto& busy = registry.gauge("onlyfans_workers_busy", "Worker processes converting a layer");
+            auto& restarts = registry.counter("onlyfans_worker_restarts_total", "Worker processes started again after they exited");
+            registry.collect(
+                [workers = workers, &busy, &restarts]()
+                {
+                    const auto stats = workers->stats();
+                    busy.set(static_cast<double>(stats.busy));
+                    restarts.set(stats.restarts);
+                });
         }
-    }
-    else
-    {
-        return -3;
-    }
-   
-  
-}
- 
-
-std::string filterLines(std::string_view layer)
-{
-    constexpr auto pattern = ctll::fixed_string{ "^(;|M106|M107|M123|M710).*$" };
-
-    //create our printer
-    PrintHead ph(5.0, 11, 8);
-    PrintManager pm(ph, 118, 1462 - 118);
-
-    // Split the input string to lines
-    const std::regex rx{ R"(.*\n?)" };
-    auto lines = layer | ranges::views::tokenize(rx);
 
-    int layer_nr = -1;
-    for (const auto& line : lines)
-    {
-        std::string line_s = line.str();
-        if (layer_nr < 0) // haven't found the layer key-word yet
+        auto& request_bytes = registry.counter("onlyfans_request_bytes_total", "Bytes of layers received");
+        auto& response_bytes = registry.counter("onlyfans_response_bytes_total", "Bytes of converted layers sent, before compression");
+        auto& compressed_raw_bytes = registry.counter("onlyfans_response_compressed_raw_bytes_total", "Bytes of converted layers sent compressed, before compression");
+        registry.collect(
+            [transfer_stats = transfer_stats, &request_bytes, &response_bytes, &compressed_raw_bytes]()
+            {
+                const auto stats = transfer_stats->snapshot();
+                request_bytes.set(stats.request_bytes);
+                response_bytes.set(stats.response_bytes);
+                compressed_raw_bytes.set(stats.compressed_raw_bytes);
+            });
+        if (transfer_stats->estimates())
         {
-            layer_nr = get_layer_nr(line_s);
+            auto& compressed_bytes = registry.counter("onlyfans_response_compressed_bytes_total", "Estimated bytes of converted layers sent compressed, after compression");
+            registry.collect(
+                [transfer_stats = transfer_stats, &compressed_bytes]()
+                {
+                    compressed_bytes.set(transfer_stats->snapshot().estimated_compressed_bytes);
+                });
         }
-        else
+
+        if (const auto& cache = converter->cache())
         {
-            pm.parse(line);
+            auto& hits = registry.counter("onlyfans_cache_hits_total", "Layers served from the cache");
+            auto& misses = registry.counter("onlyfans_cache_misses_total", "Layers not found in the cache");
+            auto& bytes = registry.gauge("onlyfans_cache_bytes", "Memory held by the cache");
+            auto& disk_bytes = registry.gauge("onlyfans_cache_disk_bytes", "Disk space held by the cache");
+            registry.collect(
+                [cache = cache, &hits, &misses, &bytes, &disk_bytes]()
+                {
+                    const auto stats = cache->stats();
+                    hits.set(stats.hits);
+                    misses.set(stats.misses);
+                    bytes.set(static_cast<double>(stats.bytes));
+                    disk_bytes.set(static_cast<double>(stats.disk_bytes));
+                });
         }
     }
 
-    if (layer_nr >= 0)
-    {
-        return pm.generate(layer_nr);
-    }
-    else
+    // The profile of the slice the call belongs to, the default printer when its settings were never broadcast.
+    // nullptr when they were broadcast but expired or were evicted since, the defaults would be the wrong printer.
+    std::shared_ptr<const PrinterProfile> profile(const std::string& uuid) const
     {
-        return "";
+        std::shared_ptr<const PrinterProfile> printer;
+        if (settings->visit(
+                uuid,
+                [&printer](const Settings& session)
+                {
+                    printer = session.profile;
+                }))
+        {
+            return printer;
+        }
+        return settings->forgotten(uuid) ? nullptr : PrinterProfile::defaults();
     }
-}
 
-std::string get_last_layer(const std::string& input)
-{
-    // Find the last occurrence of ";LAYER:xx"
-    size_t layerPos = input.rfind(";LAYER:");
-    if (layerPos == std::string::npos)
+    // Converts the layer, or serves it from the cache when the same layer was converted for the same printer before
+    std::string convert(
+        std::string_view layer,
+        const std::shared_ptr<const PrinterProfile>& profile,
+        const CancellationToken& cancellation,
+        PipelineStats* stats = nullptr,
+        VolumeStore* volume = nullptr) const
     {
-        return ""; // Return empty string if ";LAYER:xx" not found
+        if (workers)
+        {
+            // the pattern stays in the worker, there is nothing to keep in a volume
+            return converter->convert(
+                layer,
+                *profile,
+                nullptr,
+                [&]()
+                {
+                    return workers->convert(layer, profile->parameters(), cancellation, stats);
+                });
+        }
+        return converter->convert(layer, profile, cancellation, stats, volume);
     }
 
-    // Find the keyword ";TIME_ELAPSED:xxx.xxx" after ";LAYER:xx"
-    size_t timePos = input.find(";TIME_ELAPSED:", layerPos);
-    if (timePos == std::string::npos)
+    // The volume the layers of the slice are kept in, none when there is no volume directory or it cannot be written
+    std::shared_ptr<VolumeStore> volume(const std::string& uuid, const PrinterProfile& profile) const
     {
-        return ""; // Return empty string if ";TIME_ELAPSED:xxx.xxx" not found
+        if (! volumes)
+        {
+            return nullptr;
+        }
+        try
+        {
+            return volumes->open(uuid, profile);
+        }
+        catch (const std::exception& e)
+        {
+            static LogRateLimit volume_errors;
+            volume_errors.log(spdlog::level::warn, "Not keeping the rasterized layers of {}: {}", uuid, e.what());
+            return nullptr;
+        }
     }
 
-    // Extract the text between ";LAYER:xx" and ";TIME_ELAPSED:xxx.xxx"
-    return input.substr(layerPos, timePos - layerPos);
-}
-
-template<class T, class Rsp, class Req>
-struct Generate
-{
-    using service_t = std::shared_ptr<T>;
-    service_t generate_service{ std::make_shared<T>() };
-    Broadcast::shared_settings_t settings{ std::make_shared<Broadcast::settings_t>() };
-    std::shared_ptr<Metadata> metadata{ std::make_shared<Metadata>() };
-
     boost::asio::awaitable<void> run()
     {
+        // The messages of a call live on this arena. It is reset once the call is finished, which frees the
+        // layer and the generated g-code but keeps the initial block, so the next call allocates no messages.
+        alignas(8) std::array<char, ARENA_BLOCK_BYTES> arena_block;
+        google::protobuf::ArenaOptions arena_options;
+        arena_options.initial_block = arena_block.data();
+        arena_options.initial_block_size = arena_block.size();
+        google::protobuf::Arena arena{ arena_options };
+
         while (true)
         {
-            grpc::ServerContext server_context;
+            // declared first so it runs after everything else of this iteration is gone
+            const ArenaReset arena_reset{ arena };
+
+            // shared with the done notification, which may arrive after this iteration ends
+            auto server_context = std::make_shared<grpc::ServerContext>();
 
-            cura::plugins::slots::postprocess::v0::modify::CallRequest request;
-            grpc::ServerAsyncResponseWriter<Rsp> writer{ &server_context };
-            co_await agrpc::request(&T::RequestCall, *generate_service, server_context, request, writer, boost::asio::use_awaitable);
+            // CuraEngine cancels its calls when the slice is restarted, stop working on them as soon as possible and
+            // give up their place in the admission queue
+            const auto cancellation = CancellationToken::create();
+            const auto ticket = Admission::ticket();
+            auto& grpc_context = static_cast<agrpc::GrpcContext&>(boost::asio::query(co_await boost::asio::this_coro::executor, boost::asio::execution::context));
+            agrpc::notify_when_done(
+                grpc_context,
+                *server_context,
+                [server_context, cancellation, admission = admission, ticket]()
+                {
+                    if (server_context->IsCancelled())
+                    {
+                        cancellation.cancel();
+                        admission->withdraw(ticket);
+                    }
+                });
 
-            Rsp response;
-            auto client_metadata = getUuid(server_context);
+            auto& request = *google::protobuf::Arena::CreateMessage<Req>(&arena);
+            grpc::ServerAsyncResponseWriter<Rsp> writer{ server_context.get() };
+            co_await agrpc::request(&T::RequestCall, *generate_service, *server_context, request, writer, boost::asio::use_awaitable);
+            if (capture)
+            {
+                capture->record(CapturedRequest::CALL, *server_context, request);
+            }
+
+            auto& response = *google::protobuf::Arena::CreateMessage<Rsp>(&arena);
+            auto client_metadata = getUuid(*server_context);
             const auto& layer = request.gcode_word();
+            const auto printer = profile(client_metadata);
+            if (! printer)
+            {
+                static LogRateLimit forgotten;
+                forgotten.log(spdlog::level::warn, "The settings of slice {} are no longer kept, raise --session-ttl or --max-sessions", client_metadata);
+                co_await agrpc::finish_with_error(
+                    writer,
+                    grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "The settings of this slice are no longer kept, slice again"),
+                    boost::asio::use_awaitable);
+                continue;
+            }
+            transfer_stats->recordRequest(layer.size());
+
+            // calls interleave on this thread, so their spans go on a track of their own
+            const auto traced = Tracer::enabled();
+            const auto call_id = traced ? Tracer::next_id() : 0;
+            const auto layer_nr = traced ? find_layer_nr(layer) : -1;
+            const TraceSpan call_span("call", "rpc", layer_nr, call_id);
+
+            // held until the response is written, the output lives as long as the call
+            const auto arrived = std::chrono::steady_clock::now();
+            const auto permit = co_await admission->acquire(conversionBytes(layer, *printer), ticket);
+            const auto admitted = std::chrono::steady_clock::now();
+            if (traced)
+            {
+                Tracer::instance().record("admission", "rpc", arrived, admitted, layer_nr, call_id);
+            }
+            if (cancellation.is_cancelled())
+            {
+                spdlog::debug("Layer call was cancelled while it waited to be converted");
+                co_await agrpc::finish_with_error(writer, grpc::Status::CANCELLED, boost::asio::use_awaitable);
+                continue;
+            }
+            if (! permit.has_value())
+            {
+                const auto stats = admission->stats();
+                static LogRateLimit rejections;
+                rejections.log(spdlog::level::warn, "Rejected layer of {} bytes, {} conversions running and {} waiting", layer.size(), stats.active, stats.queue_depth);
+                co_await agrpc::finish_with_error(
+                    writer,
+                    grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Too many layers are being converted, retry later"),
+                    boost::asio::use_awaitable);
+                continue;
+            }
 
             grpc::Status status = grpc::Status::OK;
+            PipelineStats stats;
+            const auto queued = admitted;
+            auto started = queued;
             try
             {
-                std::string last_layer = get_last_layer(layer);
-                response.set_gcode_word(filterLines(layer));
+                // Hand the CPU-bound conversion to the compute pool, the coroutine resumes on its GrpcContext once it is done
+                auto gcode = co_await boost::asio::co_spawn(
+                    compute_pool->get_executor(),
+                    [&]() -> boost::asio::awaitable<std::string>
+                    {
+                        started = std::chrono::steady_clock::now();
+                        const AllocationScope allocations;
+                        const auto kept = volume(client_metadata, *printer);
+                        auto converted = convert(layer, printer, cancellation, metrics ? &stats : nullptr, kept.get());
+                        transfer_stats->recordResponse(converted, transfer.compresses(converted.size()));
+                        stats.allocations += allocations.counted(); // a worker process counts its own
+                        co_return converted;
+                    },
+                    boost::asio::use_awaitable);
+                const auto finished = std::chrono::steady_clock::now();
+                if (traced)
+                {
+                    Tracer::instance().record("compute_pool_wait", "rpc", queued, started, layer_nr, call_id);
+                    Tracer::instance().record("compute", "rpc", started, finished, layer_nr, call_id);
+                }
+                spdlog::debug(
+                    "Converted layer in {} us after waiting {} us for the compute pool",
+                    std::chrono::duration_cast<std::chrono::microseconds>(finished - started).count(),
+                    std::chrono::duration_cast<std::chrono::microseconds>(started - queued).count());
+                if constexpr (AllocationTracker::enabled())
+                {
+                    spdlog::debug(
+                        "Layer made {} allocations of {} bytes, at most {} bytes live, {} bytes live in the process",
+                        stats.allocations.allocations,
+                        stats.allocations.bytes,
+                        stats.allocations.peak_live_bytes,
+                        AllocationTracker::process_live_bytes());
+                }
+
+                transfer.apply(*server_context, gcode.size());
+                // takes over the buffer of the generated string, the g-code is never copied
+                response.set_gcode_word(std::move(gcode));
+            }
+            catch (const Cancelled&)
+            {
+                spdlog::debug("Abandoned the conversion of a cancelled layer call");
+                status = grpc::Status::CANCELLED;
             }
             catch (const std::exception& e)
             {
-                spdlog::error("Error: {}", e.what());
+                static LogRateLimit conversion_errors;
+                conversion_errors.log(spdlog::level::err, "Error: {}", e.what());
                 status = grpc::Status(grpc::StatusCode::INTERNAL, static_cast<std::string>(e.what()));
             }
 
@@ -161,9 +373,33 @@ struct Generate
                 co_await agrpc::finish_with_error(writer, status, boost::asio::use_awaitable);
                 continue;
             }
+            // gRPC serializes the response while it sends it, so this is not a stage of the conversion
+            const auto writing = std::chrono::steady_clock::now();
             co_await agrpc::finish(writer, response, status, boost::asio::use_awaitable);
+            const auto written = std::chrono::steady_clock::now();
+            if (traced)
+            {
+                Tracer::instance().record("response_write", "rpc", writing, written, layer_nr, call_id);
+            }
+            if (metrics)
+            {
+                metrics->record(stats, admitted - arrived, started - queued, written - writing);
+            }
         }
     }
+
+private:
+    static constexpr std::size_t ARENA_BLOCK_BYTES = 4096; // both messages and their string headers fit easily
+
+    struct ArenaReset
+    {
+        google::protobuf::Arena& arena;
+
+        ~ArenaReset()
+        {
+            arena.Reset();
+        }
+    };
 };
 
 } // namespace plugin::onlyfans
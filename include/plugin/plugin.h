@@ -5,6 +5,8 @@
 #include "plugin/modify.h"
 #include "plugin/handshake.h"
 #include "plugin/metadata.h"
+#include "plugin/stats.h"
+#include "plugin/transfer.h"
 
 #include <agrpc/asio_grpc.hpp>
 #include <boost/asio/co_spawn.hpp>
@@ -14,10 +16,13 @@
 #include <grpcpp/server.h>
 #include <grpcpp/server_builder.h>
 
+#include <algorithm>
 #include <memory>
 #include <optional>
 #include <string_view>
+#include <thread>
 #include <utility>
+#include <vector>
 
 namespace plugin
 {
@@ -29,9 +34,24 @@ public:
     std::optional<Broadcast> broadcast;
     std::shared_ptr<Metadata> metadata{ std::make_shared<Metadata>() };
 
-    Plugin(std::string_view address, std::string_view port, std::shared_ptr<grpc::ServerCredentials> credentials)
+    /**
+     * @param threads - Number of threads serving calls, each runs its own GrpcContext and completion queue
+     * @param calls_per_thread - Number of outstanding calls each service keeps requested per GrpcContext
+     * */
+    Plugin(std::string_view address, std::string_view port, std::shared_ptr<grpc::ServerCredentials> credentials, std::size_t threads = 1, std::size_t calls_per_thread = 1)
+        : calls_per_context_{ std::max<std::size_t>(calls_per_thread, 1) }
     {
-        builder_.AddListeningPort(fmt::format("{}:{}", address, port.data()), std::move(credentials));
+        builder_.AddListeningPort(fmt::format("{}:{}", address, port.data()), std::move(credentials), &port_);
+        for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); ++i)
+        {
+            contexts_.emplace_back(std::make_unique<agrpc::GrpcContext>(builder_.AddCompletionQueue()));
+        }
+    }
+
+    // Message size limits apply to every service, call before start()
+    void setTransferOptions(const TransferOptions& options)
+    {
+        options.apply(builder_);
     }
 
     void addHandshakeService(Handshake&& service)
@@ -52,37 +72,85 @@ public:
         builder_.RegisterService(generate_.value().generate_service.get());
     }
 
+    void addStatsService(Stats&& service)
+    {
+        stats_ = std::move(service);
+        builder_.RegisterAsyncGenericService(stats_.value().stats_service.get());
+    }
+
     void start()
     {
         server_ = builder_.BuildAndStart();
     }
 
+    // The port the server listens on, picked by the system when the port given was 0. Valid after start(), 0 if binding failed.
+    [[nodiscard]] int port() const
+    {
+        return port_;
+    }
+
+    // Serves all contexts, the first one on the calling thread. Returns once every context is stopped.
     void run()
     {
-        boost::asio::co_spawn(context_, handshake_.run(), boost::asio::detached);
-        if (broadcast.has_value())
+        for (auto& context : contexts_)
         {
-            boost::asio::co_spawn(context_, broadcast.value().run(), boost::asio::detached);
+            for (std::size_t call = 0; call < calls_per_context_; ++call)
+            {
+                boost::asio::co_spawn(*context, handshake_.run(), boost::asio::detached);
+                if (broadcast.has_value())
+                {
+                    boost::asio::co_spawn(*context, broadcast.value().run(), boost::asio::detached);
+                }
+                if (generate_.has_value())
+                {
+                    boost::asio::co_spawn(*context, generate_.value().run(), boost::asio::detached);
+                }
+            }
+            if (stats_.has_value())
+            {
+                boost::asio::co_spawn(*context, stats_.value().run(), boost::asio::detached);
+            }
         }
-        if (generate_.has_value())
+        if (stats_.has_value())
+        {
+            boost::asio::co_spawn(*contexts_.front(), stats_.value().dump(), boost::asio::detached);
+        }
+
+        std::vector<std::thread> threads;
+        threads.reserve(contexts_.size() - 1);
+        for (auto context = std::next(contexts_.begin()); context != contexts_.end(); ++context)
         {
-            boost::asio::co_spawn(context_, generate_.value().run(), boost::asio::detached);
+            threads.emplace_back(
+                [&grpc_context = **context]
+                {
+                    grpc_context.run();
+                });
+        }
+        contexts_.front()->run();
+        for (auto& thread : threads)
+        {
+            thread.join();
         }
-        context_.run();
     }
 
     void stop()
     {
-        context_.stop();
+        for (auto& context : contexts_)
+        {
+            context->stop();
+        }
         server_->Shutdown();
     }
 
 private:
     grpc::ServerBuilder builder_{};
-    agrpc::GrpcContext context_{ builder_.AddCompletionQueue() };
+    std::size_t calls_per_context_{ 1 };
+    int port_{ 0 };
+    std::vector<std::unique_ptr<agrpc::GrpcContext>> contexts_;
     std::unique_ptr<grpc::Server> server_;
     Handshake handshake_;
     std::optional<G> generate_;
+    std::optional<Stats> stats_;
 };
 
 
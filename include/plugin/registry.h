@@ -0,0 +1,267 @@
+#ifndef PLUGIN_REGISTRY_H
+#define PLUGIN_REGISTRY_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace plugin
+{
+
+/**
+ * Read-copy-update registry of per-session values, keyed by cura-engine-uuid.
+ *
+ * Readers never lock: every thread keeps the snapshot it last used and only
+ * touches shared state again when the published version moves on. Checking
+ * that is a single atomic load of a cache line only writers ever write to.
+ * Writers copy the current snapshot, apply their change and publish the copy.
+ * Sessions that were not used for longer than the TTL are no longer found and
+ * are dropped on the next write, the least recently used ones are evicted
+ * beyond max_sessions. The last dropped uuids are remembered, so a session
+ * that is gone can be told apart from one that was never published.
+ * */
+template<class T>
+class SessionRegistry
+{
+public:
+    struct Limits
+    {
+        std::chrono::seconds ttl{ 3600 };
+        std::size_t max_sessions{ 16 }; // at least 1
+    };
+
+    explicit SessionRegistry(Limits limits = {})
+        : limits_{ limits.ttl, std::max<std::size_t>(limits.max_sessions, 1) }
+        , current_{ std::make_shared<const Snapshot>() }
+    {
+    }
+
+    // The value of the session, or nullptr if there is none. Keeps the value alive for as long as the caller needs it.
+    std::shared_ptr<const T> find(std::string_view uuid) const
+    {
+        const auto* session = lookup(uuid);
+        return session == nullptr ? nullptr : session->value;
+    }
+
+    // Calls f with the value of the session without taking a reference, returns false if there is none.
+    // f must not call back into the registry.
+    template<class F>
+    bool visit(std::string_view uuid, F&& f) const
+    {
+        const auto* session = lookup(uuid);
+        if (session == nullptr)
+        {
+            return false;
+        }
+        std::forward<F>(f)(*session->value);
+        return true;
+    }
+
+    // True when the session was published but expired or was evicted since, false when it is found or never was
+    [[nodiscard]] bool forgotten(std::string_view uuid) const
+    {
+        const auto& current = snapshot();
+        if (current.sessions.contains(uuid))
+        {
+            return lookup(uuid) == nullptr;
+        }
+        return std::find(current.dropped.begin(), current.dropped.end(), uuid) != current.dropped.end();
+    }
+
+    void publish(std::string uuid, T value)
+    {
+        auto fresh = std::make_shared<Session>(std::make_shared<const T>(std::move(value)), now());
+
+        std::scoped_lock lock{ writer_ };
+        const auto current = current_.load(std::memory_order_acquire);
+        auto next = std::make_shared<Snapshot>();
+        next->version = current->version + 1;
+        next->sessions.reserve(current->sessions.size() + 1);
+        next->dropped = current->dropped;
+        std::erase(next->dropped, uuid);
+
+        const auto expired_before = now() - static_cast<std::int64_t>(limits_.ttl.count());
+        for (const auto& [key, session] : current->sessions)
+        {
+            if (key == uuid)
+            {
+                continue;
+            }
+            if (session->last_used.load(std::memory_order_relaxed) >= expired_before)
+            {
+                next->sessions.emplace(key, session);
+            }
+            else
+            {
+                drop(*next, key);
+            }
+        }
+        evict(*next, limits_.max_sessions - 1);
+        next->sessions.insert_or_assign(std::move(uuid), std::move(fresh));
+
+        current_.store(std::move(next), std::memory_order_release);
+        version_.fetch_add(1, std::memory_order_release);
+    }
+
+    void erase(std::string_view uuid)
+    {
+        std::scoped_lock lock{ writer_ };
+        const auto current = current_.load(std::memory_order_acquire);
+        auto next = std::make_shared<Snapshot>(*current);
+        next->version = current->version + 1;
+        const auto session = next->sessions.find(uuid);
+        if (session != next->sessions.end())
+        {
+            next->sessions.erase(session);
+        }
+        current_.store(std::move(next), std::memory_order_release);
+        version_.fetch_add(1, std::memory_order_release);
+    }
+
+    [[nodiscard]] std::size_t size() const
+    {
+        return snapshot().sessions.size();
+    }
+
+    [[nodiscard]] std::uint64_t version() const
+    {
+        return version_.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Session
+    {
+        Session(std::shared_ptr<const T> value, std::int64_t used)
+            : value{ std::move(value) }
+            , last_used{ used }
+        {
+        }
+
+        std::shared_ptr<const T> value;
+        mutable std::atomic<std::int64_t> last_used; // seconds, shared by every snapshot holding the session
+    };
+
+    // transparent, so sessions can be looked up by string_view without allocating
+    struct UuidHash
+    {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view uuid) const
+        {
+            return std::hash<std::string_view>{}(uuid);
+        }
+    };
+
+    struct Snapshot
+    {
+        std::uint64_t version{ 0 };
+        std::unordered_map<std::string, std::shared_ptr<Session>, UuidHash, std::equal_to<>> sessions;
+        std::vector<std::string> dropped; // expired or evicted, oldest first
+    };
+
+    static constexpr std::size_t MAX_DROPPED = 64;
+
+    // Coarse clock, so the last use of a session is written at most once per second
+    static std::int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static std::uint64_t nextId()
+    {
+        static std::atomic<std::uint64_t> ids{ 0 };
+        return ++ids;
+    }
+
+    const Snapshot& snapshot() const
+    {
+        struct Cached
+        {
+            std::uint64_t registry{ 0 };
+            std::uint64_t version{ 0 };
+            std::shared_ptr<const Snapshot> snapshot;
+        };
+        thread_local Cached cached;
+
+        const auto version = version_.load(std::memory_order_acquire);
+        if (cached.registry != id_ || cached.version != version || ! cached.snapshot)
+        {
+            cached.snapshot = current_.load(std::memory_order_acquire);
+            cached.registry = id_;
+            cached.version = version;
+        }
+        return *cached.snapshot;
+    }
+
+    const Session* lookup(std::string_view uuid) const
+    {
+        const auto& sessions = snapshot().sessions;
+        const auto session = sessions.find(uuid);
+        if (session == sessions.end())
+        {
+            return nullptr;
+        }
+        // an expired session stays in the snapshot until the next write, but is gone for readers already
+        const auto used = now();
+        const auto last_used = session->second->last_used.load(std::memory_order_relaxed);
+        if (last_used < used - static_cast<std::int64_t>(limits_.ttl.count()))
+        {
+            return nullptr;
+        }
+        if (last_used != used)
+        {
+            session->second->last_used.store(used, std::memory_order_relaxed);
+        }
+        return session->second.get();
+    }
+
+    // evicts the least recently used sessions until at most max_sessions are left
+    static void evict(Snapshot& snapshot, std::size_t max_sessions)
+    {
+        if (snapshot.sessions.size() <= max_sessions)
+        {
+            return;
+        }
+        std::vector<std::pair<std::int64_t, std::string>> by_use;
+        by_use.reserve(snapshot.sessions.size());
+        for (const auto& [key, session] : snapshot.sessions)
+        {
+            by_use.emplace_back(session->last_used.load(std::memory_order_relaxed), key);
+        }
+        std::sort(by_use.begin(), by_use.end());
+        for (std::size_t i = 0; snapshot.sessions.size() > max_sessions; ++i)
+        {
+            snapshot.sessions.erase(by_use[i].second);
+            drop(snapshot, by_use[i].second);
+        }
+    }
+
+    static void drop(Snapshot& snapshot, const std::string& uuid)
+    {
+        if (snapshot.dropped.size() == MAX_DROPPED)
+        {
+            snapshot.dropped.erase(snapshot.dropped.begin());
+        }
+        snapshot.dropped.push_back(uuid);
+    }
+
+    const std::uint64_t id_{ nextId() };
+    const Limits limits_;
+    std::atomic<std::shared_ptr<const Snapshot>> current_;
+    std::atomic<std::uint64_t> version_{ 0 };
+    std::mutex writer_;
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_REGISTRY_H
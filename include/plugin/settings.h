@@ -3,7 +3,9 @@
 
 #include "cura/plugins/slots/broadcast/v0/broadcast.grpc.pb.h"
 #include "cura/plugins/slots/handshake/v0/handshake.grpc.pb.h"
+#include "plugin/logging.h"
 #include "plugin/metadata.h"
+#include "processor/profile.h"
 
 #include <range/v3/all.hpp>
 
@@ -14,6 +16,7 @@
 #include <optional>
 #include <semver.hpp>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
 namespace plugin
@@ -23,6 +26,8 @@ struct Settings
 {
     std::shared_ptr<Metadata> metadata;
     std::vector<bool> onlyfans_enabled;
+    std::shared_ptr<const PrinterProfile> profile{ PrinterProfile::defaults() }; // built once per slice, shared by all its layer calls
+    std::optional<spdlog::level::level_enum> log_level; // applies to the whole plugin, not just this slice
 
     explicit Settings(const cura::plugins::slots::broadcast::v0::BroadcastServiceSettingsRequest& request, const std::shared_ptr<Metadata>& metadata)
         : metadata{ metadata }
@@ -35,6 +40,17 @@ struct Settings
             throw std::runtime_error(fmt::format("Global Settings: <onlyfans_enabled: {}>",
                                                  onlyfans_enabled_setting.has_value()));
         }
+
+        profile = std::make_shared<const PrinterProfile>(PrinterParameters::from_settings(
+            [&request, &metadata](std::string_view key)
+            {
+                return retrieveSettings(std::string{ key }, request, metadata);
+            }));
+
+        if (const auto level = retrieveSettings("onlyfans_log_level", request, metadata); level.has_value())
+        {
+            log_level = parseLogLevel(*level);
+        }
     }
 
     [[maybe_unused]] static std::optional<std::string> retrieveSettings(const std::string& settings_key, const cura::plugins::slots::broadcast::v0::Settings& settings, const auto& metadata)
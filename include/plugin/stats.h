@@ -0,0 +1,204 @@
+#ifndef PLUGIN_STATS_H
+#define PLUGIN_STATS_H
+
+#include <agrpc/asio_grpc.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/execution/context.hpp>
+#include <boost/asio/query.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <google/protobuf/wrappers.pb.h>
+#include <grpcpp/generic/async_generic_service.h>
+#include <grpcpp/support/byte_buffer.h>
+#include <spdlog/spdlog.h>
+
+#if __has_include(<coroutine>)
+#include <coroutine>
+#elif __has_include(<experimental/coroutine>)
+#include <experimental/coroutine>
+#define USE_EXPERIMENTAL_COROUTINE
+#endif
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <processor/allocations.h>
+#include <processor/metrics.h>
+#include <processor/trace.h>
+
+namespace plugin
+{
+
+// The metrics of the layer conversions, registered once and updated lock-free by every call
+struct ConversionMetrics
+{
+    explicit ConversionMetrics(MetricsRegistry& registry)
+        : layers{ registry.counter("onlyfans_layers_total", "Layers converted, cache hits excluded") }
+        , lines{ registry.counter("onlyfans_lines_total", "G-code lines read from converted layers") }
+        , lines_per_second{ registry.histogram("onlyfans_layer_lines_per_second", "Lines split, parsed and rasterized per second of a layer") }
+        , spray_lines{ registry.histogram("onlyfans_layer_spray_lines", "Spray lines added to the pattern of a layer") }
+        , output_bytes{ registry.histogram("onlyfans_layer_output_bytes", "Size of the g-code generated for a layer") }
+        , occupancy{ registry.histogram("onlyfans_layer_pattern_occupancy", "Fraction of the valve bits of a layer that are open", 1e-4) }
+        , admission_wait{ registry.histogram("onlyfans_admission_wait_seconds", "Time a layer waited for the conversion limits", 1e-9) }
+        , pool_wait{ registry.histogram("onlyfans_compute_pool_wait_seconds", "Time a layer waited for a compute thread", 1e-9) }
+        , response_write{ registry.histogram("onlyfans_response_write_seconds", "Time gRPC took to serialize and send a converted layer, the network included", 1e-9) }
+    {
+        for (size_t stage = 0; stage < PipelineStats::STAGES; stage++)
+        {
+            stages[stage] = &registry.histogram(
+                "onlyfans_stage_seconds",
+                "Time spent in each stage of a layer conversion",
+                1e-9,
+                std::format("stage=\"{}\"", PipelineStats::STAGE_NAMES[stage]));
+        }
+        if constexpr (AllocationTracker::enabled())
+        {
+            allocations = &registry.histogram("onlyfans_layer_allocations", "Heap allocations made to convert a layer");
+            allocated_bytes = &registry.histogram("onlyfans_layer_allocated_bytes", "Bytes allocated on the heap to convert a layer");
+            peak_live_bytes = &registry.histogram("onlyfans_layer_peak_live_bytes", "Most heap bytes a layer conversion held at once");
+            for (size_t stage = 0; stage < PipelineStats::STAGES; stage++)
+            {
+                stage_allocations[stage] = &registry.histogram(
+                    "onlyfans_stage_allocations",
+                    "Heap allocations made in each stage of a layer conversion",
+                    1.0,
+                    std::format("stage=\"{}\"", PipelineStats::STAGE_NAMES[stage]));
+            }
+        }
+    }
+
+    void record(const PipelineStats& stats, std::chrono::nanoseconds admission_waited, std::chrono::nanoseconds pool_waited, std::chrono::nanoseconds written)
+    {
+        admission_wait.record(admission_waited.count());
+        pool_wait.record(pool_waited.count());
+        response_write.record(written.count());
+        if (! stats.converted)
+        {
+            return;
+        }
+
+        for (size_t stage = 0; stage < PipelineStats::STAGES; stage++)
+        {
+            stages[stage]->record(stats.durations[stage].count());
+        }
+        layers.add();
+        lines.add(stats.lines);
+        const auto reading = stats.durations[PipelineStats::SPLIT] + stats.durations[PipelineStats::PARSE];
+        if (reading.count() > 0)
+        {
+            lines_per_second.record(static_cast<std::uint64_t>(static_cast<double>(stats.lines) * 1e9 / static_cast<double>(reading.count())));
+        }
+        spray_lines.record(stats.spray_lines);
+        output_bytes.record(stats.output_bytes);
+        if (stats.valve_bits > 0)
+        {
+            occupancy.record(stats.open_valve_bits * 10000 / stats.valve_bits);
+        }
+        if (allocations != nullptr)
+        {
+            allocations->record(stats.allocations.allocations);
+            allocated_bytes->record(stats.allocations.bytes);
+            peak_live_bytes->record(static_cast<std::uint64_t>(std::max<std::int64_t>(stats.allocations.peak_live_bytes, 0)));
+            for (size_t stage = 0; stage < PipelineStats::STAGES; stage++)
+            {
+                stage_allocations[stage]->record(stats.stage_allocations[stage].allocations);
+            }
+        }
+    }
+
+    Counter& layers;
+    Counter& lines;
+    Histogram& lines_per_second;
+    Histogram& spray_lines;
+    Histogram& output_bytes;
+    Histogram& occupancy; // in units of 0.01%
+    Histogram& admission_wait;
+    Histogram& pool_wait;
+    Histogram& response_write;
+    std::array<Histogram*, PipelineStats::STAGES> stages{};
+
+    // only registered in instrumentation builds, see AllocationTracker
+    Histogram* allocations = nullptr;
+    Histogram* allocated_bytes = nullptr;
+    Histogram* peak_live_bytes = nullptr;
+    std::array<Histogram*, PipelineStats::STAGES> stage_allocations{};
+};
+
+/**
+ * Serves the metrics in the Prometheus text format over gRPC.
+ *
+ * CuraEngine's definitions have no stats service, so this one is generic: the
+ * unary method METHOD takes any request and answers with a serialized
+ * google.protobuf.StringValue, every other method is UNIMPLEMENTED. When a
+ * file is set, the metrics are also written there every interval for a
+ * node exporter or similar to pick up. The trace file, if any, is rewritten
+ * on the same interval.
+ * */
+struct Stats
+{
+    static constexpr std::string_view METHOD = "/onlyfans.v0.StatsService/GetMetrics";
+
+    std::shared_ptr<grpc::AsyncGenericService> stats_service{ std::make_shared<grpc::AsyncGenericService>() };
+    std::shared_ptr<MetricsRegistry> registry{ std::make_shared<MetricsRegistry>() };
+    std::filesystem::path file;
+    std::filesystem::path trace_file; // only written while the Tracer is enabled
+    std::chrono::seconds interval{ 10 };
+
+    boost::asio::awaitable<void> run()
+    {
+        while (true)
+        {
+            grpc::GenericServerContext server_context;
+            grpc::GenericServerAsyncReaderWriter reader_writer{ &server_context };
+            co_await agrpc::request(*stats_service, server_context, reader_writer, boost::asio::use_awaitable);
+
+            grpc::ByteBuffer request;
+            co_await agrpc::read(reader_writer, request, boost::asio::use_awaitable);
+            if (server_context.method() != METHOD)
+            {
+                co_await agrpc::finish(reader_writer, grpc::Status(grpc::StatusCode::UNIMPLEMENTED, "Unknown method " + server_context.method()), boost::asio::use_awaitable);
+                continue;
+            }
+
+            google::protobuf::StringValue response;
+            response.set_value(registry->prometheus());
+            grpc::Slice slice{ response.SerializeAsString() };
+            const grpc::ByteBuffer buffer{ &slice, 1 };
+            co_await agrpc::write_and_finish(reader_writer, buffer, grpc::WriteOptions{}, grpc::Status::OK, boost::asio::use_awaitable);
+        }
+    }
+
+    // Writes the metrics and trace files every interval, returns right away without either
+    boost::asio::awaitable<void> dump()
+    {
+        const bool tracing = ! trace_file.empty() && Tracer::enabled();
+        if (file.empty() && ! tracing)
+        {
+            co_return;
+        }
+        auto& grpc_context = static_cast<agrpc::GrpcContext&>(boost::asio::query(co_await boost::asio::this_coro::executor, boost::asio::execution::context));
+        agrpc::Alarm alarm{ grpc_context };
+        while (true)
+        {
+            co_await alarm.wait(std::chrono::system_clock::now() + interval, boost::asio::use_awaitable);
+            if (! file.empty() && ! registry->write_prometheus(file))
+            {
+                spdlog::warn("Could not write the metrics to {}", file.string());
+            }
+            if (tracing && ! Tracer::instance().write(trace_file))
+            {
+                spdlog::warn("Could not write the trace to {}", trace_file.string());
+            }
+        }
+    }
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_STATS_H
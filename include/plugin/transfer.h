@@ -0,0 +1,193 @@
+#ifndef PLUGIN_TRANSFER_H
+#define PLUGIN_TRANSFER_H
+
+#include <grpc/compression.h>
+#include <grpcpp/server_builder.h>
+#include <grpcpp/server_context.h>
+#include <spdlog/spdlog.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace plugin
+{
+
+// How large messages may get and how responses are compressed on the wire
+struct TransferOptions
+{
+    std::size_t max_message_bytes{ 0 }; // for requests and responses, 0 keeps the gRPC defaults (4 MB received)
+    grpc_compression_algorithm compression{ GRPC_COMPRESS_NONE };
+    std::size_t compress_min_bytes{ 64 * 1024 }; // smaller responses are not worth compressing
+
+    static grpc_compression_algorithm parseAlgorithm(std::string_view name)
+    {
+        if (name == "none")
+        {
+            return GRPC_COMPRESS_NONE;
+        }
+        if (name == "gzip")
+        {
+            return GRPC_COMPRESS_GZIP;
+        }
+        if (name == "deflate")
+        {
+            return GRPC_COMPRESS_DEFLATE;
+        }
+        throw std::invalid_argument("Unknown compression '" + std::string{ name } + "', use none, gzip or deflate");
+    }
+
+    void apply(grpc::ServerBuilder& builder) const
+    {
+        if (max_message_bytes > 0)
+        {
+            const auto limit = static_cast<int>(std::min<std::size_t>(max_message_bytes, INT_MAX));
+            builder.SetMaxReceiveMessageSize(limit);
+            builder.SetMaxSendMessageSize(limit);
+        }
+    }
+
+    bool compresses(std::size_t response_bytes) const
+    {
+        return compression != GRPC_COMPRESS_NONE && response_bytes >= compress_min_bytes;
+    }
+
+    // Sets the compression of one response, gRPC sends it uncompressed when the client does not accept the algorithm
+    void apply(grpc::ServerContext& context, std::size_t response_bytes) const
+    {
+        context.set_compression_algorithm(compresses(response_bytes) ? compression : GRPC_COMPRESS_NONE);
+    }
+};
+
+/**
+ * Bytes received and sent by the generate service.
+ *
+ * gRPC compresses inside its transport and does not report the result, so the
+ * compressed size can only be estimated: when sample_every is set, every
+ * sample_every-th compressed response is deflated once more here and the ratio
+ * of those samples is applied to all compressed bytes. That costs a core, so
+ * it is off by default. Members are safe to call from several threads.
+ * */
+class TransferStats
+{
+public:
+    struct Snapshot
+    {
+        std::uint64_t requests{ 0 };
+        std::uint64_t request_bytes{ 0 };
+        std::uint64_t responses{ 0 };
+        std::uint64_t response_bytes{ 0 };
+        std::uint64_t compressed_responses{ 0 };
+        std::uint64_t compressed_raw_bytes{ 0 }; // raw size of the responses that were compressed
+        std::uint64_t estimated_compressed_bytes{ 0 };
+    };
+
+    explicit TransferStats(std::uint64_t sample_every = 0)
+        : sample_every_{ sample_every }
+    {
+    }
+
+    // whether the compressed size is estimated at all
+    [[nodiscard]] bool estimates() const
+    {
+        return sample_every_ > 0;
+    }
+
+    void recordRequest(std::size_t bytes)
+    {
+        requests_.fetch_add(1, std::memory_order_relaxed);
+        request_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    // call off the event loop when estimating, a sampled response is deflated here
+    void recordResponse(std::string_view payload, bool compressed)
+    {
+        responses_.fetch_add(1, std::memory_order_relaxed);
+        response_bytes_.fetch_add(payload.size(), std::memory_order_relaxed);
+        if (! compressed)
+        {
+            return;
+        }
+        compressed_raw_bytes_.fetch_add(payload.size(), std::memory_order_relaxed);
+        const auto response = compressed_responses_.fetch_add(1, std::memory_order_relaxed);
+        if (! estimates() || response % sample_every_ != 0)
+        {
+            return;
+        }
+        const auto deflated = deflatedSize(payload);
+        if (deflated == 0)
+        {
+            return;
+        }
+        sampled_raw_bytes_.fetch_add(payload.size(), std::memory_order_relaxed);
+        sampled_compressed_bytes_.fetch_add(deflated, std::memory_order_relaxed);
+        spdlog::debug("Response of {} bytes compresses to about {} bytes", payload.size(), deflated);
+    }
+
+    Snapshot snapshot() const
+    {
+        Snapshot snapshot{ .requests = requests_.load(std::memory_order_relaxed),
+                           .request_bytes = request_bytes_.load(std::memory_order_relaxed),
+                           .responses = responses_.load(std::memory_order_relaxed),
+                           .response_bytes = response_bytes_.load(std::memory_order_relaxed),
+                           .compressed_responses = compressed_responses_.load(std::memory_order_relaxed),
+                           .compressed_raw_bytes = compressed_raw_bytes_.load(std::memory_order_relaxed) };
+        const auto sampled_raw = sampled_raw_bytes_.load(std::memory_order_relaxed);
+        const auto sampled_compressed = sampled_compressed_bytes_.load(std::memory_order_relaxed);
+        if (sampled_raw > 0)
+        {
+            snapshot.estimated_compressed_bytes
+                = static_cast<std::uint64_t>(static_cast<double>(snapshot.compressed_raw_bytes) * static_cast<double>(sampled_compressed) / static_cast<double>(sampled_raw));
+        }
+        return snapshot;
+    }
+
+private:
+    // size of the payload after zlib deflate at the level gRPC uses, 0 if zlib failed
+    static std::size_t deflatedSize(std::string_view payload)
+    {
+        z_stream stream{};
+        if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+            return 0;
+        }
+        std::array<Bytef, 16 * 1024> chunk; // only the size of the output is needed, it is overwritten
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(payload.data()));
+        int result = Z_OK;
+        while (result == Z_OK)
+        {
+            // avail_in is 32 bits, feed large payloads in pieces
+            if (stream.avail_in == 0 && stream.total_in < payload.size())
+            {
+                stream.avail_in = static_cast<uInt>(std::min<std::size_t>(payload.size() - stream.total_in, UINT_MAX));
+            }
+            stream.next_out = chunk.data();
+            stream.avail_out = static_cast<uInt>(chunk.size());
+            result = deflate(&stream, stream.total_in + stream.avail_in < payload.size() ? Z_NO_FLUSH : Z_FINISH);
+        }
+        const auto size = result == Z_STREAM_END ? static_cast<std::size_t>(stream.total_out) : 0;
+        deflateEnd(&stream);
+        return size;
+    }
+
+    const std::uint64_t sample_every_;
+    std::atomic<std::uint64_t> requests_{ 0 };
+    std::atomic<std::uint64_t> request_bytes_{ 0 };
+    std::atomic<std::uint64_t> responses_{ 0 };
+    std::atomic<std::uint64_t> response_bytes_{ 0 };
+    std::atomic<std::uint64_t> compressed_responses_{ 0 };
+    std::atomic<std::uint64_t> compressed_raw_bytes_{ 0 };
+    std::atomic<std::uint64_t> sampled_raw_bytes_{ 0 };
+    std::atomic<std::uint64_t> sampled_compressed_bytes_{ 0 };
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_TRANSFER_H
@@ -0,0 +1,686 @@
+#ifndef PLUGIN_WORKERS_H
+#define PLUGIN_WORKERS_H
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <climits>
+#include <csignal>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+#include <processor/cancel.h>
+#include <processor/layer.h>
+#include <processor/metrics.h>
+#include <processor/profile.h>
+
+namespace plugin
+{
+
+struct WorkerStats
+{
+    std::size_t processes{ 0 };
+    std::size_t busy{ 0 }; // converting a layer
+    std::uint64_t restarts{ 0 };
+};
+
+#ifdef __linux__
+
+/**
+ * The shared memory between the plugin and one worker process, a memfd
+ * both map.
+ *
+ * The header holds a futex word with the state of the call. The plugin
+ * writes the printer parameters to the header and the layer behind it and
+ * sets REQUEST; the worker converts the layer where it is, writes the g-code
+ * after it and sets DONE. Whoever needs more room grows the memfd, the other
+ * side maps it again once it sees the larger capacity. The header has a
+ * mapping of its own that never moves, so the supervisor can mark a call
+ * of a crashed worker while the plugin waits for it.
+ * */
+class WorkerChannel
+{
+public:
+    enum State : std::uint32_t
+    {
+        IDLE,
+        REQUEST, // a layer waits for the worker
+        CONVERTING, // the worker took it
+        DONE, // the g-code is behind the layer
+        FAILED, // the conversion threw, the header holds the error
+        CANCELLED,
+        CRASHED, // the worker died while converting, set by the supervisor
+    };
+
+    struct Header
+    {
+        std::atomic<std::uint32_t> state{ IDLE };
+        std::atomic_bool cancelled{ false };
+        std::atomic<std::uint64_t> capacity{ 0 }; // bytes of the memfd
+        std::uint64_t request_bytes{ 0 };
+        std::uint64_t response_bytes{ 0 };
+        PrinterParameters parameters;
+        PipelineStats stats;
+        char error[512]{};
+    };
+
+    static constexpr std::size_t HEADER_BYTES = 4096; // the layer starts on the next page
+    static constexpr std::size_t INITIAL_CAPACITY = 16 * 1024 * 1024;
+
+    // a new channel, in the plugin
+    static WorkerChannel create(std::size_t capacity = INITIAL_CAPACITY)
+    {
+        int fd = memfd_create("onlyfans-worker", MFD_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "Could not create the shared memory of a worker");
+        }
+        // the worker gets the channel as a low descriptor, keep this one out of its way
+        if (const int moved = fcntl(fd, F_DUPFD_CLOEXEC, 16); moved >= 0)
+        {
+            close(fd);
+            fd = moved;
+        }
+        capacity = round_up(std::max(capacity, 2 * HEADER_BYTES), HEADER_BYTES);
+        if (ftruncate(fd, static_cast<off_t>(capacity)) != 0)
+        {
+            const auto error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), "Could not size the shared memory of a worker");
+        }
+        WorkerChannel channel{ fd };
+        ::new (static_cast<void*>(&channel.header())) Header{};
+        channel.header().capacity.store(capacity, std::memory_order_release);
+        channel.refresh();
+        return channel;
+    }
+
+    // the channel the plugin passed as fd, in the worker
+    explicit WorkerChannel(int fd)
+        : fd_{ fd }
+    {
+        void* header = mmap(nullptr, HEADER_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (header == MAP_FAILED)
+        {
+            const auto error = errno;
+            close(fd_);
+            throw std::system_error(error, std::generic_category(), "Could not map the shared memory of a worker");
+        }
+        static_assert(std::is_trivially_copyable_v<PrinterParameters> && std::is_trivially_copyable_v<PipelineStats>);
+        static_assert(std::atomic<std::uint32_t>::is_always_lock_free && sizeof(Header) <= HEADER_BYTES);
+        header_ = std::launder(reinterpret_cast<Header*>(header));
+        refresh();
+    }
+
+    WorkerChannel(WorkerChannel&& other) noexcept
+        : fd_{ std::exchange(other.fd_, -1) }
+        , header_{ std::exchange(other.header_, nullptr) }
+        , payload_{ std::exchange(other.payload_, nullptr) }
+        , mapped_{ std::exchange(other.mapped_, 0) }
+    {
+    }
+
+    WorkerChannel& operator=(WorkerChannel&&) = delete;
+    WorkerChannel(const WorkerChannel&) = delete;
+    WorkerChannel& operator=(const WorkerChannel&) = delete;
+
+    ~WorkerChannel()
+    {
+        if (payload_ != nullptr)
+        {
+            munmap(payload_, mapped_);
+        }
+        if (header_ != nullptr)
+        {
+            munmap(header_, HEADER_BYTES);
+        }
+        if (fd_ >= 0)
+        {
+            close(fd_);
+        }
+    }
+
+    [[nodiscard]] int fd() const
+    {
+        return fd_;
+    }
+
+    Header& header() const
+    {
+        return *header_;
+    }
+
+    // Has the worker convert the layer, in the plugin. Throws Cancelled when the token is cancelled before the
+    // worker is done, and std::runtime_error when the conversion failed, took longer than timeout or the worker died.
+    // A layer the worker did not take yet is withdrawn at once. A worker that does not stop converting a cancelled
+    // layer or one past its timeout is handed to stuck, which has to end it so the supervisor fails the call.
+    std::string call(
+        std::string_view layer,
+        const PrinterParameters& parameters,
+        const CancellationToken& cancellation = {},
+        PipelineStats* stats = nullptr,
+        std::chrono::milliseconds timeout = {},
+        const std::function<void()>& stuck = {})
+    {
+        reserve(layer.size());
+        auto& header = this->header();
+        header.parameters = parameters;
+        header.request_bytes = layer.size();
+        header.response_bytes = 0;
+        header.cancelled.store(false, std::memory_order_relaxed);
+        std::copy(layer.begin(), layer.end(), payload_);
+        header.state.store(REQUEST, std::memory_order_release);
+        wake(header.state);
+
+        const auto started = std::chrono::steady_clock::now();
+        std::optional<std::chrono::steady_clock::time_point> cancelled_at;
+        bool timed_out = false;
+        bool ended = false;
+        auto state = header.state.load(std::memory_order_acquire);
+        while (state == REQUEST || state == CONVERTING)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            if (! cancelled_at && cancellation.is_cancelled())
+            {
+                header.cancelled.store(true, std::memory_order_relaxed);
+                cancelled_at = now;
+            }
+            timed_out = timed_out || (timeout.count() > 0 && now - started >= timeout);
+            if (cancelled_at || timed_out)
+            {
+                auto requested = static_cast<std::uint32_t>(REQUEST);
+                if (header.state.compare_exchange_strong(requested, IDLE, std::memory_order_acq_rel))
+                {
+                    give_up(timed_out, timeout);
+                }
+                if (stuck && ! ended && (timed_out || now - *cancelled_at >= CANCEL_GRACE))
+                {
+                    spdlog::warn("A worker process is still converting a layer {}, ending it", timed_out ? "past its timeout" : "that was cancelled");
+                    stuck();
+                    ended = true;
+                }
+            }
+            wait(header.state, state, POLL_INTERVAL);
+            state = header.state.load(std::memory_order_acquire);
+        }
+
+        refresh();
+        std::string gcode;
+        std::string error;
+        if (state == DONE)
+        {
+            gcode.assign(payload_ + response_offset(header.request_bytes), header.response_bytes);
+            if (stats != nullptr)
+            {
+                *stats = header.stats;
+            }
+        }
+        else if (state == FAILED)
+        {
+            error.assign(header.error, strnlen(header.error, sizeof(header.error)));
+        }
+        header.state.store(IDLE, std::memory_order_release);
+
+        if (state == CANCELLED)
+        {
+            throw Cancelled();
+        }
+        if (state == CRASHED && ended)
+        {
+            give_up(timed_out, timeout);
+        }
+        if (state == CRASHED)
+        {
+            throw std::runtime_error("The worker process died while converting the layer");
+        }
+        if (state == FAILED)
+        {
+            throw std::runtime_error(error);
+        }
+        return gcode;
+    }
+
+    // Converts the layers of the plugin until running() turns false, in the worker
+    void serve(const std::function<bool()>& running)
+    {
+        auto& header = this->header();
+        std::shared_ptr<const PrinterProfile> profile;
+        while (running())
+        {
+            auto state = header.state.load(std::memory_order_acquire);
+            if (state != REQUEST || ! header.state.compare_exchange_strong(state, CONVERTING, std::memory_order_acq_rel))
+            {
+                wait(header.state, state, POLL_INTERVAL);
+                continue;
+            }
+
+            refresh();
+            auto result = DONE;
+            try
+            {
+                // compared as bytes, a difference in the padding only costs building the profile again
+                if (! profile || std::memcmp(&profile->parameters(), &header.parameters, sizeof(PrinterParameters)) != 0)
+                {
+                    profile = std::make_shared<const PrinterProfile>(header.parameters);
+                }
+                PipelineStats stats;
+                const auto gcode = filterLines(std::string_view{ payload_, header.request_bytes }, profile, CancellationToken::watching(header.cancelled), &stats);
+                const auto offset = response_offset(header.request_bytes);
+                reserve(offset + gcode.size());
+                std::copy(gcode.begin(), gcode.end(), payload_ + offset);
+                header.response_bytes = gcode.size();
+                header.stats = stats;
+            }
+            catch (const Cancelled&)
+            {
+                result = CANCELLED;
+            }
+            catch (const std::exception& e)
+            {
+                result = FAILED;
+                const std::string_view what = e.what();
+                const auto length = std::min(what.size(), sizeof(header.error) - 1);
+                std::copy_n(what.data(), length, header.error);
+                header.error[length] = '\0';
+            }
+            header.state.store(result, std::memory_order_release);
+            wake(header.state);
+        }
+    }
+
+    // Fails the call the worker was converting when it died, in the supervisor; a call it never took is left
+    // for the worker that replaces it
+    void abandon()
+    {
+        auto state = static_cast<std::uint32_t>(CONVERTING);
+        if (header().state.compare_exchange_strong(state, CRASHED, std::memory_order_acq_rel))
+        {
+            wake(header().state);
+        }
+    }
+
+private:
+    static constexpr auto POLL_INTERVAL = std::chrono::milliseconds{ 100 }; // how quickly a cancellation or a dead plugin is noticed
+    static constexpr auto CANCEL_GRACE = std::chrono::seconds{ 1 }; // how long a worker may take to stop converting a cancelled layer
+
+    [[noreturn]] static void give_up(bool timed_out, std::chrono::milliseconds timeout)
+    {
+        if (timed_out)
+        {
+            throw std::runtime_error(fmt::format("The worker process took longer than {} ms to convert the layer", timeout.count()));
+        }
+        throw Cancelled();
+    }
+
+    static std::size_t round_up(std::size_t bytes, std::size_t multiple)
+    {
+        return (bytes + multiple - 1) / multiple * multiple;
+    }
+
+    // the g-code starts behind the layer
+    static std::size_t response_offset(std::size_t request_bytes)
+    {
+        return round_up(request_bytes, 64);
+    }
+
+    static void wait(std::atomic<std::uint32_t>& word, std::uint32_t expected, std::chrono::milliseconds timeout)
+    {
+        const timespec time{ .tv_sec = static_cast<time_t>(timeout.count() / 1000), .tv_nsec = static_cast<long>(timeout.count() % 1000) * 1000000 };
+        // not FUTEX_PRIVATE_FLAG, the other side is another process
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT, expected, &time, nullptr, 0);
+    }
+
+    static void wake(std::atomic<std::uint32_t>& word)
+    {
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    // makes room for bytes behind the header, growing the memfd when needed
+    void reserve(std::size_t bytes)
+    {
+        const auto needed = HEADER_BYTES + round_up(bytes, HEADER_BYTES);
+        const auto capacity = header().capacity.load(std::memory_order_acquire);
+        if (needed > capacity)
+        {
+            const auto grown = std::max(needed, 2 * capacity);
+            if (ftruncate(fd_, static_cast<off_t>(grown)) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "Could not grow the shared memory of a worker");
+            }
+            header().capacity.store(grown, std::memory_order_release);
+        }
+        refresh();
+    }
+
+    // maps the payload again when the other side grew the memfd
+    void refresh()
+    {
+        const auto capacity = header().capacity.load(std::memory_order_acquire);
+        if (capacity <= HEADER_BYTES + mapped_)
+        {
+            return;
+        }
+        const auto bytes = capacity - HEADER_BYTES;
+        void* payload = payload_ == nullptr ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, HEADER_BYTES) : mremap(payload_, mapped_, bytes, MREMAP_MAYMOVE);
+        if (payload == MAP_FAILED)
+        {
+            throw std::system_error(errno, std::generic_category(), "Could not map the shared memory of a worker");
+        }
+        payload_ = static_cast<char*>(payload);
+        mapped_ = bytes;
+    }
+
+    int fd_{ -1 };
+    Header* header_{ nullptr };
+    char* payload_{ nullptr };
+    std::size_t mapped_{ 0 };
+};
+
+/**
+ * Converts the layers in worker processes instead of in the plugin.
+ *
+ * The plugin then only runs the gRPC services, which keep answering while
+ * the workers are busy, and a crash or the allocator of one worker no longer
+ * affects the other layers. Every worker is this executable started again
+ * with --worker-fd, on a channel of its own. A supervisor thread starts a
+ * new worker when one exits; the layer it was converting fails. A worker
+ * that exits within a second of starting is only replaced after a second.
+ * A worker still converting a layer past the timeout, or a second after the
+ * layer was cancelled, is killed and replaced the same way.
+ * */
+class WorkerPool
+{
+public:
+    static constexpr int WORKER_FD = 3; // the channel in the worker
+
+    // arguments are passed on to every worker, after --worker-fd; a timeout of 0 lets a layer take as long as it takes
+    WorkerPool(std::size_t processes, std::chrono::milliseconds timeout = {}, std::vector<std::string> arguments = {}, std::filesystem::path executable = "/proc/self/exe")
+        : timeout_{ timeout }
+        , executable_{ std::move(executable) }
+        , arguments_{ std::move(arguments) }
+    {
+        for (std::size_t n = 0; n < std::max<std::size_t>(processes, 1); n++)
+        {
+            auto worker = std::make_unique<Worker>(WorkerChannel::create());
+            spawn(*worker);
+            workers_.push_back(std::move(worker));
+        }
+        supervisor_ = std::thread{ [this]()
+                                   {
+                                       supervise();
+                                   } };
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool()
+    {
+        {
+            std::scoped_lock lock{ mutex_ };
+            stop_ = true;
+        }
+        stopping_.notify_all();
+        supervisor_.join();
+        for (auto& worker : workers_)
+        {
+            if (worker->pid > 0)
+            {
+                kill(worker->pid, SIGTERM);
+                waitpid(worker->pid, nullptr, 0);
+            }
+        }
+    }
+
+    // Converts the layer on the first idle worker, waits for one when all are busy
+    std::string convert(std::string_view layer, const PrinterParameters& parameters, const CancellationToken& cancellation = {}, PipelineStats* stats = nullptr)
+    {
+        Worker* worker = nullptr;
+        {
+            std::unique_lock lock{ mutex_ };
+            idle_.wait(
+                lock,
+                [this, &worker]()
+                {
+                    const auto found = std::find_if(
+                        workers_.begin(),
+                        workers_.end(),
+                        [](const auto& candidate)
+                        {
+                            return ! candidate->busy;
+                        });
+                    worker = found == workers_.end() ? nullptr : found->get();
+                    return worker != nullptr;
+                });
+            worker->busy = true;
+        }
+        const auto release = [this, worker]()
+        {
+            {
+                std::scoped_lock lock{ mutex_ };
+                worker->busy = false;
+            }
+            idle_.notify_one();
+        };
+        // SIGKILL, a worker stuck in a conversion may not get to a SIGTERM handler; the supervisor replaces it
+        const auto end = [this, worker]()
+        {
+            std::scoped_lock lock{ mutex_ };
+            if (worker->pid > 0)
+            {
+                kill(worker->pid, SIGKILL);
+            }
+        };
+        try
+        {
+            auto gcode = worker->channel.call(layer, parameters, cancellation, stats, timeout_, end);
+            release();
+            return gcode;
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+    }
+
+    [[nodiscard]] WorkerStats stats() const
+    {
+        std::scoped_lock lock{ mutex_ };
+        WorkerStats stats{ .processes = workers_.size(), .restarts = restarts_ };
+        stats.busy = static_cast<std::size_t>(std::count_if(
+            workers_.begin(),
+            workers_.end(),
+            [](const auto& worker)
+            {
+                return worker->busy;
+            }));
+        return stats;
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+    static constexpr auto SUPERVISE_INTERVAL = std::chrono::milliseconds{ 100 };
+    static constexpr auto RESTART_DELAY = std::chrono::seconds{ 1 };
+
+    struct Worker
+    {
+        explicit Worker(WorkerChannel&& created)
+            : channel{ std::move(created) }
+        {
+        }
+
+        WorkerChannel channel;
+        pid_t pid{ -1 };
+        bool busy{ false };
+        clock::time_point started{};
+        clock::time_point restart_at{};
+    };
+
+    void spawn(Worker& worker)
+    {
+        // the executable is started through /proc/self/exe, which stays this build even when it is replaced on disk
+        std::error_code error_code;
+        const auto name = std::filesystem::read_symlink(executable_, error_code);
+        std::vector<std::string> arguments{ error_code ? executable_.string() : name.string(), "--worker-fd=" + std::to_string(WORKER_FD) };
+        arguments.insert(arguments.end(), arguments_.begin(), arguments_.end());
+        std::vector<char*> argv;
+        for (auto& argument : arguments)
+        {
+            argv.push_back(argument.data());
+        }
+        argv.push_back(nullptr);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        // dup2 clears close-on-exec, the channel is the only descriptor the worker inherits
+        posix_spawn_file_actions_adddup2(&actions, worker.channel.fd(), WORKER_FD);
+        pid_t pid = -1;
+        const int error = posix_spawn(&pid, executable_.c_str(), &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if (error != 0)
+        {
+            throw std::system_error(error, std::generic_category(), "Could not start a worker process");
+        }
+        worker.pid = pid;
+        worker.started = clock::now();
+        spdlog::debug("Started worker process {}", pid);
+    }
+
+    void supervise()
+    {
+        std::unique_lock lock{ mutex_ };
+        while (! stopping_.wait_for(
+            lock,
+            SUPERVISE_INTERVAL,
+            [this]()
+            {
+                return stop_;
+            }))
+        {
+            const auto now = clock::now();
+            for (auto& worker : workers_)
+            {
+                int status = 0;
+                if (worker->pid > 0 && waitpid(worker->pid, &status, WNOHANG) == worker->pid)
+                {
+                    if (WIFSIGNALED(status))
+                    {
+                        spdlog::error("Worker process {} was killed by signal {}, starting another", worker->pid, WTERMSIG(status));
+                    }
+                    else
+                    {
+                        spdlog::error("Worker process {} exited with {}, starting another", worker->pid, WEXITSTATUS(status));
+                    }
+                    worker->pid = -1;
+                    worker->channel.abandon();
+                    worker->restart_at = now - worker->started < RESTART_DELAY ? now + RESTART_DELAY : now;
+                    ++restarts_;
+                }
+                if (worker->pid < 0 && now >= worker->restart_at)
+                {
+                    try
+                    {
+                        spawn(*worker);
+                    }
+                    catch (const std::exception& e)
+                    {
+                        spdlog::error("{}", e.what());
+                        worker->restart_at = now + RESTART_DELAY;
+                    }
+                }
+            }
+        }
+    }
+
+    std::chrono::milliseconds timeout_;
+    std::filesystem::path executable_;
+    std::vector<std::string> arguments_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    mutable std::mutex mutex_;
+    std::condition_variable idle_;
+    std::condition_variable stopping_;
+    bool stop_{ false };
+    std::uint64_t restarts_{ 0 };
+    std::thread supervisor_;
+};
+
+// The main of a worker process, converts layers on the channel passed as fd until the plugin is gone
+inline int runWorker(int fd)
+{
+    // ends the worker with the plugin, also when the plugin is killed
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    const auto plugin = getppid();
+    WorkerChannel channel{ fd };
+    spdlog::debug("Worker process {} is converting layers", getpid());
+    channel.serve(
+        [plugin]()
+        {
+            return getppid() == plugin;
+        });
+    return 0;
+}
+
+#else
+
+// Worker processes use memfd and futex, elsewhere every layer is converted in the plugin
+class WorkerPool
+{
+public:
+    explicit WorkerPool(std::size_t, std::chrono::milliseconds = {}, std::vector<std::string> = {}, std::filesystem::path = {})
+    {
+        throw std::runtime_error("Worker processes are only supported on Linux");
+    }
+
+    std::string convert(std::string_view, const PrinterParameters&, const CancellationToken& = {}, PipelineStats* = nullptr)
+    {
+        return {};
+    }
+
+    [[nodiscard]] WorkerStats stats() const
+    {
+        return {};
+    }
+};
+
+inline int runWorker(int)
+{
+    throw std::runtime_error("Worker processes are only supported on Linux");
+}
+
+#endif
+
+} // namespace plugin
+
+#endif // PLUGIN_WORKERS_H
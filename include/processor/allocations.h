@@ -0,0 +1,129 @@
+#ifndef ALLOCATIONS_H
+#define ALLOCATIONS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// What the heap allocations of one thread, or of a part of its work, amounted to
+struct AllocationCounters
+{
+    std::uint64_t allocations = 0;
+    std::uint64_t bytes = 0; // allocated, whether freed again or not
+    std::int64_t live_bytes = 0; // allocated minus freed, negative when the thread freed memory of others
+    std::int64_t peak_live_bytes = 0; // highest live_bytes reached
+
+    AllocationCounters& operator+=(const AllocationCounters& other)
+    {
+        allocations += other.allocations;
+        bytes += other.bytes;
+        live_bytes += other.live_bytes;
+        peak_live_bytes = std::max(peak_live_bytes, other.peak_live_bytes);
+        return *this;
+    }
+};
+
+/**
+ * Counts every allocation of the global operator new, per thread and for
+ * the process. Only an instrumentation build, configured with
+ * ONLYFANS_TRACK_ALLOCATIONS, replaces operator new and delete to call
+ * allocated() and freed(); otherwise enabled() is false and every counter
+ * stays zero.
+ * */
+class AllocationTracker
+{
+public:
+    static constexpr bool enabled()
+    {
+#ifdef ONLYFANS_TRACK_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // the counters of the calling thread
+    static AllocationCounters& thread() noexcept
+    {
+        thread_local AllocationCounters counters;
+        return counters;
+    }
+
+    // bytes allocated and not freed by all threads together
+    static std::int64_t process_live_bytes() noexcept
+    {
+        return live().load(std::memory_order_relaxed);
+    }
+
+    static std::uint64_t process_allocations() noexcept
+    {
+        return total().load(std::memory_order_relaxed);
+    }
+
+    static void allocated(std::size_t bytes) noexcept
+    {
+        auto& counters = thread();
+        counters.allocations++;
+        counters.bytes += bytes;
+        counters.live_bytes += static_cast<std::int64_t>(bytes);
+        counters.peak_live_bytes = std::max(counters.peak_live_bytes, counters.live_bytes);
+        live().fetch_add(static_cast<std::int64_t>(bytes), std::memory_order_relaxed);
+        total().fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void freed(std::size_t bytes) noexcept
+    {
+        thread().live_bytes -= static_cast<std::int64_t>(bytes);
+        live().fetch_sub(static_cast<std::int64_t>(bytes), std::memory_order_relaxed);
+    }
+
+private:
+    static std::atomic<std::int64_t>& live() noexcept
+    {
+        static std::atomic<std::int64_t> bytes{ 0 };
+        return bytes;
+    }
+
+    static std::atomic<std::uint64_t>& total() noexcept
+    {
+        static std::atomic<std::uint64_t> allocations{ 0 };
+        return allocations;
+    }
+};
+
+// Counts the allocations of the calling thread while it is in scope, scopes may be nested
+class AllocationScope
+{
+public:
+    AllocationScope() noexcept
+        : _start(AllocationTracker::thread())
+    {
+        // the peak of the scope starts from what is live now, the peak before it is restored on the way out
+        AllocationTracker::thread().peak_live_bytes = _start.live_bytes;
+    }
+
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+
+    ~AllocationScope()
+    {
+        auto& counters = AllocationTracker::thread();
+        counters.peak_live_bytes = std::max(counters.peak_live_bytes, _start.peak_live_bytes);
+    }
+
+    // so far, with the peak relative to the start of the scope
+    AllocationCounters counted() const noexcept
+    {
+        const auto& counters = AllocationTracker::thread();
+        return { counters.allocations - _start.allocations,
+                 counters.bytes - _start.bytes,
+                 counters.live_bytes - _start.live_bytes,
+                 counters.peak_live_bytes - _start.live_bytes };
+    }
+
+private:
+    AllocationCounters _start;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+
+/**
+ * Per-thread monotonic arena that a layer conversion allocates its
+ * intermediate data from (the spray pattern and the generator scratch rows).
+ *
+ * Allocations are a pointer bump in a buffer that is reused by every
+ * conversion on the thread and freed in one go when the conversion ends.
+ * When a conversion does not fit, the overflow comes from the heap and the
+ * buffer is grown to that size on release, so after the first few layers a
+ * conversion does not touch the global allocator at all.
+ * */
+class ConversionArena
+{
+public:
+    // Scoped use of the arena of the calling thread, everything allocated from
+    // resource() must be gone before the lease is destroyed
+    class Lease
+    {
+    public:
+        Lease()
+            : _arena(local())
+        {
+        }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        ~Lease()
+        {
+            _arena.release();
+        }
+
+        std::pmr::memory_resource* resource() const
+        {
+            return _arena.resource();
+        }
+
+    private:
+        ConversionArena& _arena;
+    };
+
+    explicit ConversionArena(size_t initial_bytes = INITIAL_BYTES)
+    {
+        reset(initial_bytes);
+    }
+
+    ConversionArena(const ConversionArena&) = delete;
+    ConversionArena& operator=(const ConversionArena&) = delete;
+
+    static ConversionArena& local()
+    {
+        thread_local ConversionArena arena;
+        return arena;
+    }
+
+    std::pmr::memory_resource* resource()
+    {
+        return &*_resource;
+    }
+
+    // size of the reusable buffer
+    size_t capacity() const
+    {
+        return _capacity;
+    }
+
+    // bytes that did not fit in the buffer since the last release
+    size_t overflow() const
+    {
+        return _upstream.allocated;
+    }
+
+    void release()
+    {
+        const auto needed = _capacity + _upstream.allocated;
+        _resource->release();
+        if (_upstream.allocated > 0 && _capacity < MAX_BYTES)
+        {
+            reset(std::min(needed, MAX_BYTES));
+        }
+        _upstream.allocated = 0;
+    }
+
+private:
+    static constexpr size_t INITIAL_BYTES = 256 * 1024;
+    static constexpr size_t MAX_BYTES = 64 * 1024 * 1024; // larger conversions keep using the heap for the rest
+
+    // heap resource that remembers how much the arena had to ask for
+    struct CountingResource : std::pmr::memory_resource
+    {
+        size_t allocated = 0;
+
+        void* do_allocate(size_t bytes, size_t alignment) override
+        {
+            allocated += bytes;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override
+        {
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+
+    void reset(size_t bytes)
+    {
+        _resource.reset();
+        _buffer = std::make_unique_for_overwrite<std::byte[]>(bytes);
+        _capacity = bytes;
+        _resource.emplace(_buffer.get(), _capacity, &_upstream);
+    }
+
+    CountingResource _upstream;
+    std::unique_ptr<std::byte[]> _buffer;
+    size_t _capacity = 0;
+    std::optional<std::pmr::monotonic_buffer_resource> _resource;
+};
+
+#endif
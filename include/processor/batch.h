@@ -0,0 +1,319 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "arena.h"
+#include "cancel.h"
+#include "dedup.h"
+#include "layer.h"
+#include "process.h"
+#include "profile.h"
+#include "volume.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct BatchResult
+{
+    size_t layers = 0;
+    size_t output_bytes = 0;
+    size_t deduplicated = 0; // layers that call the body of the layer before, see LayerDeduplicator
+    double print_time = 0.0; // estimated machine time of the whole print in seconds
+};
+
+// Writes every layer as it was converted
+struct WriteAsConverted
+{
+    std::string operator()(GeneratedLayer&& layer) const
+    {
+        return std::move(layer.gcode);
+    }
+
+    std::string finish() const
+    {
+        return {};
+    }
+};
+
+/**
+ * Produces count layers with convert(index, cancellation) on threads threads
+ * and writes them to out in index order, framed by the start and end
+ * commands of the printer, while the calling thread writes.
+ *
+ * At most a few layers per thread are produced ahead of the one being
+ * written, so the memory stays bounded whatever the size of the print. The
+ * first layer that fails stops the others, its error is rethrown with the
+ * number layer_nr(index) gives for it.
+ *
+ * The writing thread hands the converted layers to sequence in order, which
+ * returns the g-code to write for them, and writes what sequence.finish()
+ * returns after the last one. Being the only one that sees the layers in
+ * print order, it ends every layer with the ;TIME_ELAPSED since the start
+ * of the print and the print with its total ;PRINT_TIME.
+ * */
+template<class Convert, class LayerNr, class Sequence = WriteAsConverted>
+BatchResult write_in_order(
+    size_t count,
+    const std::shared_ptr<const PrinterProfile>& profile,
+    std::ostream& out,
+    size_t threads,
+    const Convert& convert,
+    const LayerNr& layer_nr,
+    Sequence&& sequence = {})
+{
+    threads = std::clamp<size_t>(threads, 1, std::max<size_t>(count, 1));
+    const size_t window = threads * 4;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<GeneratedLayer> converted(count);
+    std::vector<bool> done(count, false);
+    size_t written = 0;
+    std::exception_ptr error;
+    std::atomic<size_t> next{ 0 };
+    const auto cancellation = CancellationToken::create();
+
+    const auto work = [&]()
+    {
+        while (true)
+        {
+            const auto layer = next.fetch_add(1, std::memory_order_relaxed);
+            if (layer >= count)
+            {
+                return;
+            }
+            {
+                std::unique_lock lock(mutex);
+                changed.wait(
+                    lock,
+                    [&]()
+                    {
+                        return layer < written + window || error;
+                    });
+                if (error)
+                {
+                    return;
+                }
+            }
+
+            GeneratedLayer text{};
+            std::exception_ptr failure;
+            try
+            {
+                text = convert(layer, cancellation);
+            }
+            catch (const Cancelled&)
+            {
+                return; // another layer failed
+            }
+            catch (const std::exception& e)
+            {
+                failure = std::make_exception_ptr(std::runtime_error(std::format("Layer {}: {}", layer_nr(layer), e.what())));
+            }
+            {
+                std::scoped_lock lock(mutex);
+                if (failure && ! error)
+                {
+                    error = failure;
+                    cancellation.cancel();
+                }
+                converted[layer] = std::move(text);
+                done[layer] = true;
+            }
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+    for (size_t n = 0; n < threads; n++)
+    {
+        workers.emplace_back(work);
+    }
+
+    BatchResult result;
+    GCodeGenerator generator(profile);
+    const auto begin = generator.print_begin_cmd(static_cast<int>(count));
+    out.write(begin.data(), static_cast<std::streamsize>(begin.size()));
+    const auto write = [&](const std::string& text)
+    {
+        if (! out.write(text.data(), static_cast<std::streamsize>(text.size())))
+        {
+            {
+                std::scoped_lock lock(mutex);
+                error = std::make_exception_ptr(std::runtime_error("Could not write the converted print"));
+                cancellation.cancel();
+            }
+            changed.notify_all();
+            return false;
+        }
+        result.output_bytes += text.size();
+        return true;
+    };
+    for (size_t layer = 0; layer < count; layer++)
+    {
+        GeneratedLayer done_layer{};
+        {
+            std::unique_lock lock(mutex);
+            changed.wait(
+                lock,
+                [&]()
+                {
+                    return done[layer] || error;
+                });
+            if (error)
+            {
+                break;
+            }
+            done_layer = std::move(converted[layer]);
+            written = layer + 1;
+        }
+        changed.notify_all();
+        result.print_time += done_layer.time;
+        done_layer.gcode += generator.time_elapsed_cmd(result.print_time);
+        if (! write(sequence(std::move(done_layer))))
+        {
+            break;
+        }
+        result.layers++;
+    }
+    if (result.layers == count && write(sequence.finish()))
+    {
+        write(generator.print_time_cmd(result.print_time));
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+
+    const auto end = generator.print_end_cmd(static_cast<int>(count));
+    out.write(end.data(), static_cast<std::streamsize>(end.size()));
+    result.output_bytes += begin.size() + end.size();
+    return result;
+}
+
+// Writes count layers generated by generate(index, cancellation, digest), through a LayerDeduplicator when deduplicate is set
+template<class Generate, class LayerNr>
+BatchResult write_layers(
+    size_t count,
+    const std::shared_ptr<const PrinterProfile>& profile,
+    std::ostream& out,
+    size_t threads,
+    bool deduplicate,
+    const Generate& generate,
+    const LayerNr& layer_nr)
+{
+    if (! deduplicate)
+    {
+        return write_in_order(
+            count,
+            profile,
+            out,
+            threads,
+            [&](size_t layer, const CancellationToken& cancellation)
+            {
+                return generate(layer, cancellation, false);
+            },
+            layer_nr);
+    }
+    LayerDeduplicator deduplicator;
+    auto result = write_in_order(
+        count,
+        profile,
+        out,
+        threads,
+        [&](size_t layer, const CancellationToken& cancellation)
+        {
+            return generate(layer, cancellation, true);
+        },
+        layer_nr,
+        deduplicator);
+    result.deduplicated = deduplicator.deduplicated();
+    return result;
+}
+
+// Converts every layer of a sliced file and writes the print to out, the rasterized layers are also kept in volume when given
+inline BatchResult convert_gcode(
+    std::string_view gcode,
+    const std::shared_ptr<const PrinterProfile>& profile,
+    std::ostream& out,
+    size_t threads = std::thread::hardware_concurrency(),
+    VolumeStore* volume = nullptr,
+    bool deduplicate = false)
+{
+    const auto layers = split_layers(gcode);
+    return write_layers(
+        layers.size(),
+        profile,
+        out,
+        threads,
+        deduplicate,
+        [&](size_t layer, const CancellationToken& cancellation, bool digest)
+        {
+            return convert_layer(layers[layer], profile, cancellation, nullptr, volume, digest);
+        },
+        [&](size_t layer)
+        {
+            return find_layer_nr(layers[layer]);
+        });
+}
+
+/**
+ * Writes the print of the layers kept in volume to out without parsing any
+ * g-code, e.g. after changing the feedrates of the profile. The profile must
+ * describe the same print head and bed as the one the layers were rasterized
+ * for, else std::invalid_argument is thrown.
+ * */
+inline BatchResult regenerate_volume(
+    const VolumeStore& volume,
+    const std::shared_ptr<const PrinterProfile>& profile,
+    std::ostream& out,
+    size_t threads = std::thread::hardware_concurrency(),
+    bool deduplicate = false)
+{
+    const auto [rows, width] = VolumeDirectory::geometry(*profile);
+    if (volume.rows() != rows || volume.width() != width)
+    {
+        throw std::invalid_argument(std::format("The volume holds layers of {} rows by {} bytes, the printer rasterizes {} by {}", volume.rows(), volume.width(), rows, width));
+    }
+    const auto layers = volume.layers();
+    return write_layers(
+        layers.size(),
+        profile,
+        out,
+        threads,
+        deduplicate,
+        [&](size_t layer, const CancellationToken& cancellation, bool digest)
+        {
+            ConversionArena::Lease arena;
+            PrintManager manager(profile, arena.resource());
+            manager.set_cancellation(cancellation);
+            volume.load(layers[layer], manager.gcodeparser.pattern);
+            auto generated = manager.generate_layer(layers[layer]);
+            if (digest)
+            {
+                generated.digest = manager.gcodeparser.pattern.digest();
+            }
+            return generated;
+        },
+        [&](size_t layer)
+        {
+            return layers[layer];
+        });
+}
+
+#endif
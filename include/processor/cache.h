@@ -0,0 +1,305 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <xxhash.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// Identifies a converted layer by its content: the layer text, the layer
+// number and the printer profile it was converted for
+struct LayerKey
+{
+    std::uint64_t text_low = 0;
+    std::uint64_t text_high = 0;
+    int layer_nr = -1;
+    std::uint64_t profile = 0;
+
+    bool operator==(const LayerKey&) const = default;
+
+    std::string to_string() const
+    {
+        return std::format("{:016x}{:016x}_{}_{:016x}", text_high, text_low, layer_nr, profile);
+    }
+};
+
+struct LayerKeyHash
+{
+    size_t operator()(const LayerKey& key) const
+    {
+        return static_cast<size_t>(key.text_low ^ (key.profile * 0x9E3779B97F4A7C15ULL) ^ static_cast<std::uint64_t>(key.layer_nr));
+    }
+};
+
+struct LayerCacheStats
+{
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+    std::uint64_t disk_hits = 0;
+    std::uint64_t disk_writes = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t disk_bytes = 0;
+};
+
+/**
+ * Bounded LRU cache of generated layers.
+ *
+ * The memory tier is limited to max_bytes of output, 0 leaves only the disk.
+ * When a directory is given every inserted layer is also written there,
+ * named after its key, whether or not it fits in memory, so the cache
+ * survives a restart of the plugin. The directory is trimmed to
+ * max_disk_bytes by deleting the least recently written layers. All members
+ * are safe to call from several threads.
+ * */
+class LayerCache
+{
+public:
+    using value_t = std::shared_ptr<const std::string>;
+
+    explicit LayerCache(size_t max_bytes, std::filesystem::path directory = {}, size_t max_disk_bytes = 0)
+        : _max_bytes(max_bytes)
+        , _directory(std::move(directory))
+        , _max_disk_bytes(max_disk_bytes)
+    {
+        if (! _directory.empty())
+        {
+            std::filesystem::create_directories(_directory);
+            for (const auto& entry : std::filesystem::directory_iterator(_directory))
+            {
+                if (entry.is_regular_file() && entry.path().extension() == EXTENSION)
+                {
+                    _disk_bytes += entry.file_size();
+                }
+            }
+        }
+    }
+
+    static LayerKey key(std::string_view layer, int layer_nr, std::uint64_t profile)
+    {
+        const auto hash = XXH3_128bits(layer.data(), layer.size());
+        return LayerKey{ .text_low = hash.low64, .text_high = hash.high64, .layer_nr = layer_nr, .profile = profile };
+    }
+
+    value_t find(const LayerKey& key)
+    {
+        {
+            std::scoped_lock lock(_mutex);
+            auto it = _index.find(key);
+            if (it != _index.end())
+            {
+                _entries.splice(_entries.begin(), _entries, it->second);
+                _stats.hits++;
+                return it->second->second;
+            }
+        }
+
+        if (auto value = read(key))
+        {
+            insert_memory(key, value);
+            std::scoped_lock lock(_mutex);
+            _stats.hits++;
+            _stats.disk_hits++;
+            return value;
+        }
+
+        std::scoped_lock lock(_mutex);
+        _stats.misses++;
+        return nullptr;
+    }
+
+    void insert(const LayerKey& key, value_t value)
+    {
+        insert_memory(key, value);
+        write(key, *value);
+    }
+
+    LayerCacheStats stats() const
+    {
+        std::scoped_lock lock(_mutex);
+        auto stats = _stats;
+        stats.entries = _entries.size();
+        stats.bytes = _bytes;
+        stats.disk_bytes = _disk_bytes;
+        return stats;
+    }
+
+private:
+    static constexpr std::string_view EXTENSION = ".gcode";
+
+    void insert_memory(const LayerKey& key, const value_t& value)
+    {
+        std::scoped_lock lock(_mutex);
+        if (_index.contains(key) || value->size() > _max_bytes)
+        {
+            return;
+        }
+        _entries.emplace_front(key, value);
+        _index.emplace(key, _entries.begin());
+        _bytes += value->size();
+        while (_bytes > _max_bytes)
+        {
+            auto& oldest = _entries.back();
+            _bytes -= oldest.second->size();
+            _index.erase(oldest.first);
+            _entries.pop_back();
+            _stats.evictions++;
+        }
+    }
+
+    std::filesystem::path path(const LayerKey& key) const
+    {
+        return _directory / (key.to_string() + std::string(EXTENSION));
+    }
+
+    value_t read(const LayerKey& key) const
+    {
+        if (_directory.empty())
+        {
+            return nullptr;
+        }
+        std::ifstream file(path(key), std::ios::binary | std::ios::ate);
+        if (! file.is_open())
+        {
+            return nullptr;
+        }
+        auto value = std::make_shared<std::string>(static_cast<size_t>(file.tellg()), '\0');
+        file.seekg(0);
+        if (! file.read(value->data(), static_cast<std::streamsize>(value->size())))
+        {
+            return nullptr;
+        }
+        return value;
+    }
+
+    // written to a temporary file first, so a concurrent reader or a crash never sees half a layer;
+    // a layer another thread or plugin wrote in the meantime is kept, so every file is counted once
+    void write(const LayerKey& key, const std::string& value)
+    {
+        if (_directory.empty())
+        {
+            return;
+        }
+        const auto target = path(key);
+        auto temporary = target;
+        temporary += temporary_suffix();
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            if (! file.write(value.data(), static_cast<std::streamsize>(value.size())))
+            {
+                return;
+            }
+        }
+        std::error_code ec;
+        if (std::filesystem::exists(target, ec))
+        {
+            std::filesystem::remove(temporary, ec);
+            return;
+        }
+        std::filesystem::rename(temporary, target, ec);
+        if (ec)
+        {
+            std::filesystem::remove(temporary, ec);
+            return;
+        }
+
+        bool trim = false;
+        {
+            std::scoped_lock lock(_mutex);
+            _stats.disk_writes++;
+            _disk_bytes += value.size();
+            trim = _max_disk_bytes > 0 && _disk_bytes > _max_disk_bytes;
+        }
+        if (trim)
+        {
+            trim_disk();
+        }
+    }
+
+    // unique among the processes sharing the directory: the converter, the C library, workers and the plugin
+    static std::string temporary_suffix()
+    {
+        static std::atomic<std::uint64_t> written{ 0 };
+#ifdef _WIN32
+        const auto process = _getpid();
+#else
+        const auto process = getpid();
+#endif
+        return std::format(".{}.{}.tmp", process, written.fetch_add(1, std::memory_order_relaxed));
+    }
+
+    // deletes the oldest layers until the directory is back at 90% of its budget
+    void trim_disk()
+    {
+        std::scoped_lock trim_lock(_trim_mutex);
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::directory_entry>> files;
+        size_t total = 0;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(_directory, ec))
+        {
+            if (entry.is_regular_file(ec) && entry.path().extension() == EXTENSION)
+            {
+                files.emplace_back(entry.last_write_time(ec), entry);
+                total += entry.file_size(ec);
+            }
+        }
+        std::sort(
+            files.begin(),
+            files.end(),
+            [](const auto& lhs, const auto& rhs)
+            {
+                return lhs.first < rhs.first;
+            });
+
+        const size_t target = _max_disk_bytes / 10 * 9;
+        for (const auto& [time, entry] : files)
+        {
+            if (total <= target)
+            {
+                break;
+            }
+            const auto size = entry.file_size(ec);
+            if (std::filesystem::remove(entry.path(), ec))
+            {
+                total -= size;
+            }
+        }
+
+        std::scoped_lock lock(_mutex);
+        _disk_bytes = total;
+    }
+
+    const size_t _max_bytes;
+    const std::filesystem::path _directory;
+    const size_t _max_disk_bytes;
+
+    mutable std::mutex _mutex;
+    std::mutex _trim_mutex;
+    std::list<std::pair<LayerKey, value_t>> _entries; // most recently used first
+    std::unordered_map<LayerKey, std::list<std::pair<LayerKey, value_t>>::iterator, LayerKeyHash> _index;
+    size_t _bytes = 0;
+    size_t _disk_bytes = 0;
+    LayerCacheStats _stats;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef CANCEL_H
+#define CANCEL_H
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+
+// Thrown from inside a conversion once nobody is waiting for its result anymore
+class Cancelled : public std::runtime_error
+{
+public:
+    Cancelled()
+        : std::runtime_error("Conversion was cancelled")
+    {
+    }
+};
+
+// Cheap to copy flag that the parser and generator poll at chunk boundaries.
+// A default constructed token can never be cancelled.
+class CancellationToken
+{
+public:
+    CancellationToken() = default;
+
+    static CancellationToken create()
+    {
+        return CancellationToken(std::make_shared<std::atomic_bool>(false));
+    }
+
+    // follows a flag that lives elsewhere, such as in memory shared with another process; the flag must outlive the token
+    static CancellationToken watching(std::atomic_bool& flag)
+    {
+        return CancellationToken(std::shared_ptr<std::atomic_bool>(std::shared_ptr<void>{}, &flag));
+    }
+
+    void cancel() const
+    {
+        if (_flag)
+        {
+            _flag->store(true, std::memory_order_relaxed);
+        }
+    }
+
+    bool is_cancelled() const
+    {
+        return _flag && _flag->load(std::memory_order_relaxed);
+    }
+
+    void throw_if_cancelled() const
+    {
+        if (is_cancelled())
+        {
+            throw Cancelled();
+        }
+    }
+
+private:
+    explicit CancellationToken(std::shared_ptr<std::atomic_bool> flag)
+        : _flag(std::move(flag))
+    {
+    }
+
+    std::shared_ptr<std::atomic_bool> _flag;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef CONVERTER_H
+#define CONVERTER_H
+
+#include "cache.h"
+#include "cancel.h"
+#include "layer.h"
+#include "metrics.h"
+#include "profile.h"
+#include "volume.h"
+
+#include <plugin/cmdline.h>
+#include <xxhash.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// The version mixed into the cache keys, the same for the plugin and the C library so both can share a cache directory
+inline std::uint64_t converter_version()
+{
+    static const auto version = XXH3_64bits(plugin::cmdline::VERSION.data(), plugin::cmdline::VERSION.size());
+    return version;
+}
+
+/**
+ * Converts single layers, through the cache when there is one. This is what
+ * both the plugin and the C library run for every layer. The converter holds
+ * no state of its own besides the cache, so one instance may be used from
+ * any number of threads.
+ * */
+class LayerConverter
+{
+public:
+    // version is mixed into the cache keys, so layers of another build of the converter are never served
+    explicit LayerConverter(std::shared_ptr<LayerCache> cache = {}, std::uint64_t version = 0)
+        : _cache(std::move(cache))
+        , _version(version)
+    {
+    }
+
+    // the pattern of the layer is also kept in volume when given
+    std::string convert(
+        std::string_view layer,
+        const std::shared_ptr<const PrinterProfile>& profile,
+        const CancellationToken& cancellation = {},
+        PipelineStats* stats = nullptr,
+        VolumeStore* volume = nullptr) const
+    {
+        return convert(
+            layer,
+            *profile,
+            volume,
+            [&]()
+            {
+                return filterLines(layer, profile, cancellation, stats, volume);
+            });
+    }
+
+    // the same, with layers that are not cached converted by convert_layer(), e.g. in another process
+    template<class Convert>
+    std::string convert(std::string_view layer, const PrinterProfile& profile, VolumeStore* volume, Convert&& convert_layer) const
+    {
+        if (! _cache)
+        {
+            return convert_layer();
+        }
+        const auto layer_nr = find_layer_nr(layer);
+        const auto key = LayerCache::key(layer, layer_nr, fingerprint(profile));
+        // a cached layer has no pattern, it is converted again when the volume does not have it yet
+        if (volume == nullptr || volume->contains(layer_nr))
+        {
+            if (auto cached = _cache->find(key))
+            {
+                return *cached;
+            }
+        }
+        std::string gcode = convert_layer();
+        _cache->insert(key, std::make_shared<const std::string>(gcode));
+        return gcode;
+    }
+
+    // identifies the printer and the converter a layer was converted by
+    std::uint64_t fingerprint(const PrinterProfile& profile) const
+    {
+        return profile.fingerprint() ^ _version;
+    }
+
+    const std::shared_ptr<LayerCache>& cache() const
+    {
+        return _cache;
+    }
+
+private:
+    std::shared_ptr<LayerCache> _cache;
+    std::uint64_t _version;
+};
+
+#endif
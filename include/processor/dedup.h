@@ -0,0 +1,117 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "process.h"
+
+#include <cstdint>
+#include <format>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/**
+ * Writes the body of consecutive layers with the same pattern only once.
+ *
+ * Walls that go straight up give hundreds of layers that spray the same
+ * pattern, and so have the same body, only their header differs. When a
+ * layer has the digest and body of the one before, the body of the first
+ * is defined as a macro on the printer and every layer of the run calls
+ * it:
+ *
+ *   DEFINE_LAYER_MACRO NAME=LAYER_12
+ *   ...the body...
+ *   END_LAYER_MACRO
+ *   RUN_LAYER_MACRO NAME=LAYER_12
+ *
+ * The printer must know these commands, so this is only done when asked.
+ * Layers are given in print order; one layer is held back until the next
+ * shows whether it starts a run. Every layer must come with its digest.
+ * */
+class LayerDeduplicator
+{
+public:
+    // the g-code to write for layer, empty while it is held back
+    std::string operator()(GeneratedLayer&& layer)
+    {
+        if (_macro && repeats(*_macro, layer))
+        {
+            _deduplicated++;
+            return run(layer, _macro->layer_nr);
+        }
+        _macro.reset();
+
+        std::string gcode;
+        if (_held && repeats(*_held, layer))
+        {
+            _deduplicated++;
+            gcode = define(*_held);
+            gcode += run(layer, _held->layer_nr);
+            _macro = std::exchange(_held, std::nullopt);
+            return gcode;
+        }
+        if (_held)
+        {
+            gcode = std::move(_held->gcode);
+        }
+        _held = std::move(layer);
+        return gcode;
+    }
+
+    // the layer still held back
+    std::string finish()
+    {
+        return _held ? std::move(std::exchange(_held, std::nullopt)->gcode) : std::string{};
+    }
+
+    // layers that call the macro of an earlier layer instead of repeating its body
+    size_t deduplicated() const
+    {
+        return _deduplicated;
+    }
+
+private:
+    static bool repeats(const GeneratedLayer& previous, const GeneratedLayer& layer)
+    {
+        // the digest decides quickly, the bodies make sure
+        return layer.digest && previous.digest == layer.digest && ! layer.body().empty() && previous.body() == layer.body();
+    }
+
+    static std::string name(int layer_nr)
+    {
+        return std::format("LAYER_{}", layer_nr);
+    }
+
+    // the layer itself, with its body defined as a macro and called
+    static std::string define(const GeneratedLayer& layer)
+    {
+        const std::string_view gcode = layer.gcode;
+        std::string defined;
+        defined.reserve(gcode.size() + 128);
+        defined += gcode.substr(0, layer.body_begin);
+        defined += std::format("DEFINE_LAYER_MACRO NAME={}\n", name(layer.layer_nr));
+        defined += layer.body();
+        defined += "END_LAYER_MACRO\n";
+        defined += std::format("RUN_LAYER_MACRO NAME={}\n", name(layer.layer_nr));
+        defined += gcode.substr(layer.body_end);
+        return defined;
+    }
+
+    // the layer with its body replaced by a call of the macro of layer macro_nr
+    static std::string run(const GeneratedLayer& layer, int macro_nr)
+    {
+        const std::string_view gcode = layer.gcode;
+        std::string called;
+        called.reserve(gcode.size() - layer.body().size() + 64);
+        called += gcode.substr(0, layer.body_begin);
+        called += std::format("RUN_LAYER_MACRO NAME={}\n", name(macro_nr));
+        called += gcode.substr(layer.body_end);
+        return called;
+    }
+
+    std::optional<GeneratedLayer> _held; // written as it is unless the next layer repeats it
+    std::optional<GeneratedLayer> _macro; // the layer whose body the current run calls
+    size_t _deduplicated = 0;
+};
+
+#endif
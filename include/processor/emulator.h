@@ -0,0 +1,589 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include "process.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <bitset>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// What the emulated printer did during one layer
+struct EmulatedLayer
+{
+    int layer_nr = 0; // as set by SET_PRINT_STATS_INFO CURRENT_LAYER
+    size_t lines = 0;
+    double moves = 0.0; // seconds
+    double dwell = 0.0;
+    double macros = 0.0;
+    std::optional<double> estimated; // the ;ESTIMATED_LAYER_TIME written before the layer
+    size_t valve_sets = 0;
+    size_t valve_toggles = 0; // valves that opened or closed
+    size_t stray_bits = 0; // valves open while the head crossed a row outside the bed
+    double max_valve_frequency = 0.0; // switches per second of the valve that switched again the soonest
+
+    double time() const
+    {
+        return moves + dwell + macros;
+    }
+};
+
+// Result of comparing what was sprayed with the pattern of the layer
+struct SprayComparison
+{
+    size_t rows = 0; // rows compared, summed over the passes
+    size_t mismatched_bits = 0;
+    std::optional<size_t> first_mismatch_row;
+};
+
+/**
+ * Interprets the g-code we generate the way the printer does, to verify a
+ * conversion without a machine.
+ *
+ * The emulator follows the position of the head, the feedrate, the pass and
+ * the valves. Whenever the head crosses a bed row, the open valves are
+ * recorded as sprayed in that row for the current pass, so the sprayed
+ * bitmap of every pass can be compared bit for bit with the SprayPattern
+ * the layer was generated from. The valves are only set every second row,
+ * a row is compared when its valves were set as the head entered it, the
+ * others carry the valves of the row before. Machine time is costed with
+ * the model of the TimeEstimator, so the estimate written in the layer can
+ * be checked against it.
+ *
+ * The layer macros of a deduplicated print are recorded when defined and
+ * run line by line when called, see LayerDeduplicator.
+ *
+ * Layers start at SET_PRINT_STATS_INFO CURRENT_LAYER. When a layer ends,
+ * on_layer is called while its bitmap is still available. Unknown commands
+ * and malformed parameters throw std::invalid_argument with the line number.
+ * */
+class PrinterEmulator
+{
+public:
+    explicit PrinterEmulator(std::shared_ptr<const PrinterProfile> profile = PrinterProfile::defaults())
+        : _profile(std::move(profile))
+        , _bytes(_profile->bytes_per_pass())
+        , _rows(static_cast<size_t>(_profile->bed_rows()))
+        , _valves(_bytes)
+        , _decoded(_bytes)
+        , _toggles(_bytes * 8, 0)
+        , _switched(_bytes * 8, -1.0)
+    {
+        for (auto& sprayed : _sprayed)
+        {
+            sprayed = ValveRows(_rows, _bytes);
+        }
+        for (auto& keyed : _keyed)
+        {
+            keyed.assign(_rows, false);
+        }
+        for (unsigned value = 0; value < _unreversed.size(); value++)
+        {
+            std::bitset<8> bits;
+            for (size_t bit = 0; bit < 8; bit++)
+            {
+                bits[7 - bit] = (value >> bit) & 1U;
+            }
+            _unreversed[value] = bits;
+        }
+    }
+
+    // runs every line of gcode, the last line does not need a newline
+    void feed(std::string_view gcode)
+    {
+        while (! gcode.empty())
+        {
+            const auto* end = static_cast<const char*>(std::memchr(gcode.data(), '\n', gcode.size()));
+            const size_t length = end == nullptr ? gcode.size() : static_cast<size_t>(end - gcode.data());
+            execute(gcode.substr(0, length));
+            gcode.remove_prefix(end == nullptr ? length : length + 1);
+        }
+    }
+
+    // runs a single line, without its newline
+    void execute(std::string_view line)
+    {
+        _line_nr++;
+        _layer.lines++;
+        if (! line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+        while (! line.empty() && line.front() == ' ')
+        {
+            line.remove_prefix(1);
+        }
+        if (line.empty())
+        {
+            return;
+        }
+        if (_recording != nullptr && ! line.starts_with("END_LAYER_MACRO"))
+        {
+            _recording->append(line);
+            *_recording += '\n';
+            return;
+        }
+        if (line.front() == ';')
+        {
+            comment(line);
+            return;
+        }
+
+        auto command = line.substr(0, line.find_first_of(" ;"));
+        auto parameters = line.substr(command.size());
+        parameters = parameters.substr(0, parameters.find(';'));
+
+        if (command == "G1" || command == "G0")
+        {
+            linear_move(parameters);
+        }
+        else if (command == "VALVES_SET")
+        {
+            valves_set(parameters);
+        }
+        else if (command == "G4")
+        {
+            dwell(parameters);
+        }
+        else if (command == "SET_FIRST_PASS" || command == "SET_SECOND_PASS")
+        {
+            _pass = command == "SET_FIRST_PASS" ? 0 : 1;
+            _layer.macros += _profile->parameters().macro_costs.set_pass;
+        }
+        else if (command == "FILL_HOPPER_ASYNC")
+        {
+            _layer.macros += _profile->parameters().macro_costs.fill_hopper;
+        }
+        else if (command == "Z_ONE_LAYER")
+        {
+            _layer.macros += _profile->parameters().macro_costs.z_one_layer;
+        }
+        else if (command == "PAUSE_PRINTER")
+        {
+            _layer.macros += _profile->parameters().macro_costs.pause_printer;
+        }
+        else if (command == "SET_PRINT_STATS_INFO")
+        {
+            print_stats_info(parameters);
+        }
+        else if (command == "G28")
+        {
+            // the homing time is not known, and the rest of our G28 line is not read by the firmware either
+            _x = 0.0f;
+            _y = 0.0f;
+        }
+        else if (command == "VALVES_ENABLE" || command == "VALVES_DISABLE")
+        {
+            _enabled = command == "VALVES_ENABLE";
+        }
+        else if (command == "DEFINE_LAYER_MACRO")
+        {
+            _recording = &_macros[std::string{ macro_name(parameters) }];
+            _recording->clear();
+        }
+        else if (command == "END_LAYER_MACRO")
+        {
+            if (_recording == nullptr)
+            {
+                fail("END_LAYER_MACRO without DEFINE_LAYER_MACRO");
+            }
+            _recording = nullptr;
+        }
+        else if (command == "RUN_LAYER_MACRO")
+        {
+            const auto macro = _macros.find(std::string{ macro_name(parameters) });
+            if (macro == _macros.end())
+            {
+                fail(std::format("Unknown macro {}", macro_name(parameters)));
+            }
+            // a copy, the macro may be defined again while it runs; its lines are not lines of the file
+            const auto body = macro->second;
+            const auto line_nr = _line_nr;
+            feed(body);
+            _line_nr = line_nr;
+        }
+        else if (command != "RESPOND")
+        {
+            fail(std::format("Unknown command {}", command));
+        }
+    }
+
+    // ends the last layer
+    void finish()
+    {
+        end_layer();
+    }
+
+    // called at the end of every layer
+    std::function<void(const PrinterEmulator&)> on_layer;
+
+    // the layer being emulated, or the one that just ended inside on_layer
+    const EmulatedLayer& layer() const
+    {
+        return _layer;
+    }
+
+    // bed row by bed row, the valves that were open in pass 0 or 1 of the current layer, in valve order
+    const ValveRows& sprayed(int pass) const
+    {
+        return _sprayed[pass];
+    }
+
+    // whether the valves were set as the head entered the row
+    bool keyed(int pass, size_t row) const
+    {
+        return _keyed[pass][row];
+    }
+
+    /**
+     * Compares the rows of the current layer whose valves were set with the
+     * pattern. Valve v of a pass sprays bit 2v + pass of a pattern row, as
+     * GCodeGenerator::interlace_and_separate splits them.
+     * */
+    SprayComparison compare(const SprayPattern& sp) const
+    {
+        if (sp.pattern.size() != _rows || sp.pattern.width() != 2 * _bytes)
+        {
+            throw std::invalid_argument("The pattern does not have the size of the bed of the profile");
+        }
+        SprayComparison comparison;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (size_t row = 0; row < _rows; row++)
+            {
+                if (! _keyed[pass][row])
+                {
+                    continue;
+                }
+                comparison.rows++;
+                const auto expected = sp.pattern[row];
+                const auto sprayed = _sprayed[pass][row];
+                for (size_t valve = 0; valve < _bytes * 8; valve++)
+                {
+                    const auto bit = 2 * valve + pass;
+                    if (expected[bit / 8][bit % 8] != sprayed[valve / 8][valve % 8])
+                    {
+                        comparison.mismatched_bits++;
+                        if (! comparison.first_mismatch_row || *comparison.first_mismatch_row > row)
+                        {
+                            comparison.first_mismatch_row = row;
+                        }
+                    }
+                }
+            }
+        }
+        return comparison;
+    }
+
+    // machine time of everything emulated so far, in seconds
+    double elapsed() const
+    {
+        return _elapsed + _layer.time();
+    }
+
+    // how often each valve opened or closed
+    std::span<const uint64_t> toggles() const
+    {
+        return _toggles;
+    }
+
+    std::optional<int> total_layers() const
+    {
+        return _total_layers;
+    }
+
+    size_t lines() const
+    {
+        return _line_nr;
+    }
+
+private:
+    void comment(std::string_view line)
+    {
+        constexpr std::string_view estimate = ";ESTIMATED_LAYER_TIME:";
+        if (line.starts_with(estimate))
+        {
+            line.remove_prefix(estimate.size());
+            while (! line.empty() && line.front() == ' ')
+            {
+                line.remove_prefix(1);
+            }
+            // written before the layer it belongs to
+            _next_estimate = number<double>(line, "ESTIMATED_LAYER_TIME");
+        }
+    }
+
+    void linear_move(std::string_view parameters)
+    {
+        float x = _x;
+        float y = _y;
+        while (auto word = next_word(parameters))
+        {
+            const auto value = number<float>(word->substr(1), word->substr(0, 1));
+            switch (word->front())
+            {
+            case 'X':
+                x = value;
+                break;
+            case 'Y':
+                y = value;
+                break;
+            case 'F':
+                _feedrate = value;
+                break;
+            default:
+                fail(std::format("Unknown parameter {}", *word));
+            }
+        }
+
+        // costed as TimeEstimator::move, so both agree to the last bit
+        const double distance = std::hypot(x - _x, y - _y);
+        if (_feedrate > 0.0f)
+        {
+            _layer.moves += distance * 60.0 / _feedrate;
+        }
+        if (y != _y)
+        {
+            spray(_y, y);
+        }
+        _x = x;
+        _y = y;
+    }
+
+    // the head crossed the rows between from and to with the current valves
+    void spray(float from, float to)
+    {
+        const auto start = static_cast<long>(_profile->parameters().y_start);
+        const bool up = to > from;
+        // the row next to the position the move started from
+        const long entered = (up ? static_cast<long>(std::floor(from)) : static_cast<long>(std::ceil(from)) - 1) - start;
+        const long first = static_cast<long>(std::floor(std::min(from, to))) - start;
+        const long last = static_cast<long>(std::ceil(std::max(from, to))) - 1 - start;
+
+        size_t open = 0;
+        if (_enabled)
+        {
+            for (const auto& valves : _valves)
+            {
+                open += valves.count();
+            }
+        }
+        for (long row = first; row <= last; row++)
+        {
+            if (row < 0 || row >= static_cast<long>(_rows))
+            {
+                _layer.stray_bits += open;
+                continue;
+            }
+            if (open > 0)
+            {
+                auto sprayed = _sprayed[_pass][static_cast<size_t>(row)];
+                for (size_t byte = 0; byte < _bytes; byte++)
+                {
+                    sprayed[byte] |= _valves[byte];
+                }
+            }
+            if (row == entered && _valves_fresh)
+            {
+                _keyed[_pass][static_cast<size_t>(row)] = true;
+            }
+        }
+        _valves_fresh = false;
+    }
+
+    void valves_set(std::string_view parameters)
+    {
+        constexpr std::string_view key = "VALUES=";
+        const auto word = next_word(parameters);
+        if (! word || ! word->starts_with(key))
+        {
+            fail("VALVES_SET without VALUES=");
+        }
+        auto values = word->substr(key.size());
+        size_t byte = 0;
+        while (! values.empty())
+        {
+            const auto comma = values.find(',');
+            const auto value = number<unsigned>(values.substr(0, comma), "VALUES");
+            if (value > 255 || byte == _bytes)
+            {
+                fail("VALVES_SET needs one value from 0 to 255 per valve block");
+            }
+            _decoded[byte++] = _unreversed[value];
+            values.remove_prefix(comma == std::string_view::npos ? values.size() : comma + 1);
+        }
+        if (byte != _bytes)
+        {
+            fail("VALVES_SET needs one value from 0 to 255 per valve block");
+        }
+
+        for (byte = 0; byte < _bytes; byte++)
+        {
+            const auto changed = (_valves[byte] ^ _decoded[byte]).to_ulong();
+            if (changed == 0)
+            {
+                continue;
+            }
+            _layer.valve_toggles += std::popcount(changed);
+            const auto now = _layer.time();
+            for (size_t bit = 0; bit < 8; bit++)
+            {
+                if ((changed >> bit) & 1U)
+                {
+                    _toggles[byte * 8 + bit]++;
+                    // valves set twice without moving in between never sprayed the first setting
+                    auto& switched = _switched[byte * 8 + bit];
+                    if (switched >= 0.0 && now > switched)
+                    {
+                        _layer.max_valve_frequency = std::max(_layer.max_valve_frequency, 1.0 / (now - switched));
+                    }
+                    switched = now;
+                }
+            }
+            _valves[byte] = _decoded[byte];
+        }
+        _layer.valve_sets++;
+        _valves_fresh = true;
+    }
+
+    std::string_view macro_name(std::string_view parameters) const
+    {
+        constexpr std::string_view key = "NAME=";
+        const auto word = next_word(parameters);
+        if (! word || ! word->starts_with(key) || word->size() == key.size())
+        {
+            fail("Expected NAME=<macro>");
+        }
+        return word->substr(key.size());
+    }
+
+    void dwell(std::string_view parameters)
+    {
+        while (auto word = next_word(parameters))
+        {
+            if (word->front() != 'P')
+            {
+                fail(std::format("Unknown parameter {}", *word));
+            }
+            _layer.dwell += number<float>(word->substr(1), "P") / 1000.0;
+        }
+    }
+
+    void print_stats_info(std::string_view parameters)
+    {
+        constexpr std::string_view current = "CURRENT_LAYER=";
+        constexpr std::string_view total = "TOTAL_LAYER=";
+        while (auto word = next_word(parameters))
+        {
+            if (word->starts_with(current))
+            {
+                end_layer();
+                _layer.layer_nr = number<int>(word->substr(current.size()), "CURRENT_LAYER");
+                _layer.estimated = std::exchange(_next_estimate, std::nullopt);
+                _layer.lines = 1;
+            }
+            else if (word->starts_with(total))
+            {
+                _total_layers = number<int>(word->substr(total.size()), "TOTAL_LAYER");
+            }
+        }
+    }
+
+    // reports a started layer and starts from a clean one
+    void end_layer()
+    {
+        if (_layer.layer_nr != 0)
+        {
+            if (on_layer)
+            {
+                on_layer(*this);
+            }
+            for (int pass = 0; pass < 2; pass++)
+            {
+                _sprayed[pass] = ValveRows(_rows, _bytes);
+                _keyed[pass].assign(_rows, false);
+            }
+        }
+        _elapsed += _layer.time();
+        _layer = EmulatedLayer{};
+        std::fill(_switched.begin(), _switched.end(), -1.0);
+    }
+
+    // the next space separated word of text
+    static std::optional<std::string_view> next_word(std::string_view& text)
+    {
+        const auto begin = text.find_first_not_of(' ');
+        if (begin == std::string_view::npos)
+        {
+            text = {};
+            return std::nullopt;
+        }
+        text.remove_prefix(begin);
+        const auto word = text.substr(0, text.find(' '));
+        text.remove_prefix(word.size());
+        return word;
+    }
+
+    template<class T>
+    T number(std::string_view text, std::string_view name) const
+    {
+        T value{};
+        const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (ec != std::errc() || (ptr != text.data() + text.size() && *ptr != ' '))
+        {
+            fail(std::format("Invalid value for {}: '{}'", name, text));
+        }
+        return value;
+    }
+
+    [[noreturn]] void fail(const std::string& message) const
+    {
+        throw std::invalid_argument(std::format("Line {}: {}", _line_nr, message));
+    }
+
+    std::shared_ptr<const PrinterProfile> _profile;
+    size_t _bytes;
+    size_t _rows;
+    std::array<std::bitset<8>, 256> _unreversed;
+
+    float _x = 0.0f;
+    float _y = 0.0f;
+    float _feedrate = 0.0f;
+    int _pass = 0;
+    bool _enabled = true;
+    bool _valves_fresh = false; // set since the head last moved along Y
+    std::vector<std::bitset<8>> _valves;
+    std::vector<std::bitset<8>> _decoded;
+    std::vector<uint64_t> _toggles;
+    std::vector<double> _switched; // when in the current layer each valve last switched, negative before it did
+
+    std::array<ValveRows, 2> _sprayed{ ValveRows(0, 0), ValveRows(0, 0) };
+    std::array<std::vector<bool>, 2> _keyed;
+
+    std::unordered_map<std::string, std::string> _macros; // the lines of every layer macro
+    std::string* _recording = nullptr; // the macro being defined
+
+    EmulatedLayer _layer;
+    std::optional<double> _next_estimate;
+    std::optional<int> _total_layers;
+    double _elapsed = 0.0;
+    size_t _line_nr = 0;
+};
+
+#endif
@@ -1,10 +1,12 @@
 #ifndef GCODE_H
 #define GCODE_H
 
-#include <sstream>
+#include <charconv>
 #include <cmath>
-#include <string>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 
 // Define the Command class
 class GCodeMove
@@ -40,50 +42,93 @@ public:
 };
 
 // Parses a gcode instruction and extracts the X, Y, Z, E values
-// // Only works for G0 and G1 commands that contain at least one element
-// - input:   std::string that contains the gcode instruction
-// - output:  a Command object that contains the parsed values of the gcode instruction
-GCodeMove get_g_move(const std::string& line)
+// Only works for G0 and G1 commands that contain at least one element
+// - input:   the gcode instruction, trailing whitespace and newline are allowed
+// - output:  the parsed values, or nothing when the line is not a G0/G1 move.
+//            Does not allocate, so it is cheap to call on every line of a layer.
+inline std::optional<GCodeMove> try_get_g_move(std::string_view line)
 {
-    if (line.substr(0, 2) != "G0" && line.substr(0, 2) != "G1")
+    if (! line.starts_with("G0") && ! line.starts_with("G1"))
     {
-        throw std::invalid_argument("Supplied gcode command must be starting with G0 or G1");
+        return std::nullopt;
     }
 
+    const auto is_space = [](char ch)
+    {
+        return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\v' || ch == '\f';
+    };
+
     float x = 0.0f, y = 0.0f, z = 0.0f, e = 0.0f;
-    std::istringstream iss(line);
-    std::string commandType;
-    iss >> commandType;
-    char ch;
     bool atLeastOneParameter = false;
-    while (iss >> ch)
+    // skip the command itself, then look at every non-whitespace character
+    size_t pos = 0;
+    while (pos < line.size() && ! is_space(line[pos]))
+    {
+        pos++;
+    }
+    while (pos < line.size())
     {
-        if (ch == 'X')
+        const char ch = line[pos++];
+        float* value = nullptr;
+        switch (ch)
         {
-            iss >> x;
-            atLeastOneParameter = true;
+        case 'X':
+            value = &x;
+            break;
+        case 'Y':
+            value = &y;
+            break;
+        case 'Z':
+            value = &z;
+            break;
+        case 'E':
+            value = &e;
+            break;
+        default:
+            continue;
         }
-        else if (ch == 'Y')
+        atLeastOneParameter = true;
+
+        while (pos < line.size() && is_space(line[pos]))
         {
-            iss >> y;
-            atLeastOneParameter = true;
+            pos++;
         }
-        else if (ch == 'Z')
+        if (pos < line.size() && line[pos] == '+')
         {
-            iss >> z;
-            atLeastOneParameter = true;
+            pos++;
         }
-        else if (ch == 'E')
+        const auto [end, ec] = std::from_chars(line.data() + pos, line.data() + line.size(), *value);
+        if (ec != std::errc())
         {
-            iss >> e;
-            atLeastOneParameter = true;
+            // like a failed stream extraction: the value becomes 0 and the rest of the line is ignored
+            *value = 0.0f;
+            break;
         }
+        pos = end - line.data();
     }
     if (! atLeastOneParameter)
     {
-        throw std::invalid_argument("Supplied gcode command needs to have at least a single parameter (X, Y, Z or E)");
+        return std::nullopt;
     }
     return GCodeMove(x, y, z, e);
+}
+
+// Parses a gcode instruction and extracts the X, Y, Z, E values
+// // Only works for G0 and G1 commands that contain at least one element
+// - input:   std::string that contains the gcode instruction
+// - output:  a Command object that contains the parsed values of the gcode instruction
+inline GCodeMove get_g_move(std::string_view line)
+{
+    if (! line.starts_with("G0") && ! line.starts_with("G1"))
+    {
+        throw std::invalid_argument("Supplied gcode command must be starting with G0 or G1");
+    }
+    const auto move = try_get_g_move(line);
+    if (! move.has_value())
+    {
+        throw std::invalid_argument("Supplied gcode command needs to have at least a single parameter (X, Y, Z or E)");
+    }
+    return *move;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,174 @@
+#ifndef LAYER_H
+#define LAYER_H
+
+#include "arena.h"
+#include "cancel.h"
+#include "metrics.h"
+#include "process.h"
+#include "profile.h"
+#include "trace.h"
+#include "volume.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <charconv>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Returns the number of the first ";LAYER:" marker in the text, or -1 if there is none
+inline int find_layer_nr(std::string_view layer)
+{
+    constexpr std::string_view marker = ";LAYER:";
+    const auto pos = layer.find(marker);
+    if (pos == std::string_view::npos)
+    {
+        return -1;
+    }
+    int layer_nr = -1;
+    const auto begin = layer.data() + pos + marker.size();
+    const auto [ptr, ec] = std::from_chars(begin, layer.data() + layer.size(), layer_nr);
+    if (ec != std::errc())
+    {
+        return -1;
+    }
+    return layer_nr;
+}
+
+// Returns the number of a ";LAYER:<nr>" line, -2 if the number is missing and -3 for any other line
+inline int get_layer_nr(std::string_view line)
+{
+    constexpr std::string_view prefix = ";LAYER:";
+    if (! line.starts_with(prefix))
+    {
+        return -3;
+    }
+    line.remove_prefix(prefix.size());
+    while (! line.empty() && (line.front() == ' ' || line.front() == '\t'))
+    {
+        line.remove_prefix(1);
+    }
+    int layerNumber = 0;
+    const auto [ptr, ec] = std::from_chars(line.data(), line.data() + line.size(), layerNumber);
+    if (ec != std::errc())
+    {
+        return -2;
+    }
+    return layerNumber;
+}
+
+// Converts a layer and tells where its body is, with the digest of its pattern when digest is set
+inline GeneratedLayer convert_layer(
+    std::string_view layer,
+    const std::shared_ptr<const PrinterProfile>& profile = PrinterProfile::defaults(),
+    const CancellationToken& cancellation = {},
+    PipelineStats* stats = nullptr,
+    VolumeStore* volume = nullptr,
+    bool digest = false)
+{
+    // the call may have been abandoned while this layer was waiting for a thread
+    cancellation.throw_if_cancelled();
+
+    if (Tracer::enabled())
+    {
+        Tracer::set_layer(find_layer_nr(layer));
+    }
+    const TraceSpan span("convert", "conversion");
+
+    // everything but the output lives in the arena of this thread and is freed at once when the layer is done
+    ConversionArena::Lease arena;
+
+    //create our printer
+    PrintManager pm(profile, arena.resource());
+    pm.set_cancellation(cancellation);
+    pm.set_stats(stats);
+
+    // Split the input string to lines, the views point into the request
+    int layer_nr = -1;
+    std::pmr::vector<std::string_view> lines(arena.resource());
+    {
+        StageTimer timer(stats, PipelineStats::SPLIT);
+        lines.reserve(std::count(layer.begin(), layer.end(), '\n') + 1);
+        while (! layer.empty())
+        {
+            const auto end = layer.find('\n');
+            const auto line = layer.substr(0, end == std::string_view::npos ? layer.size() : end + 1);
+            layer.remove_prefix(line.size());
+
+            if (layer_nr < 0) // haven't found the layer key-word yet
+            {
+                layer_nr = get_layer_nr(line);
+            }
+            else
+            {
+                lines.push_back(line);
+            }
+        }
+    }
+    pm.parse(lines);
+
+    if (layer_nr >= 0)
+    {
+        if (stats != nullptr)
+        {
+            stats->converted = true;
+        }
+        // kept so the layer can be generated again without parsing it, the conversion does not depend on it
+        if (volume != nullptr)
+        {
+            try
+            {
+                volume->store(layer_nr, pm.gcodeparser.pattern);
+            }
+            catch (const std::exception& e)
+            {
+                spdlog::warn("Layer {} is not kept in the volume: {}", layer_nr, e.what());
+            }
+        }
+        auto generated = pm.generate_layer(layer_nr);
+        if (digest)
+        {
+            generated.digest = pm.gcodeparser.pattern.digest();
+        }
+        return generated;
+    }
+    else
+    {
+        return {};
+    }
+}
+
+inline std::string filterLines(
+    std::string_view layer,
+    const std::shared_ptr<const PrinterProfile>& profile = PrinterProfile::defaults(),
+    const CancellationToken& cancellation = {},
+    PipelineStats* stats = nullptr,
+    VolumeStore* volume = nullptr)
+{
+    return convert_layer(layer, profile, cancellation, stats, volume).gcode;
+}
+
+// Cuts a whole sliced file into its layers, each view starts at a ";LAYER:" line and runs up to the next one.
+// Whatever comes before the first layer, such as Cura's start g-code, is not part of any layer.
+inline std::vector<std::string_view> split_layers(std::string_view gcode)
+{
+    constexpr std::string_view marker = ";LAYER:";
+    std::vector<std::string_view> layers;
+    auto begin = gcode.starts_with(marker) ? 0 : gcode.find("\n;LAYER:");
+    while (begin != std::string_view::npos)
+    {
+        if (gcode[begin] == '\n')
+        {
+            begin++;
+        }
+        const auto end = gcode.find("\n;LAYER:", begin);
+        layers.push_back(gcode.substr(begin, end == std::string_view::npos ? std::string_view::npos : end + 1 - begin));
+        begin = end;
+    }
+    return layers;
+}
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef MAPPED_H
+#define MAPPED_H
+
+#include <cerrno>
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A file mapped read-only into memory, so a sliced file of hundreds of megabytes is never copied.
+// Throws std::system_error when the file cannot be opened or mapped.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::filesystem::path& path)
+    {
+#ifdef _WIN32
+        const auto file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), "Could not open " + path.string());
+        }
+        LARGE_INTEGER size;
+        if (! GetFileSizeEx(file, &size))
+        {
+            const auto error = GetLastError();
+            CloseHandle(file);
+            throw std::system_error(static_cast<int>(error), std::system_category(), "Could not read the size of " + path.string());
+        }
+        _size = static_cast<size_t>(size.QuadPart);
+        if (_size > 0)
+        {
+            _mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            const auto error = GetLastError();
+            CloseHandle(file);
+            if (_mapping == nullptr)
+            {
+                throw std::system_error(static_cast<int>(error), std::system_category(), "Could not map " + path.string());
+            }
+            _data = static_cast<const char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+            if (_data == nullptr)
+            {
+                const auto view_error = GetLastError();
+                CloseHandle(_mapping);
+                throw std::system_error(static_cast<int>(view_error), std::system_category(), "Could not map " + path.string());
+            }
+        }
+        else
+        {
+            CloseHandle(file);
+        }
+#else
+        const auto file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "Could not open " + path.string());
+        }
+        struct stat status = {};
+        if (::fstat(file, &status) != 0)
+        {
+            const auto error = errno;
+            ::close(file);
+            throw std::system_error(error, std::generic_category(), "Could not read the size of " + path.string());
+        }
+        _size = static_cast<size_t>(status.st_size);
+        if (_size > 0)
+        {
+            auto* data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, file, 0);
+            const auto error = errno;
+            ::close(file);
+            if (data == MAP_FAILED)
+            {
+                throw std::system_error(error, std::generic_category(), "Could not map " + path.string());
+            }
+            // the layers are read front to back, once
+            ::madvise(data, _size, MADV_SEQUENTIAL);
+            _data = static_cast<const char*>(data);
+        }
+        else
+        {
+            ::close(file);
+        }
+#endif
+    }
+
+    MappedFile(MappedFile&& other) noexcept
+        : _data(std::exchange(other._data, nullptr))
+        , _size(std::exchange(other._size, 0))
+#ifdef _WIN32
+        , _mapping(std::exchange(other._mapping, nullptr))
+#endif
+    {
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept
+    {
+        if (this != &other)
+        {
+            unmap();
+            _data = std::exchange(other._data, nullptr);
+            _size = std::exchange(other._size, 0);
+#ifdef _WIN32
+            _mapping = std::exchange(other._mapping, nullptr);
+#endif
+        }
+        return *this;
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        unmap();
+    }
+
+    std::string_view view() const
+    {
+        return { _data, _size };
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    void unmap()
+    {
+        if (_data == nullptr)
+        {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile(_data);
+        CloseHandle(_mapping);
+        _mapping = nullptr;
+#else
+        ::munmap(const_cast<char*>(_data), _size);
+#endif
+        _data = nullptr;
+    }
+
+    const char* _data = nullptr;
+    size_t _size = 0;
+#ifdef _WIN32
+    HANDLE _mapping = nullptr;
+#endif
+};
+
+#endif
@@ -0,0 +1,387 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "allocations.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <variant>
+#include <vector>
+
+// What one layer conversion did and how long each of its stages took
+struct PipelineStats
+{
+    enum Stage
+    {
+        SPLIT, // cutting the layer into lines
+        PARSE, // lines to moves to the spray pattern, in one pass
+        INTERLACE, // pattern rows to valve order
+        EMIT, // writing the g-code text
+        STAGES
+    };
+
+    static constexpr std::array<std::string_view, STAGES> STAGE_NAMES = { "split", "parse", "interlace", "emit" };
+
+    bool converted = false; // false when the layer was served from the cache
+    std::array<std::chrono::nanoseconds, STAGES> durations{};
+    size_t lines = 0;
+    size_t moves = 0;
+    size_t spray_lines = 0;
+    size_t output_bytes = 0;
+    size_t valve_bits = 0; // bits in the pattern
+    size_t open_valve_bits = 0; // bits in the pattern that open a valve
+
+    // counted in instrumentation builds only, see AllocationTracker
+    AllocationCounters allocations; // of the whole layer
+    std::array<AllocationCounters, STAGES> stage_allocations{};
+};
+
+// Adds the time until it goes out of scope to a stage and records it as a trace span, and its allocations
+// in instrumentation builds. Does nothing without stats while tracing is disabled.
+class StageTimer
+{
+public:
+    StageTimer(PipelineStats* stats, PipelineStats::Stage stage, int layer_nr = Tracer::layer(), std::uint64_t async_id = 0)
+        : _stats(stats)
+        , _stage(stage)
+        , _layer_nr(layer_nr)
+        , _async_id(async_id)
+        , _traced(Tracer::enabled())
+    {
+        if (_stats != nullptr || _traced)
+        {
+            _start = std::chrono::steady_clock::now();
+        }
+        if (AllocationTracker::enabled() && _stats != nullptr)
+        {
+            _allocations.emplace();
+        }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    ~StageTimer()
+    {
+        if (_stats == nullptr && ! _traced)
+        {
+            return;
+        }
+        const auto end = std::chrono::steady_clock::now();
+        if (_stats != nullptr)
+        {
+            _stats->durations[_stage] += end - _start;
+        }
+        if (_allocations)
+        {
+            _stats->stage_allocations[_stage] += _allocations->counted();
+        }
+        if (_traced)
+        {
+            Tracer::instance().record(PipelineStats::STAGE_NAMES[_stage], "stage", _start, end, _layer_nr, _async_id);
+        }
+    }
+
+private:
+    PipelineStats* _stats;
+    PipelineStats::Stage _stage;
+    int _layer_nr;
+    std::uint64_t _async_id;
+    bool _traced;
+    std::chrono::steady_clock::time_point _start;
+    std::optional<AllocationScope> _allocations;
+};
+
+class Counter
+{
+public:
+    void add(std::uint64_t value = 1)
+    {
+        _value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // for a total that is kept elsewhere and copied in by a collector, it must never decrease
+    void set(std::uint64_t total)
+    {
+        _value.store(total, std::memory_order_relaxed);
+    }
+
+    std::uint64_t value() const
+    {
+        return _value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<std::uint64_t> _value{ 0 };
+};
+
+class Gauge
+{
+public:
+    void set(double value)
+    {
+        _value.store(value, std::memory_order_relaxed);
+    }
+
+    double value() const
+    {
+        return _value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<double> _value{ 0.0 };
+};
+
+/**
+ * Log-linear histogram in the spirit of HdrHistogram: every power of two is
+ * split into SUB_BUCKETS linear buckets, so a quantile is reported with at
+ * most 1/SUB_BUCKETS relative error over the whole 64 bit range. Recording
+ * is a few relaxed atomic increments and never blocks.
+ * */
+class Histogram
+{
+public:
+    void record(std::uint64_t value)
+    {
+        _buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(value, std::memory_order_relaxed);
+        auto max = _max.load(std::memory_order_relaxed);
+        while (value > max && ! _max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    std::uint64_t count() const
+    {
+        return _count.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t sum() const
+    {
+        return _sum.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t max() const
+    {
+        return _max.load(std::memory_order_relaxed);
+    }
+
+    // upper bound of the bucket holding the q-th quantile, 0 when nothing was recorded
+    std::uint64_t quantile(double q) const
+    {
+        const auto count = this->count();
+        if (count == 0)
+        {
+            return 0;
+        }
+        const auto rank = std::max<std::uint64_t>(static_cast<std::uint64_t>(std::ceil(std::clamp(q, 0.0, 1.0) * static_cast<double>(count))), 1);
+        std::uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < BUCKETS; bucket++)
+        {
+            seen += _buckets[bucket].load(std::memory_order_relaxed);
+            if (seen >= rank)
+            {
+                return std::min(upper(bucket), max());
+            }
+        }
+        return max();
+    }
+
+private:
+    static constexpr unsigned SUB_BITS = 4;
+    static constexpr std::uint64_t SUB_BUCKETS = 1U << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static size_t index(std::uint64_t value)
+    {
+        if (value < SUB_BUCKETS)
+        {
+            return value;
+        }
+        const unsigned shift = std::bit_width(value) - 1 - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+    }
+
+    static std::uint64_t upper(size_t bucket)
+    {
+        if (bucket < SUB_BUCKETS)
+        {
+            return bucket;
+        }
+        const auto shift = bucket / SUB_BUCKETS - 1;
+        const auto sub = bucket % SUB_BUCKETS + SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::array<std::atomic<std::uint64_t>, BUCKETS> _buckets{};
+    std::atomic<std::uint64_t> _count{ 0 };
+    std::atomic<std::uint64_t> _sum{ 0 };
+    std::atomic<std::uint64_t> _max{ 0 };
+};
+
+/**
+ * Named counters, gauges and histograms that can be rendered in the
+ * Prometheus text format.
+ *
+ * Metrics are registered once, typically at startup, and the returned
+ * references stay valid for the lifetime of the registry; updating them does
+ * not involve the registry. Metrics with the same name but different labels
+ * form one family and should be registered one after the other. Collectors
+ * run before every render, to refresh gauges and counters from state kept elsewhere; they
+ * must not register metrics themselves.
+ * */
+class MetricsRegistry
+{
+public:
+    Counter& counter(std::string name, std::string help, std::string labels = {})
+    {
+        return add<Counter>(std::move(name), std::move(help), std::move(labels), 1.0);
+    }
+
+    Gauge& gauge(std::string name, std::string help, std::string labels = {})
+    {
+        return add<Gauge>(std::move(name), std::move(help), std::move(labels), 1.0);
+    }
+
+    // values are multiplied by scale when rendered, e.g. 1e-9 to record nanoseconds and report seconds
+    Histogram& histogram(std::string name, std::string help, double scale = 1.0, std::string labels = {})
+    {
+        return add<Histogram>(std::move(name), std::move(help), std::move(labels), scale);
+    }
+
+    void collect(std::function<void()> collector)
+    {
+        std::scoped_lock lock(_mutex);
+        _collectors.push_back(std::move(collector));
+    }
+
+    std::string prometheus() const
+    {
+        std::scoped_lock lock(_mutex);
+        for (const auto& collector : _collectors)
+        {
+            collector();
+        }
+
+        std::string text;
+        std::string_view family;
+        for (const auto& entry : _entries)
+        {
+            if (entry.name != family)
+            {
+                family = entry.name;
+                std::format_to(std::back_inserter(text), "# HELP {} {}\n# TYPE {} {}\n", entry.name, entry.help, entry.name, type(entry));
+            }
+            render(text, entry);
+        }
+        return text;
+    }
+
+    // written to a temporary file first, so a scraper never reads half of it
+    bool write_prometheus(const std::filesystem::path& path) const
+    {
+        auto temporary = path;
+        temporary += ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            const auto text = prometheus();
+            if (! file.write(text.data(), static_cast<std::streamsize>(text.size())))
+            {
+                return false;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(temporary, path, ec);
+        return ! ec;
+    }
+
+private:
+    using metric_t = std::variant<std::unique_ptr<Counter>, std::unique_ptr<Gauge>, std::unique_ptr<Histogram>>;
+
+    struct Entry
+    {
+        std::string name;
+        std::string help;
+        std::string labels;
+        double scale;
+        metric_t metric;
+    };
+
+    template<class M>
+    M& add(std::string name, std::string help, std::string labels, double scale)
+    {
+        std::scoped_lock lock(_mutex);
+        for (const auto& entry : _entries)
+        {
+            if (entry.name == name && entry.labels == labels && std::holds_alternative<std::unique_ptr<M>>(entry.metric))
+            {
+                return *std::get<std::unique_ptr<M>>(entry.metric);
+            }
+        }
+        auto metric = std::make_unique<M>();
+        auto& result = *metric;
+        _entries.push_back(Entry{ std::move(name), std::move(help), std::move(labels), scale, std::move(metric) });
+        return result;
+    }
+
+    static std::string_view type(const Entry& entry)
+    {
+        constexpr std::array<std::string_view, 3> types = { "counter", "gauge", "summary" };
+        return types[entry.metric.index()];
+    }
+
+    // histograms are exported as summaries, a few quantiles say more than hundreds of buckets
+    static void render(std::string& text, const Entry& entry)
+    {
+        const auto labels = [&entry](std::string_view extra = {})
+        {
+            if (entry.labels.empty() && extra.empty())
+            {
+                return std::string{};
+            }
+            return std::format("{{{}{}{}}}", entry.labels, entry.labels.empty() || extra.empty() ? "" : ",", extra);
+        };
+
+        if (const auto* counter = std::get_if<std::unique_ptr<Counter>>(&entry.metric))
+        {
+            std::format_to(std::back_inserter(text), "{}{} {}\n", entry.name, labels(), (*counter)->value());
+        }
+        else if (const auto* gauge = std::get_if<std::unique_ptr<Gauge>>(&entry.metric))
+        {
+            std::format_to(std::back_inserter(text), "{}{} {}\n", entry.name, labels(), (*gauge)->value());
+        }
+        else if (const auto* histogram = std::get_if<std::unique_ptr<Histogram>>(&entry.metric))
+        {
+            for (const auto q : { 0.5, 0.9, 0.99, 1.0 })
+            {
+                const auto value = static_cast<double>((*histogram)->quantile(q)) * entry.scale;
+                std::format_to(std::back_inserter(text), "{}{} {}\n", entry.name, labels(std::format("quantile=\"{}\"", q)), value);
+            }
+            std::format_to(std::back_inserter(text), "{}_sum{} {}\n", entry.name, labels(), static_cast<double>((*histogram)->sum()) * entry.scale);
+            std::format_to(std::back_inserter(text), "{}_count{} {}\n", entry.name, labels(), (*histogram)->count());
+        }
+    }
+
+    mutable std::mutex _mutex;
+    std::vector<Entry> _entries;
+    std::vector<std::function<void()>> _collectors;
+};
+
+#endif
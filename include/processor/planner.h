@@ -0,0 +1,147 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include "profile.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstddef>
+#include <memory_resource>
+#include <span>
+#include <vector>
+
+/**
+ * Plans the feedrate of every row of a pass from the valves that switch in
+ * it, instead of printing every row at the fixed feedrates.
+ *
+ * The fixed feedrates are slow enough for the densest pattern. A valve that
+ * switches after one row and again two rows later limits the head to rows
+ * it can cross in 1 / max_valve_frequency, a valve that stays open or closed
+ * limits nothing. The switches are found with the XOR of consecutive valve
+ * sets. Every segment of rows runs at the highest feedrate its switches
+ * allow, up to max_feedrate, then the changes between rows are limited to
+ * what the acceleration can reach over one row. The planned feedrates are
+ * never below the fixed ones, which are known to be safe for any pattern.
+ * */
+class FeedratePlanner
+{
+public:
+    explicit FeedratePlanner(const PrinterParameters& parameters)
+        : _frequency(parameters.max_valve_frequency)
+        , _max_feedrate(parameters.max_feedrate)
+        , _acceleration(parameters.acceleration)
+    {
+    }
+
+    // false when the profile keeps the fixed feedrates
+    bool enabled() const
+    {
+        return _frequency > 0.0f;
+    }
+
+    /**
+     * Each move takes the head one row further. sets[move] are the valves of
+     * the pass set after move, width bytes, or empty when they are not set
+     * there; the valves are closed before the first move. feedrates holds the
+     * fixed feedrate of every move in mm/min and is replaced by the plan.
+     * */
+    void plan(std::span<const std::span<const std::bitset<8>>> sets, std::span<int> feedrates, size_t width, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) const
+    {
+        const size_t moves = feedrates.size();
+        if (! enabled() || moves == 0)
+        {
+            return;
+        }
+
+        // the highest feedrate of every move that leaves each valve enough time between its switches
+        std::pmr::vector<double> limits(moves, static_cast<double>(_max_feedrate), resource);
+        std::pmr::vector<std::bitset<8>> valves(width, resource);
+        std::pmr::vector<long> switched(width * 8, -1, resource); // the move after which a valve last switched
+        for (size_t move = 0; move < moves; move++)
+        {
+            const auto set = sets[move];
+            if (set.empty())
+            {
+                continue;
+            }
+            for (size_t byte = 0; byte < width; byte++)
+            {
+                const auto changed = valves[byte] ^ set[byte];
+                if (changed.none())
+                {
+                    continue;
+                }
+                valves[byte] = set[byte];
+                for (size_t bit = 0; bit < 8; bit++)
+                {
+                    if (! changed[bit])
+                    {
+                        continue;
+                    }
+                    auto& last = switched[byte * 8 + bit];
+                    if (last >= 0)
+                    {
+                        // the rows between both switches must take the valve at least one period
+                        const auto rows = move - static_cast<size_t>(last);
+                        const auto limit = static_cast<double>(_frequency) * 60.0 * static_cast<double>(rows);
+                        if (limit < _max_feedrate)
+                        {
+                            for (auto row = static_cast<size_t>(last) + 1; row <= move; row++)
+                            {
+                                limits[row] = std::min(limits[row], limit);
+                            }
+                        }
+                    }
+                    last = static_cast<long>(move);
+                }
+            }
+        }
+
+        std::pmr::vector<double> planned(moves, resource);
+        for (size_t begin = 0; begin < moves; begin += SEGMENT_ROWS)
+        {
+            const auto end = std::min(begin + SEGMENT_ROWS, moves);
+            const auto limit = *std::min_element(limits.begin() + begin, limits.begin() + end);
+            for (auto move = begin; move < end; move++)
+            {
+                planned[move] = std::floor(std::max(limit, static_cast<double>(feedrates[move])));
+            }
+        }
+
+        // enter and leave the pass at the fixed feedrates, the changes in between are reachable in one row;
+        // rounded down to the whole feedrates that are written
+        const auto reachable = [this](double feedrate)
+        {
+            const auto speed = feedrate / 60.0;
+            return std::floor(std::sqrt(speed * speed + 2.0 * _acceleration * ROW_LENGTH) * 60.0);
+        };
+        auto previous = static_cast<double>(feedrates.front());
+        for (size_t move = 0; move < moves; move++)
+        {
+            planned[move] = std::min(planned[move], reachable(previous));
+            previous = planned[move];
+        }
+        previous = static_cast<double>(feedrates.back());
+        for (size_t move = moves; move-- > 0;)
+        {
+            planned[move] = std::min(planned[move], reachable(previous));
+            previous = planned[move];
+        }
+
+        for (size_t move = 0; move < moves; move++)
+        {
+            feedrates[move] = std::max(feedrates[move], static_cast<int>(planned[move]));
+        }
+    }
+
+private:
+    static constexpr size_t SEGMENT_ROWS = 16;
+    static constexpr double ROW_LENGTH = 1.0; // mm
+
+    float _frequency;
+    int _max_feedrate;
+    float _acceleration;
+};
+
+#endif
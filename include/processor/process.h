@@ -1,22 +1,39 @@
 #ifndef PROCESS_H
 #define PROCESS_H
 
+#include "cancel.h"
 #include "gcode.h"
+#include "metrics.h"
+#include "planner.h"
+#include "profile.h"
+#include "timing.h"
 
+#include <xxhash.h>
+
+#include <algorithm>
+#include <atomic>
+#include <barrier>
 #include <bitset>
+#include <charconv>
 #include <cmath>
+#include <cstdint>
 #include <exception>
 #include <filesystem>
 #include <format>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
-const int x_size = 880 * 2; // we use a resoluation of 0.5 mm, hence the times two.
-const int y_size = 1330 * 2; // TODO make this based on the Cura print bed output (how to get this setting??)
-
 
 class PrintHead
 {
@@ -35,6 +52,11 @@ public:
     /* returns the index and the offset of a coordinate, based on the interval */
     void get_block_indices(float x_coordinate, int& block_index, int& block_offset)
     {
+        // written so NaN fails as well
+        if (! (x_coordinate >= 0.0f && x_coordinate / _valve_spacing < static_cast<float>(std::numeric_limits<int>::max())))
+        {
+            throw std::invalid_argument(std::format("X {} is not under a valve of the print head", x_coordinate));
+        }
         int valve_index = static_cast<int>(x_coordinate / _valve_spacing);
         block_index = static_cast<int>(valve_index / _nozzles_per_block);
         block_offset = valve_index % _nozzles_per_block;
@@ -56,6 +78,44 @@ private:
     const float _valve_spacing;
 };
 
+// Rows of valve bytes, stored back to back in a single buffer.
+// pattern[row] is a span over the bytes of that row.
+class ValveRows
+{
+public:
+    ValveRows(size_t rows, size_t width, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : _rows(rows)
+        , _width(width)
+        , _data(rows * width, resource)
+    {
+    }
+
+    std::span<std::bitset<8>> operator[](size_t row)
+    {
+        return { _data.data() + row * _width, _width };
+    }
+
+    std::span<const std::bitset<8>> operator[](size_t row) const
+    {
+        return { _data.data() + row * _width, _width };
+    }
+
+    size_t size() const
+    {
+        return _rows;
+    }
+
+    size_t width() const
+    {
+        return _width;
+    }
+
+private:
+    size_t _rows;
+    size_t _width;
+    std::pmr::vector<std::bitset<8>> _data;
+};
+
 // Class holding the pattern that has to be sprayed
 // can be filled with individual 'spray lines'
 // and will generate our machine specific output g-code
@@ -63,22 +123,28 @@ private:
 class SprayPattern
 {
 public:
-    SprayPattern(PrintHead ph, uint16_t y_bed_size, uint16_t nr_passes = 2)
+    SprayPattern(PrintHead ph, uint16_t y_bed_size, uint16_t nr_passes = 2, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
         : _ph(ph)
         , _spray_pattern_data_width(std::ceil(_ph.nr_of_nozzles() * nr_passes / 8.0))
-        , pattern(y_bed_size, std::vector<std::bitset<8>>(_spray_pattern_data_width)){
-
-        };
+        , pattern(y_bed_size, _spray_pattern_data_width, resource)
+    {
+    }
 
     void set_layer_nr(int layer_nr)
     {
         _layer_nr = layer_nr;
     }
 
+    // only an extrusion along Y can be sprayed, the valves sit side by side along X
+    static bool along_y(const GCodeMove& begin, const GCodeMove& end)
+    {
+        constexpr float tolerance = 1e-8;
+        return std::fabs(begin.X - end.X) <= tolerance;
+    }
+
     void add_spray_line(GCodeMove begin, GCodeMove end)
     {
-        float tolerance = 1e-8;
-        if (std::fabs(begin.X - end.X) > tolerance)
+        if (! along_y(begin, end))
         {
             throw std::invalid_argument("Begin and end coordinates do not have the same X-value");
         }
@@ -93,15 +159,26 @@ public:
         set_valves(begin.X, first.Y, second.Y);
     };
 
-    void set_valves(uint16_t x_coord, uint16_t y_begin_coord, uint16_t y_end_coord)
+    // Throws std::invalid_argument for a line that is not on the bed, the rows end before y_end_coord
+    void set_valves(float x_coord, float y_begin_coord, float y_end_coord)
     {
+        // written so NaN fails as well
+        if (! (y_begin_coord >= 0.0f && y_end_coord < static_cast<float>(pattern.size() + 1)))
+        {
+            throw std::invalid_argument(std::format("Y {} to {} is not on the bed of {} rows", y_begin_coord, y_end_coord, pattern.size()));
+        }
         // first convert from coordinate to y_coord index
         int begin_index = get_y_index(y_begin_coord);
         int end_index = get_y_index(y_end_coord);
 
         // also get the valve that we have to turn on/off
         int block_index, block_offset;
-        _ph.get_block_indices(x_coord, block_index, block_offset);
+        // whole millimeters, like the coordinates were before they were checked
+        _ph.get_block_indices(std::trunc(x_coord), block_index, block_offset);
+        if (static_cast<size_t>(block_index) >= pattern.width() || block_offset >= 8)
+        {
+            throw std::invalid_argument(std::format("X {} is beyond the valves of the print head", x_coord));
+        }
 
         for (int n = begin_index; n < end_index; n++)
         {
@@ -125,36 +202,81 @@ public:
         return _spray_pattern_data_width;
     }
 
+    // hash of the packed rows, equal patterns have equal digests
+    std::uint64_t digest() const
+    {
+        XXH3_state_t state;
+        XXH3_64bits_reset(&state);
+        std::vector<unsigned char> packed(pattern.width());
+        for (size_t row = 0; row < pattern.size(); row++)
+        {
+            const auto valves = pattern[row];
+            std::transform(
+                valves.begin(),
+                valves.end(),
+                packed.begin(),
+                [](const std::bitset<8>& byte)
+                {
+                    return static_cast<unsigned char>(byte.to_ulong());
+                });
+            XXH3_64bits_update(&state, packed.data(), packed.size());
+        }
+        return XXH3_64bits_digest(&state);
+    }
+
     PrintHead _ph;
     const uint16_t _spray_pattern_data_width;
-    std::vector<std::vector<std::bitset<8>>> pattern;
+    ValveRows pattern;
     int _layer_nr = -1;
 };
 
+// The g-code of a layer, with the part that only depends on its pattern marked
+struct GeneratedLayer
+{
+    std::string gcode;
+    int layer_nr = -1;
+    size_t body_begin = 0; // everything from the first move until the layer is back at its start
+    size_t body_end = 0;
+    std::optional<std::uint64_t> digest; // of the pattern the layer was generated from, when the caller needs it
+    double time = 0.0; // estimated machine time in seconds
+
+    std::string_view body() const
+    {
+        return std::string_view{ gcode }.substr(body_begin, body_end - body_begin);
+    }
+};
+
 class GCodeGenerator
 {
 public:
-    const int Y_INITIAL_POSITION = 118;
-    const int Y_MAXIMUM_POSITION = 1462;
-    const int X_ZERO_POSITION = 0;
-    const int X_MAXIMUM_POSITION = 1388;
-    const int Y_FEED_RATE = 8000;
-
-    const int N_NOZZLES = 88;
-    const int N_NOZZLES_PER_MANIFOLD = 8;
-    const int N_PASSES = 2;
-    const int PRINTABLE_AREA = (880, 1462);
-    const int RESOLUTION = N_NOZZLES * N_PASSES;
-    const int RESOLUTION_MM = 5;
+    explicit GCodeGenerator(std::shared_ptr<const PrinterProfile> profile = PrinterProfile::defaults(), std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : estimator(profile->parameters().macro_costs)
+        , _profile(std::move(profile))
+        , _planner(_profile->parameters())
+        , _resource(resource)
+        , _scratch(resource)
+    {
+    }
+
+    const PrinterProfile& profile() const
+    {
+        return *_profile;
+    }
 
     std::string print_begin_cmd(int NUMBER_OF_LAYERS)
     {
         return std::format(
             "SET_PRINT_STATS_INFO TOTAL_LAYER={}\n"
             "G28 X Y SET_FIRST_PASS G4 P3000 ;wait for servo\n"
-            "VALVES_SET VALUES=0,0,0,0,0,0,0,0,0,0,0\n"
+            "{}"
             "VALVES_ENABLE ; change to VALVES_DISABLE to do run without valves active\n",
-            NUMBER_OF_LAYERS);
+            NUMBER_OF_LAYERS,
+            _profile->closed_valves());
+    }
+
+    std::string print_time_cmd(double print_time)
+    {
+        return std::format(";PRINT_TIME:{:.3f}\n", print_time);
     }
 
     std::string print_end_cmd(int NUMBER_OF_LAYERS)
@@ -168,38 +290,58 @@ public:
             ";Layer{}\n"
             "SET_PRINT_STATS_INFO CURRENT_LAYER={}\n"
             "RESPOND MSG=\"Start layer {}\"\n"
-            "FILL_HOPPER_ASYNC\n"
-            "SET_FIRST_PASS\n"
-            "Z_ONE_LAYER\n"
-            "PAUSE_PRINTER ;wait for button press\n"
-            "G1 X{} F6000; deposit material\n",
+            "{}",
             layer_idx + 1,
             layer_idx + 1,
             layer_idx + 1,
-            X_MAXIMUM_POSITION);
+            _profile->layer_begin_text());
+    }
+
+    // summary of the estimated layer time; every field is clamped to its width, so the line always has the same length
+    std::string layer_time_cmd(double layer_time, double moves, double dwell, double macros)
+    {
+        static constexpr double max_seconds = 99999999.999; // the most {:12.3f} holds
+        const auto field = [](double seconds)
+        {
+            return std::clamp(seconds, 0.0, max_seconds);
+        };
+        return std::format(
+            ";ESTIMATED_LAYER_TIME:{:12.3f} MOVES:{:12.3f} DWELL:{:12.3f} MACROS:{:12.3f}\n",
+            field(layer_time),
+            field(moves),
+            field(dwell),
+            field(macros));
+    }
+
+    std::string time_elapsed_cmd(double elapsed)
+    {
+        return std::format(";TIME_ELAPSED:{:.3f}\n", elapsed);
     }
 
     std::string layer_return_cmd(int feedspeed, int y_pos)
     {
         return std::format(
             "G1 Y{} F{}\n"
-            "VALVES_SET VALUES=0,0,0,0,0,0,0,0,0,0,0\n"
+            "{}"
             "G1 Y{}\n"
             "FILL_HOPPER_ASYNC\n"
             "SET_SECOND_PASS\n"
-            "G4 P3000\n",
+            "G4 P{}\n",
             y_pos,
             feedspeed,
-            y_pos + 1);
+            _profile->closed_valves(),
+            y_pos + 1,
+            _profile->parameters().pass_dwell);
     }
 
     std::string layer_end_cmd(int y_start_bed_pos)
     {
         return std::format(
             "G1 Y{}\n"
-            "VALVES_SET VALUES=0,0,0,0,0,0,0,0,0,0,0\n"
+            "{}"
             "G1 Y0\n",
-            y_start_bed_pos - 1);
+            y_start_bed_pos - 1,
+            _profile->closed_valves());
     }
 
     std::bitset<8> extractEverySecondBit(const std::bitset<8>& input1, const std::bitset<8>& input2)
@@ -223,17 +365,22 @@ public:
     // last element (i.e. 10000001)
     //                    ^      ^
     //             index [7]    [0]
-    void interlace_and_separate(std::vector<std::bitset<8>>& data)
+    void interlace_and_separate(std::span<std::bitset<8>> data)
+    {
+        _scratch.assign(data.begin(), data.end());
+        interlace_and_separate(_scratch, data);
+    }
+
+    // same as above, but leaves the input untouched and writes every bit of data
+    void interlace_and_separate(std::span<const std::bitset<8>> orig, std::span<std::bitset<8>> data)
     {
-        if (data.size() % 2 != 0)
+        if (orig.size() % 2 != 0 || data.size() != orig.size())
         {
             throw std::invalid_argument("Input vector must contain an even number of elements");
         }
 
         int s = data.size() / 2;
 
-        std::vector<std::bitset<8>> orig(data.begin(), data.end());
-        int idx = 0;
         for (int n = 0; n < data.size(); n++)
         {
             for (int i = 0; i < 8; i += 2) // process all bits in chunks of 2
@@ -258,135 +405,503 @@ public:
         }
     }
 
-    std::string generate(SprayPattern sp, uint16_t layer_nr = 0, uint16_t y_start_of_bed = 0, uint16_t bed_length = 1400)
+    // The rows of the pattern the valves are set after in valve order, allocated from the memory resource of the
+    // generator. Both passes only set the valves after the rows that end on an odd Y, so only those are kept,
+    // the one of row is at row / 2.
+    ValveRows interlace(const SprayPattern& sp, int y_start_of_bed)
     {
-        // get an idea of the max size of the vector that is need
-        // so we can allocate in one go
-        //  one entry will become max: G1 Y0000\nSET_VALVES VALUES=255,255,255,255,255,255,255,255,255,255,255\n
-        int MAX_LEN_ONE_ENTRY = 71;
-        int n = sp.pattern.size() * MAX_LEN_ONE_ENTRY + 1;
+        const size_t first = (y_start_of_bed + 1) % 2 == 0 ? 0 : 1;
+        ValveRows interlaced((sp.pattern.size() + 1 - first) / 2, sp.pattern.width(), _resource);
+        for (size_t row = first; row < sp.pattern.size(); row += 2)
+        {
+            interlace_and_separate(sp.pattern[row], interlaced[row / 2]);
+        }
 
-        std::string s;
-        s.reserve(n);
+        if (stats != nullptr)
+        {
+            size_t open_valve_bits = 0;
+            for (size_t row = 0; row < sp.pattern.size(); row++)
+            {
+                for (const auto& valves : sp.pattern[row])
+                {
+                    open_valve_bits += valves.count();
+                }
+            }
+            stats->valve_bits += sp.pattern.size() * sp.pattern.width() * 8;
+            stats->open_valve_bits += open_valve_bits;
+        }
+        return interlaced;
+    }
 
-        s += layer_begin_cmd(layer_nr);
+    // does not modify the pattern, so it can be generated again
+    std::string generate(const SprayPattern& sp, uint16_t layer_nr = 0, uint16_t y_start_of_bed = 0, uint16_t bed_length = 1400)
+    {
+        return generate_layer(sp, layer_nr, y_start_of_bed, bed_length).gcode;
+    }
 
-        int y_pos = y_start_of_bed;
-        int base_feedspeed = 5454;
-        int joint_feedspeed = 7691; // was 8460, we reduce by 10% ->  7691 (becasue it is inversed)
-        int last_feedspeed = feedspeed;
+    // same as generate(), but tells where the body of the layer is in the g-code. A layer does not know the
+    // layers printed before it, the plugin gets them one call at a time and in any order, so the ;TIME_ELAPSED
+    // of the print is only written by a converter that sees the whole print, see write_in_order
+    GeneratedLayer generate_layer(const SprayPattern& sp, uint16_t layer_nr = 0, uint16_t y_start_of_bed = 0, uint16_t bed_length = 1400)
+    {
+        const auto& parameters = _profile->parameters();
+        const int rows = static_cast<int>(sp.pattern.size());
+        const int base_feedspeed = parameters.base_feedrate;
 
-        for (auto& p : sp.pattern)
+        const auto interlaced = [&]()
+        {
+            StageTimer timer(stats, PipelineStats::INTERLACE);
+            return interlace(sp, y_start_of_bed);
+        }();
+        StageTimer timer(stats, PipelineStats::EMIT);
+
+        // empty when every row is printed at the fixed feedrates
+        const auto [forward, backward] = plan_feedrates(interlaced, rows, y_start_of_bed);
+        const Passes passes{ interlaced, forward, backward, y_start_of_bed, rows };
+
+        // the time of the layer goes in front of it, so all moves are estimated before any text is written
+        estimator.begin_layer();
+        estimator.fill_hopper();
+        estimator.set_pass();
+        estimator.z_one_layer();
+        estimator.pause_printer();
+        estimator.move_x(parameters.x_maximum, parameters.deposit_feedrate);
+        for (int row = 0; row < rows; row++)
         {
-            interlace_and_separate(p);
-            int x_pos = X_MAXIMUM_POSITION - y_pos;
-            if (x_pos < 0)
+            const int y_pos = y_start_of_bed + row;
+            if ((y_pos & CANCELLATION_INTERVAL) == 0)
             {
-                x_pos = 0;
+                cancellation.throw_if_cancelled();
             }
+            estimator.move(x_position(y_pos), y_pos, forward_feedrate(passes, row));
+        }
+
+        // and the return leg
+        const int y_return = y_start_of_bed + rows;
+        estimator.set_feedrate(base_feedspeed);
+        estimator.move_y(y_return);
+        estimator.move_y(y_return + 1);
+        estimator.fill_hopper();
+        estimator.set_pass();
+        estimator.dwell(parameters.pass_dwell);
+        for (int move = 0; move < rows; move++)
+        {
+            if (const int feedspeed = return_feedrate(passes, move); feedspeed > 0)
+            {
+                estimator.set_feedrate(feedspeed);
+            }
+            estimator.move_y(y_return - move);
+        }
+        estimator.move_y(y_start_of_bed);
+        estimator.move_y(0);
+        estimator.end_layer();
+
+        auto header = layer_time_cmd(estimator.layer_time(), estimator.layer_moves(), estimator.layer_dwell(), estimator.layer_macros());
+        header += layer_begin_cmd(layer_nr);
+        const auto between = layer_return_cmd(base_feedspeed, y_return);
+        const auto footer = layer_end_cmd(y_start_of_bed + 1);
+
+        auto s = emit_rows(passes, header, between, footer);
+        const size_t body_end = s.size();
+        if (stats != nullptr)
+        {
+            stats->output_bytes += s.size();
+        }
+        return { std::move(s), layer_nr, header.size(), body_end, std::nullopt, estimator.layer_time() };
+    }
+
+    // number of threads the rows of a large layer are written on; the threads are started per layer, so this
+    // only pays off when single layers are converted one at a time, not when whole prints are converted in parallel
+    static void set_emit_threads(size_t threads)
+    {
+        _emit_threads.store(std::max<size_t>(threads, 1), std::memory_order_relaxed);
+    }
+
+    static size_t emit_threads()
+    {
+        return _emit_threads.load(std::memory_order_relaxed);
+    }
+
+    TimeEstimator estimator;
+    CancellationToken cancellation;
+    PipelineStats* stats = nullptr; // filled in when set
+
+private:
+    // what the rows of both passes of a layer are written from
+    struct Passes
+    {
+        const ValveRows& interlaced; // see interlace()
+        std::span<const int> forward; // planned feedrates, empty when fixed
+        std::span<const int> backward;
+        int y_start;
+        int rows;
+    };
+
+    // counts the bytes the rows take, so every block knows where its rows go before they are written
+    struct TextSize
+    {
+        size_t bytes = 0;
+
+        void text(std::string_view text)
+        {
+            bytes += text.size();
+        }
+
+        void number(int value)
+        {
+            char buffer[16];
+            bytes += static_cast<size_t>(std::to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer);
+        }
+
+        void end_values()
+        {
+        }
+    };
+
+    // writes the rows into memory that was sized with TextSize
+    struct TextWriter
+    {
+        char* out;
+
+        void text(std::string_view text)
+        {
+            out = std::copy(text.begin(), text.end(), out);
+        }
+
+        void number(int value)
+        {
+            char buffer[16];
+            const auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+            out = std::copy(buffer, end, out);
+        }
+
+        // the last value ends in a comma, the line ends there instead
+        void end_values()
+        {
+            *(out - 1) = '\n';
+        }
+    };
+
+    int x_position(int y_pos) const
+    {
+        return std::max(_profile->parameters().x_maximum - y_pos, 0);
+    }
+
+    int forward_feedrate(const Passes& passes, int row) const
+    {
+        return passes.forward.empty() ? fixed_feedrate(passes.y_start + row, passes.y_start) : passes.forward[row];
+    }
 
+    // the feedrate the return leg changes to at move, 0 when it keeps the one before
+    int return_feedrate(const Passes& passes, int move) const
+    {
+        if (passes.backward.empty())
+        {
+            return 0;
+        }
+        const int previous = move == 0 ? _profile->parameters().base_feedrate : passes.backward[move - 1];
+        return passes.backward[move] != previous ? passes.backward[move] : 0;
+    }
+
+    template<class Sink>
+    void valves_set(Sink& sink, std::span<const std::bitset<8>> valves) const
+    {
+        sink.text("VALVES_SET VALUES=");
+        for (const auto& value : valves)
+        {
+            sink.text(_profile->valve_value(value));
+        }
+        sink.end_values();
+    }
 
-            if (y_pos == y_start_of_bed)
+    template<class Sink>
+    void forward_row(Sink& sink, const Passes& passes, int row) const
+    {
+        const int y_pos = passes.y_start + row;
+        sink.text("G1 Y");
+        sink.number(y_pos);
+        sink.text(" X");
+        sink.number(x_position(y_pos));
+        sink.text(" F");
+        sink.number(forward_feedrate(passes, row));
+        sink.text("\n");
+        if ((y_pos + 1) % 2 == 0) // only even
+        {
+            const auto p = passes.interlaced[row / 2];
+            valves_set(sink, p.first(p.size() / 2));
+        }
+    }
+
+    template<class Sink>
+    void return_row(Sink& sink, const Passes& passes, int move) const
+    {
+        const int y_pos = passes.y_start + passes.rows - move;
+        sink.text("G1 Y");
+        sink.number(y_pos);
+        if (const int feedspeed = return_feedrate(passes, move); feedspeed > 0)
+        {
+            sink.text(" F");
+            sink.number(feedspeed);
+        }
+        sink.text("\n");
+        if (y_pos % 2 == 0) // only even
+        {
+            if (y_pos == 0) // we already returned to base, so we close the valves. This can only happen if the bed_begin_y_coord = 0
             {
-                s += "G1 Y" + std::to_string(y_pos++) + " X" + std::to_string(x_pos) + " F" + std::to_string(joint_feedspeed) + "\n"; // the first time we add the print velocity
+                sink.text("VALVES_SET VALUES=");
+                sink.text(_profile->closed_values());
+                sink.end_values();
             }
             else
             {
-                if (x_pos == 0) // hopper is at the end, we move only the printhead
-                {
-                    s += "G1 Y" + std::to_string(y_pos++) + " X" + std::to_string(x_pos) + " F" + std::to_string(base_feedspeed) + '\n';
-                }
-                else
-                {
-                    s += "G1 Y" + std::to_string(y_pos++) + " X" + std::to_string(x_pos) + " F" + std::to_string(joint_feedspeed) + '\n';
-                }
+                // no need to interlace again, already done before
+                const auto p = passes.interlaced[(passes.rows - 1 - move) / 2];
+                valves_set(sink, p.subspan(p.size() / 2));
             }
+        }
+    }
 
-            if (y_pos % 2 == 0) // only even
+    // the rows of blocks [begin, end) of a pass, false when the conversion was cancelled on the way
+    template<class Sink>
+    bool write_block(Sink& sink, const Passes& passes, bool forward, int begin, int end) const
+    {
+        for (int row = begin; row < end; row++)
+        {
+            if ((row & CANCELLATION_INTERVAL) == 0 && cancellation.is_cancelled())
             {
-                s += "VALVES_SET VALUES=";
-                for (int i = 0; i < p.size() / 2; i++)
-                {
-                    reverse(p[i]);
-                    s += std::to_string(p[i].to_ulong()) + ',';
-                }
-                s.pop_back(); // remove last comma
-                s += '\n';
+                return false;
+            }
+            if (forward)
+            {
+                forward_row(sink, passes, row);
+            }
+            else
+            {
+                return_row(sink, passes, row);
             }
         }
+        return true;
+    }
 
-        s += layer_return_cmd(base_feedspeed, y_pos++);
-
-        // and the return leg
-        for (auto it = sp.pattern.rbegin(); it != sp.pattern.rend(); ++it)
+    /**
+     * The layer as header, the forward pass, between, the return pass and
+     * footer. Both passes are cut into blocks of rows. Every block is sized
+     * first, then the layer is allocated once and every block writes its rows
+     * straight to where they go. Large layers do this on emit_threads()
+     * threads, the text of a row only depends on the row.
+     * */
+    std::string emit_rows(const Passes& passes, std::string_view header, std::string_view between, std::string_view footer) const
+    {
+        const size_t workers = std::clamp<size_t>(static_cast<size_t>(passes.rows) / MIN_BLOCK_ROWS, 1, emit_threads());
+        const size_t blocks = 2 * workers; // the forward pass, then the return pass
+        const auto block_rows = [&](size_t block)
         {
-            // no need to interlace again, already done before
-            s += "G1 Y" + std::to_string(--y_pos) + '\n';
+            const auto part = block % workers;
+            return std::pair{ static_cast<int>(passes.rows * part / workers), static_cast<int>(passes.rows * (part + 1) / workers) };
+        };
+        std::pmr::vector<size_t> offsets(blocks, _resource);
 
-            if (y_pos % 2 == 0) // only even
+        std::string s;
+        std::exception_ptr error;
+        std::barrier sized(static_cast<std::ptrdiff_t>(workers));
+        const auto work = [&](size_t worker)
+        {
+            for (auto block = worker; block < blocks; block += workers)
             {
-                s += "VALVES_SET VALUES=";
-                for (int i = (*it).size() / 2; i < (*it).size(); i++)
+                TextSize size;
+                const auto [begin, end] = block_rows(block);
+                write_block(size, passes, block < workers, begin, end);
+                offsets[block] = size.bytes;
+            }
+            sized.arrive_and_wait();
+            if (worker == 0)
+            {
+                try
                 {
-                    if (y_pos == 0) // we already returned to base, so we close the valves. This can only happen if the bed_begin_y_coord = 0
-                    {
-                        s += "0,0,0,0,0,0,0,0,0,0,0,";
-                    }
-                    else
+                    size_t position = header.size();
+                    for (size_t block = 0; block < blocks; block++)
                     {
-                        reverse((*it)[i]);
-                        s += std::to_string((*it)[i].to_ulong()) + ',';
+                        position += block == workers ? between.size() : 0;
+                        position += std::exchange(offsets[block], position);
                     }
+                    s.resize(position + footer.size());
+                    std::copy(header.begin(), header.end(), s.data());
+                    std::copy(between.begin(), between.end(), s.data() + offsets[workers] - between.size());
+                    std::copy(footer.begin(), footer.end(), s.data() + position);
                 }
-                s.pop_back(); // remove last comma
-                s += '\n';
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+            }
+            sized.arrive_and_wait();
+            if (error)
+            {
+                return;
             }
+            for (auto block = worker; block < blocks; block += workers)
+            {
+                TextWriter writer{ s.data() + offsets[block] };
+                const auto [begin, end] = block_rows(block);
+                write_block(writer, passes, block < workers, begin, end);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        threads.reserve(workers - 1);
+        for (size_t worker = 1; worker < workers; worker++)
+        {
+            threads.emplace_back(work, worker);
+        }
+        work(0);
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        if (error)
+        {
+            std::rethrow_exception(error);
         }
+        cancellation.throw_if_cancelled();
+        return s;
+    }
 
-        // end of layer gcode
-        s += layer_end_cmd(y_pos);
+    // the feedrate of the row at y_pos when it is not planned
+    int fixed_feedrate(int y_pos, int y_start_of_bed) const
+    {
+        const auto& parameters = _profile->parameters();
+        // the first row gets the print velocity, once the hopper is at the end only the printhead moves
+        return y_pos != y_start_of_bed && parameters.x_maximum - y_pos <= 0 ? parameters.base_feedrate : parameters.joint_feedrate;
+    }
 
-        return s;
+    // the planned feedrates of the rows of both passes in the order they are printed, both empty when the profile does not plan them
+    std::pair<std::pmr::vector<int>, std::pmr::vector<int>> plan_feedrates(const ValveRows& interlaced, size_t rows, int y_start_of_bed) const
+    {
+        std::pair<std::pmr::vector<int>, std::pmr::vector<int>> planned{ std::pmr::vector<int>(_resource), std::pmr::vector<int>(_resource) };
+        if (! _planner.enabled())
+        {
+            return planned;
+        }
+        auto& [forward, backward] = planned;
+        const size_t width = interlaced.width() / 2;
+        std::pmr::vector<std::span<const std::bitset<8>>> sets(rows, _resource);
+
+        // the valves are set after every row that ends on an even Y, as generate() writes them
+        forward.resize(rows);
+        for (size_t row = 0; row < rows; row++)
+        {
+            const int y_pos = y_start_of_bed + static_cast<int>(row);
+            forward[row] = fixed_feedrate(y_pos, y_start_of_bed);
+            sets[row] = (y_pos + 1) % 2 == 0 ? interlaced[row / 2].first(width) : std::span<const std::bitset<8>>{};
+        }
+        _planner.plan(sets, forward, width, _resource);
+        forward.front() = fixed_feedrate(y_start_of_bed, y_start_of_bed); // comes from the far end of the bed, not from a row
+
+        const std::pmr::vector<std::bitset<8>> closed(width, _resource);
+        backward.assign(rows, _profile->parameters().base_feedrate);
+        for (size_t move = 0; move < rows; move++)
+        {
+            const int y_pos = y_start_of_bed + static_cast<int>(rows - move);
+            const auto row = rows - 1 - move;
+            sets[move] = y_pos % 2 != 0 ? std::span<const std::bitset<8>>{} : y_pos == 0 ? std::span<const std::bitset<8>>(closed) : interlaced[row / 2].subspan(width);
+        }
+        _planner.plan(sets, backward, width, _resource);
+        return planned;
     }
+
+    static constexpr int CANCELLATION_INTERVAL = 63; // poll once every 64 rows
+    static constexpr size_t MIN_BLOCK_ROWS = 256; // fewer rows are not worth starting a thread for
+    inline static std::atomic<size_t> _emit_threads{ 1 };
+    std::shared_ptr<const PrinterProfile> _profile;
+    FeedratePlanner _planner;
+    std::pmr::memory_resource* _resource;
+    std::pmr::vector<std::bitset<8>> _scratch;
 };
 
 /* can be fed gcode, and it will populate the Spraypattern*/
 class GCodeParser
 {
 public:
-    GCodeParser(PrintHead ph, uint16_t x_bed_size, uint16_t y_bed_size)
-        : pattern(ph, y_bed_size, x_bed_size / ph.printhead_size()){
-
-        };
+    GCodeParser(PrintHead ph, uint16_t x_bed_size, uint16_t y_bed_size, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : pattern(ph, y_bed_size, x_bed_size / ph.printhead_size(), resource)
+    {
+    }
 
     void set_layer_nr(int layer_nr)
     {
         pattern.set_layer_nr(layer_nr);
     }
 
-    void parse(std::string line)
+    void parse(std::string_view line)
     {
-        try
+        if ((++_parsed_lines & CANCELLATION_INTERVAL) == 0)
+        {
+            cancellation.throw_if_cancelled();
+        }
+        auto current_move = try_get_g_move(line);
+        if (! current_move.has_value())
+        {
+            return; // not a valid G-code command aparently
+        }
+        if (current_move->isExtrusionMove() && first_move_processed)
         {
-            auto current_move = get_g_move(line);
-            if (current_move.isExtrusionMove())
+            if (! SprayPattern::along_y(prev_move, *current_move))
             {
-                if (first_move_processed)
+                return; // a wall or skin that cannot be sprayed, skipped as if it were not there
+            }
+            pattern.add_spray_line(prev_move, *current_move);
+        }
+        first_move_processed = true;
+        prev_move = *current_move;
+    }
+
+    // Same as parsing the lines one by one, every move is added to the pattern as soon as it is read
+    void parse(std::span<const std::string_view> lines)
+    {
+        StageTimer timer(stats, PipelineStats::PARSE);
+        size_t moves = 0;
+        size_t spray_lines = 0;
+        for (const auto line : lines)
+        {
+            if ((++_parsed_lines & CANCELLATION_INTERVAL) == 0)
+            {
+                cancellation.throw_if_cancelled();
+            }
+            auto current_move = try_get_g_move(line);
+            if (! current_move.has_value())
+            {
+                continue;
+            }
+            moves++;
+            if (current_move->isExtrusionMove() && first_move_processed)
+            {
+                if (! SprayPattern::along_y(prev_move, *current_move))
                 {
-                    pattern.add_spray_line(prev_move, current_move);
+                    continue; // a wall or skin that cannot be sprayed, skipped as if it were not there
                 }
+                pattern.add_spray_line(prev_move, *current_move);
+                spray_lines++;
             }
             first_move_processed = true;
-            prev_move = current_move;
+            prev_move = *current_move;
         }
-        catch (std::invalid_argument e)
+        if (stats != nullptr)
         {
-            // not a valid G-code command aparently
+            stats->lines += lines.size();
+            stats->moves += moves;
+            stats->spray_lines += spray_lines;
         }
     }
+
     bool first_move_processed = false;
     SprayPattern pattern;
     GCodeMove prev_move;
+    CancellationToken cancellation;
+    PipelineStats* stats = nullptr; // filled in when set
+
+private:
+    static constexpr size_t CANCELLATION_INTERVAL = 1023; // poll once every 1024 lines
+    size_t _parsed_lines = 0;
 };
 
 
@@ -417,11 +932,28 @@ public:
      * @param bed_length - The length in mm of the bed. This plus the y_start_pos
      * should be equal less than the maximum y-position the print head can reach.
      * */
-    PrintManager(PrintHead print_head, int y_start_pos, int bed_length)
+    PrintManager(
+        PrintHead print_head,
+        int y_start_pos,
+        int bed_length,
+        std::shared_ptr<const PrinterProfile> profile = PrinterProfile::defaults(),
+        std::pmr::memory_resource* resource = std::pmr::get_default_resource())
         : printhead(print_head)
         , _y_start_pos(y_start_pos)
         , _bed_length(bed_length - 1) // substract one, because we need it to stop, close the valves and return
-        , gcodeparser(printhead, printhead.printhead_size() * 2, _bed_length)
+        , gcodeparser(printhead, printhead.printhead_size() * 2, _bed_length, resource)
+        , gg(std::move(profile), resource)
+    {
+    }
+
+    // Creates the print head and bed from the profile, the pattern and scratch rows are allocated from resource
+    explicit PrintManager(const std::shared_ptr<const PrinterProfile>& profile, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : PrintManager(
+            PrintHead(profile->parameters().valve_spacing, profile->parameters().nr_of_blocks, profile->parameters().nozzles_per_block),
+            profile->parameters().y_start,
+            profile->parameters().y_end - profile->parameters().y_start,
+            profile,
+            resource)
     {
     }
 
@@ -430,82 +962,40 @@ public:
         return gg.generate(gcodeparser.pattern, layer_nr, _y_start_pos, _bed_length);
     }
 
-    void parse(std::string line)
+    GeneratedLayer generate_layer(uint16_t layer_nr)
     {
-        gcodeparser.parse(line);
+        return gg.generate_layer(gcodeparser.pattern, layer_nr, _y_start_pos, _bed_length);
     }
 
-    PrintHead printhead;
-    int _y_start_pos;
-    int _bed_length;
-    GCodeParser gcodeparser;
-    GCodeGenerator gg;
-};
-
-int asdasd(int a)
-{
-    std::filesystem::path currentPath = std::filesystem::current_path();
-
-    std::string dataPath = currentPath.string() + "\\..\\..\\dat\\";
-    std::string filename = "commands.txt";
-
-    /* The resulting G-code is getnerated in several steps:
-     1. We construct a matrixs representing the Y direction
-        cells of 0.5mm long, and in the X direction cells of 5mm wide.
-        The columns, containing 11 8-bit values, represent the bit values
-        for each of the 88 valves. The rows represent the y-coordinate (step size 0.5mm)
-        As the print is interlaced, the matrix has twice the number of columns (22).
-     2. as Cura doesn't output the print lines exactly at 5 mm intervals,
-        we first calculate the offset, to be applied to all feature X coordinates
-     3. we step through the original G-code, looking for extrusion moves. Every extrusion
-        move is then mapped into our output matrix based on the start and end-position of
-        the extrusion move.
-     4. the output matrix is converted to G-code that our printer understands.
-     */
-
-
-    const int number_of_nozzles = 88;
-    const int n_vals = 22; // 11 first the 88 valves on the first pass, and 11 for the return pass
-
-    std::vector<std::vector<uint8_t>> V_OUT(y_size, std::vector<uint8_t>(n_vals));
-
-    // Convert the path to a string and print it
-    std::cout << "Data directory: " << dataPath << std::endl;
-
-    // Open the file
-    std::ifstream file(dataPath + filename);
-    if (! file.is_open())
+    void parse(std::string_view line)
     {
-        std::cerr << "Error opening file!" << std::endl;
-        return 1;
+        gcodeparser.parse(line);
     }
 
-    // Vector to store Command objects
-
-    // Read file line by line
-    std::string line;
-    bool is_extruding = false;
-    GCodeMove last_cmd;
-    while (std::getline(file, line))
+    void parse(std::span<const std::string_view> lines)
     {
-        // Check if the line starts with 'G0' or 'G1'
-        if (line.substr(0, 2) == "G0" || line.substr(0, 2) == "G1")
-        {
-            // Parse the line and create a Command object
-            GCodeMove current_cmd = get_g_move(line);
-
-            if (current_cmd.isExtrusionMove())
-            {
-                // add_valve_output(last_cmd, current_cmd, V_OUT, number_of_nozzles);
-            }
-        }
+        gcodeparser.parse(lines);
     }
 
-    // Close the file
-    file.close();
+    // the conversion throws Cancelled soon after the token is cancelled
+    void set_cancellation(const CancellationToken& cancellation)
+    {
+        gcodeparser.cancellation = cancellation;
+        gg.cancellation = cancellation;
+    }
 
-    return 0;
-}
+    // the conversion adds what it did to stats, which must outlive it
+    void set_stats(PipelineStats* stats)
+    {
+        gcodeparser.stats = stats;
+        gg.stats = stats;
+    }
 
+    PrintHead printhead;
+    int _y_start_pos;
+    int _bed_length;
+    GCodeParser gcodeparser;
+    GCodeGenerator gg;
+};
 
 #endif
\ No newline at end of file
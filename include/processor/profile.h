@@ -0,0 +1,299 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "timing.h"
+
+#include <xxhash.h>
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// The machine parameters of the printer, as configured in the Cura settings
+struct PrinterParameters
+{
+    float valve_spacing = 5.0f; // distance between the centers of two valves
+    uint16_t nr_of_blocks = 11;
+    uint16_t nozzles_per_block = 8;
+    uint16_t nr_passes = 2;
+    int y_start = 118; // Y-position of the print head where the bed starts
+    int y_end = 1462; // maximum Y-position the print head can reach
+    int x_maximum = 1388; // X-position of the hopper when depositing material
+    int base_feedrate = 5454; // printhead only, the hopper is parked
+    int joint_feedrate = 7691; // printhead and hopper together, was 8460 and reduced by 10%
+    int deposit_feedrate = 6000;
+    int pass_dwell = 3000; // milliseconds to wait before the return pass
+    float max_valve_frequency = 0.0f; // switches per second a valve keeps up with, 0 prints every row at the fixed feedrates
+    int max_feedrate = 12000; // fastest a row is printed when the valves allow it
+    float acceleration = 1000.0f; // mm/s², how quickly the planned feedrate may change between rows
+    MacroCosts macro_costs;
+
+    using lookup_t = std::function<std::optional<std::string>(std::string_view)>;
+
+    // Reads every parameter that lookup knows about, the others keep their default
+    static PrinterParameters from_settings(const lookup_t& lookup)
+    {
+        PrinterParameters parameters;
+        read(lookup, "onlyfans_valve_spacing", parameters.valve_spacing);
+        read(lookup, "onlyfans_nr_of_blocks", parameters.nr_of_blocks);
+        read(lookup, "onlyfans_nozzles_per_block", parameters.nozzles_per_block);
+        read(lookup, "onlyfans_bed_y_start", parameters.y_start);
+        read(lookup, "onlyfans_bed_y_end", parameters.y_end);
+        read(lookup, "onlyfans_x_maximum", parameters.x_maximum);
+        read(lookup, "onlyfans_base_feedrate", parameters.base_feedrate);
+        read(lookup, "onlyfans_joint_feedrate", parameters.joint_feedrate);
+        read(lookup, "onlyfans_deposit_feedrate", parameters.deposit_feedrate);
+        read(lookup, "onlyfans_pass_dwell", parameters.pass_dwell);
+        read(lookup, "onlyfans_max_valve_frequency", parameters.max_valve_frequency);
+        read(lookup, "onlyfans_max_feedrate", parameters.max_feedrate);
+        read(lookup, "onlyfans_acceleration", parameters.acceleration);
+        read(lookup, "onlyfans_pause_printer_time", parameters.macro_costs.pause_printer);
+        read(lookup, "onlyfans_fill_hopper_time", parameters.macro_costs.fill_hopper);
+        read(lookup, "onlyfans_z_one_layer_time", parameters.macro_costs.z_one_layer);
+        read(lookup, "onlyfans_set_pass_time", parameters.macro_costs.set_pass);
+        parameters.validate();
+        return parameters;
+    }
+
+    // Reads settings given as name=value, e.g. on the command line
+    static PrinterParameters from_assignments(std::span<const std::string> assignments)
+    {
+        std::unordered_map<std::string_view, std::string_view> settings;
+        for (std::string_view assignment : assignments)
+        {
+            const auto separator = assignment.find('=');
+            if (separator == std::string_view::npos)
+            {
+                throw std::invalid_argument(std::format("Setting {} is not of the form name=value", assignment));
+            }
+            settings.insert_or_assign(assignment.substr(0, separator), assignment.substr(separator + 1));
+        }
+        return from_settings(
+            [&settings](std::string_view key) -> std::optional<std::string>
+            {
+                const auto setting = settings.find(key);
+                if (setting == settings.end())
+                {
+                    return std::nullopt;
+                }
+                return std::string{ setting->second };
+            });
+    }
+
+    void validate() const
+    {
+        if (valve_spacing <= 0.0f || nr_of_blocks == 0 || nozzles_per_block == 0 || nr_passes == 0)
+        {
+            throw std::invalid_argument("The print head needs at least one valve with a positive spacing");
+        }
+        if ((nr_of_blocks * nozzles_per_block) % 8 != 0)
+        {
+            throw std::invalid_argument("The number of valves must be a multiple of 8");
+        }
+        if (y_start < 0 || y_end <= y_start + 1)
+        {
+            throw std::invalid_argument("The bed must end after it starts");
+        }
+        if (base_feedrate <= 0 || joint_feedrate <= 0 || deposit_feedrate <= 0)
+        {
+            throw std::invalid_argument("Feedrates must be positive");
+        }
+        if (max_valve_frequency < 0.0f)
+        {
+            throw std::invalid_argument("The valve frequency cannot be negative");
+        }
+        if (max_valve_frequency > 0.0f && (max_feedrate < std::max(base_feedrate, joint_feedrate) || acceleration <= 0.0f))
+        {
+            throw std::invalid_argument("Planned feedrates need a maximum feedrate above the fixed ones and a positive acceleration");
+        }
+    }
+
+private:
+    template<class T>
+    static void read(const lookup_t& lookup, std::string_view key, T& value)
+    {
+        const auto setting = lookup(key);
+        if (! setting.has_value())
+        {
+            return;
+        }
+        // Cura sends all settings as strings, integers may still carry a fraction ("5454.0")
+        double parsed = 0.0;
+        const auto [ptr, ec] = std::from_chars(setting->data(), setting->data() + setting->size(), parsed);
+        if (ec != std::errc())
+        {
+            throw std::invalid_argument(std::format("Setting {} has an invalid value: '{}'", key, *setting));
+        }
+        value = static_cast<T>(parsed);
+    }
+};
+
+// Immutable, precomputed form of the PrinterParameters. Built once per slice and
+// shared by all layer conversions of that slice.
+class PrinterProfile
+{
+public:
+    explicit PrinterProfile(const PrinterParameters& parameters = {})
+        : _parameters(parameters)
+    {
+        _parameters.validate();
+        for (unsigned value = 0; value < _valve_values.size(); value++)
+        {
+            // the printer expects the valves of a block in reverse order
+            std::bitset<8> reversed;
+            for (size_t bit = 0; bit < 8; bit++)
+            {
+                reversed[7 - bit] = (value >> bit) & 1U;
+            }
+            _valve_values[value] = std::to_string(reversed.to_ulong()) + ',';
+        }
+
+        _closed_values.clear();
+        for (size_t block = 0; block < bytes_per_pass(); block++)
+        {
+            _closed_values += "0,";
+        }
+        _closed_valves = "VALVES_SET VALUES=" + _closed_values;
+        _closed_valves.back() = '\n';
+
+        _layer_begin_text = std::format(
+            "FILL_HOPPER_ASYNC\n"
+            "SET_FIRST_PASS\n"
+            "Z_ONE_LAYER\n"
+            "PAUSE_PRINTER ;wait for button press\n"
+            "G1 X{} F{}; deposit material\n",
+            _parameters.x_maximum,
+            _parameters.deposit_feedrate);
+
+        // longest possible row: G1 Y.. X.. F..\nVALVES_SET VALUES=255,...,255\n
+        const auto digits = [](int value)
+        {
+            return std::to_string(value).size();
+        };
+        auto max_feedrate = std::max(_parameters.base_feedrate, _parameters.joint_feedrate);
+        if (_parameters.max_valve_frequency > 0.0f)
+        {
+            max_feedrate = std::max(max_feedrate, _parameters.max_feedrate);
+        }
+        _max_row_bytes = 4 + digits(_parameters.y_end) + 2 + digits(_parameters.x_maximum) + 2 + digits(max_feedrate) + 1 + 18 + bytes_per_pass() * 4;
+
+        const auto description = std::format(
+            "{} {} {} {} {} {} {} {} {} {} {} {} {} {} {} {} {} {}",
+            _parameters.valve_spacing,
+            _parameters.nr_of_blocks,
+            _parameters.nozzles_per_block,
+            _parameters.nr_passes,
+            _parameters.y_start,
+            _parameters.y_end,
+            _parameters.x_maximum,
+            _parameters.base_feedrate,
+            _parameters.joint_feedrate,
+            _parameters.deposit_feedrate,
+            _parameters.pass_dwell,
+            _parameters.max_valve_frequency,
+            _parameters.max_feedrate,
+            _parameters.acceleration,
+            _parameters.macro_costs.pause_printer,
+            _parameters.macro_costs.fill_hopper,
+            _parameters.macro_costs.z_one_layer,
+            _parameters.macro_costs.set_pass);
+        _fingerprint = XXH3_64bits(description.data(), description.size());
+    }
+
+    static std::shared_ptr<const PrinterProfile> defaults()
+    {
+        static const auto profile = std::make_shared<const PrinterProfile>();
+        return profile;
+    }
+
+    const PrinterParameters& parameters() const
+    {
+        return _parameters;
+    }
+
+    uint16_t nr_of_nozzles() const
+    {
+        return _parameters.nr_of_blocks * _parameters.nozzles_per_block;
+    }
+
+    float printhead_size() const
+    {
+        return nr_of_nozzles() * _parameters.valve_spacing;
+    }
+
+    // number of valve bytes written in one VALVES_SET
+    size_t bytes_per_pass() const
+    {
+        return nr_of_nozzles() / 8;
+    }
+
+    // number of pattern rows, one less than the bed because the head needs a row to stop and close the valves
+    int bed_rows() const
+    {
+        return _parameters.y_end - _parameters.y_start - 1;
+    }
+
+    // decimal text of a valve byte as the printer expects it, followed by a comma
+    std::string_view valve_value(std::bitset<8> value) const
+    {
+        return _valve_values[value.to_ulong()];
+    }
+
+    // "0," for every valve byte of a pass
+    std::string_view closed_values() const
+    {
+        return _closed_values;
+    }
+
+    // VALVES_SET line that closes all valves
+    std::string_view closed_valves() const
+    {
+        return _closed_valves;
+    }
+
+    // the part of the layer start that does not depend on the layer number
+    std::string_view layer_begin_text() const
+    {
+        return _layer_begin_text;
+    }
+
+    size_t max_row_bytes() const
+    {
+        return _max_row_bytes;
+    }
+
+    // upper bound of the generated g-code of a layer
+    size_t max_layer_bytes() const
+    {
+        return static_cast<size_t>(bed_rows() + 2) * 2 * _max_row_bytes + 1024;
+    }
+
+    // changes whenever anything that affects the generated g-code changes
+    std::uint64_t fingerprint() const
+    {
+        return _fingerprint;
+    }
+
+private:
+    PrinterParameters _parameters;
+    std::array<std::string, 256> _valve_values;
+    std::string _closed_values;
+    std::string _closed_valves;
+    std::string _layer_begin_text;
+    size_t _max_row_bytes = 0;
+    std::uint64_t _fingerprint = 0;
+};
+
+#endif
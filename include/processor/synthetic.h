@@ -0,0 +1,87 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include "profile.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <iterator>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The shape of a generated layer
+struct SyntheticLayerOptions
+{
+    size_t lines = 10000; // spray lines, every one is a travel and an extrusion move
+    double fill_density = 0.25; // average fraction of the bed length a spray line covers
+    double diagonal_fraction = 0.1; // extra extrusion moves that are not along Y, like walls, which the converter skips
+    int layer_nr = 1;
+    std::uint32_t seed = 1;
+};
+
+/**
+ * Generates a layer the way Cura writes one for this printer: a ;LAYER:
+ * header, comments, fan commands, and travel moves to the start of every
+ * spray line followed by an extrusion move along Y, with some extrusions at
+ * an angle in between like walls and skin. The same options always
+ * give the same layer, on every platform, so it can be used to compare
+ * benchmark runs.
+ * */
+inline std::string synthetic_layer(const PrinterParameters& parameters, const SyntheticLayerOptions& options = {})
+{
+    std::mt19937 random(options.seed);
+    // not the std distributions, their output differs between standard libraries
+    const auto fraction = [&random]()
+    {
+        return static_cast<double>(random()) / (static_cast<double>(std::mt19937::max()) + 1.0);
+    };
+
+    const double bed_width = parameters.valve_spacing * parameters.nr_of_blocks * parameters.nozzles_per_block * parameters.nr_passes;
+    const double bed_length = parameters.y_end - parameters.y_start - 1;
+    const double fill = std::clamp(options.fill_density, 0.0, 1.0);
+
+    std::string layer;
+    layer.reserve(options.lines * 64);
+    std::format_to(std::back_inserter(layer), ";LAYER:{}\n;MESH:synthetic.stl\nM106 S255\n;TYPE:FILL\n", options.layer_nr);
+    double extruded = 0.0;
+    for (size_t line = 0; line < options.lines; line++)
+    {
+        if (line % 1000 == 999)
+        {
+            layer += ";TYPE:SKIN\n";
+        }
+        if (fraction() < options.diagonal_fraction)
+        {
+            extruded += 0.5;
+            std::format_to(std::back_inserter(layer), "G1 F1500 X{:.3f} Y{:.3f} E{:.5f}\n", fraction() * bed_width, fraction() * bed_length, extruded);
+        }
+
+        const auto x = fraction() * bed_width;
+        const auto length = std::min(fraction() * 2.0 * fill, 1.0) * bed_length;
+        const auto y_begin = fraction() * (bed_length - length);
+        const auto forward = (random() & 1U) != 0;
+        extruded += length * 0.033;
+        std::format_to(std::back_inserter(layer), "G0 F6000 X{:.3f} Y{:.3f}\n", x, forward ? y_begin : y_begin + length);
+        std::format_to(std::back_inserter(layer), "G1 F1500 X{:.3f} Y{:.3f} E{:.5f}\n", x, forward ? y_begin + length : y_begin, extruded);
+    }
+    layer += "M107\n;TIME_ELAPSED:0.000000\n";
+    return layer;
+}
+
+// Splits a layer into its lines without the line ends, the views point into the layer
+inline std::vector<std::string_view> splitLines(std::string_view layer)
+{
+    std::vector<std::string_view> lines;
+    while (! layer.empty())
+    {
+        const auto end = layer.find('\n');
+        lines.push_back(layer.substr(0, end));
+        layer.remove_prefix(end == std::string_view::npos ? layer.size() : end + 1);
+    }
+    return lines;
+}
+
+#endif
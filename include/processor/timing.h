@@ -0,0 +1,138 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <cmath>
+
+// Fixed cost in seconds of the blocking macros we emit. The firmware runs
+// these without reporting a duration, so the estimate can only add what
+// the operator configured for them.
+struct MacroCosts
+{
+    float pause_printer = 0.0f; // waits for a button press, depends on the operator
+    float fill_hopper = 0.0f; // FILL_HOPPER_ASYNC, only the part that blocks motion
+    float z_one_layer = 0.0f;
+    float set_pass = 0.0f; // SET_FIRST_PASS / SET_SECOND_PASS
+};
+
+// Analytic estimate of the machine time of the g-code we generate.
+// Moves are costed at their commanded feedrate (acceleration is ignored),
+// dwells at their duration and macros at their configured cost. The
+// estimator follows the position of the machine, so it must see every
+// move in the order it is written to the output.
+class TimeEstimator
+{
+public:
+    explicit TimeEstimator(MacroCosts costs = {})
+        : _costs(costs)
+    {
+    }
+
+    void begin_layer()
+    {
+        _layer_moves = 0.0;
+        _layer_dwell = 0.0;
+        _layer_macros = 0.0;
+    }
+
+    // feedrate in mm/min, as in the F parameter of G1
+    void move(float x, float y, float feedrate)
+    {
+        _feedrate = feedrate;
+        move(x, y);
+    }
+
+    void move(float x, float y)
+    {
+        const double distance = std::hypot(x - _x, y - _y);
+        _x = x;
+        _y = y;
+        if (_feedrate > 0.0f)
+        {
+            _layer_moves += distance * 60.0 / _feedrate;
+        }
+    }
+
+    void set_feedrate(float feedrate)
+    {
+        _feedrate = feedrate;
+    }
+
+    void move_y(float y)
+    {
+        move(_x, y);
+    }
+
+    void move_x(float x, float feedrate)
+    {
+        move(x, _y, feedrate);
+    }
+
+    void dwell(float milliseconds)
+    {
+        _layer_dwell += milliseconds / 1000.0;
+    }
+
+    void pause_printer()
+    {
+        _layer_macros += _costs.pause_printer;
+    }
+
+    void fill_hopper()
+    {
+        _layer_macros += _costs.fill_hopper;
+    }
+
+    void z_one_layer()
+    {
+        _layer_macros += _costs.z_one_layer;
+    }
+
+    void set_pass()
+    {
+        _layer_macros += _costs.set_pass;
+    }
+
+    // closes the current layer and adds it to the elapsed time
+    void end_layer()
+    {
+        _elapsed += layer_time();
+    }
+
+    double layer_time() const
+    {
+        return _layer_moves + _layer_dwell + _layer_macros;
+    }
+
+    double layer_moves() const
+    {
+        return _layer_moves;
+    }
+
+    double layer_dwell() const
+    {
+        return _layer_dwell;
+    }
+
+    double layer_macros() const
+    {
+        return _layer_macros;
+    }
+
+    // total time of all finished layers
+    double elapsed() const
+    {
+        return _elapsed;
+    }
+
+private:
+    MacroCosts _costs;
+    float _x = 0.0f;
+    float _y = 0.0f;
+    float _feedrate = 0.0f;
+    double _layer_moves = 0.0;
+    double _layer_dwell = 0.0;
+    double _layer_macros = 0.0;
+    double _elapsed = 0.0;
+};
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+// One finished span. Names and categories must be string literals or otherwise outlive the tracer.
+struct TraceEvent
+{
+    std::string_view name;
+    std::string_view category;
+    std::int64_t start_ns = 0; // since the tracer was enabled
+    std::int64_t duration_ns = 0;
+    int layer_nr = -1;
+    std::uint64_t async_id = 0; // spans with an id form their own track, for work that interleaves on one thread
+};
+
+/**
+ * Collects spans in the Chrome trace-event format, for the Perfetto UI.
+ *
+ * Off unless enabled, and then a span costs a single atomic load. Every
+ * thread records into its own ring buffer that keeps the last
+ * events_per_thread spans; its lock is only ever contended while the trace is
+ * written. Rings are kept after their thread exits so no spans are lost.
+ * */
+class Tracer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    static Tracer& instance()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    static bool enabled()
+    {
+        return _enabled.load(std::memory_order_acquire);
+    }
+
+    void enable(size_t events_per_thread = 1 << 16)
+    {
+        std::scoped_lock lock(_mutex);
+        _events_per_thread = std::max<size_t>(events_per_thread, 1);
+        _epoch = clock::now();
+        _enabled.store(true, std::memory_order_release);
+    }
+
+    // The layer the calling thread is working on, attached to the spans it starts
+    static int layer()
+    {
+        return _layer;
+    }
+
+    static void set_layer(int layer_nr)
+    {
+        _layer = layer_nr;
+    }
+
+    // an id for the spans of one asynchronous operation, such as a call
+    static std::uint64_t next_id()
+    {
+        static std::atomic<std::uint64_t> ids{ 0 };
+        return ++ids;
+    }
+
+    void record(std::string_view name, std::string_view category, clock::time_point start, clock::time_point end, int layer_nr, std::uint64_t async_id = 0)
+    {
+        auto& ring = local();
+        const TraceEvent event{ .name = name,
+                                .category = category,
+                                .start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start - _epoch).count(),
+                                .duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+                                .layer_nr = layer_nr,
+                                .async_id = async_id };
+        std::scoped_lock lock(ring.mutex);
+        if (ring.events.size() < ring.capacity)
+        {
+            ring.events.push_back(event);
+        }
+        else
+        {
+            ring.events[ring.next] = event;
+            ring.next = (ring.next + 1) % ring.capacity;
+        }
+    }
+
+    std::string json() const
+    {
+        std::string text = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        std::scoped_lock lock(_mutex);
+        for (const auto& ring : _rings)
+        {
+            std::scoped_lock ring_lock(ring->mutex);
+            for (const auto& event : ring->events)
+            {
+                const auto start = static_cast<double>(event.start_ns) / 1000.0;
+                if (event.async_id == 0)
+                {
+                    std::format_to(
+                        std::back_inserter(text),
+                        "{}\n{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"X\",\"ts\":{:.3f},\"dur\":{:.3f},\"pid\":1,\"tid\":{},\"args\":{{\"layer\":{}}}}}",
+                        first ? "" : ",",
+                        event.name,
+                        event.category,
+                        start,
+                        static_cast<double>(event.duration_ns) / 1000.0,
+                        ring->thread,
+                        event.layer_nr);
+                }
+                else
+                {
+                    for (const auto& [phase, ts] : { std::pair{ 'b', start }, std::pair{ 'e', start + static_cast<double>(event.duration_ns) / 1000.0 } })
+                    {
+                        std::format_to(
+                            std::back_inserter(text),
+                            "{}\n{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"{}\",\"id\":{},\"ts\":{:.3f},\"pid\":1,\"tid\":{},\"args\":{{\"layer\":{}}}}}",
+                            first ? "" : ",",
+                            event.name,
+                            event.category,
+                            phase,
+                            event.async_id,
+                            ts,
+                            ring->thread,
+                            event.layer_nr);
+                        first = false;
+                    }
+                }
+                first = false;
+            }
+        }
+        text += "\n]}\n";
+        return text;
+    }
+
+    // written to a temporary file first, so the UI never loads half a trace
+    bool write(const std::filesystem::path& path) const
+    {
+        auto temporary = path;
+        temporary += ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            const auto text = json();
+            if (! file.write(text.data(), static_cast<std::streamsize>(text.size())))
+            {
+                return false;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(temporary, path, ec);
+        return ! ec;
+    }
+
+private:
+    struct Ring
+    {
+        std::mutex mutex;
+        std::vector<TraceEvent> events;
+        size_t capacity = 0;
+        size_t next = 0; // oldest event once the ring is full
+        std::uint32_t thread = 0;
+    };
+
+    Ring& local()
+    {
+        thread_local std::shared_ptr<Ring> ring;
+        if (! ring)
+        {
+            ring = std::make_shared<Ring>();
+            std::scoped_lock lock(_mutex);
+            ring->capacity = _events_per_thread;
+            ring->thread = static_cast<std::uint32_t>(_rings.size() + 1);
+            ring->events.reserve(std::min<size_t>(ring->capacity, 4096));
+            _rings.push_back(ring);
+        }
+        return *ring;
+    }
+
+    inline static std::atomic_bool _enabled{ false };
+    inline static thread_local int _layer = -1;
+    mutable std::mutex _mutex;
+    size_t _events_per_thread = 1 << 16;
+    clock::time_point _epoch = clock::now();
+    std::vector<std::shared_ptr<Ring>> _rings;
+};
+
+// Records the time until it goes out of scope as a span, when tracing is enabled
+class TraceSpan
+{
+public:
+    TraceSpan(std::string_view name, std::string_view category, int layer_nr = Tracer::layer(), std::uint64_t async_id = 0)
+        : _name(name)
+        , _category(category)
+        , _layer_nr(layer_nr)
+        , _async_id(async_id)
+        , _active(Tracer::enabled())
+    {
+        if (_active)
+        {
+            _start = Tracer::clock::now();
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    ~TraceSpan()
+    {
+        if (_active)
+        {
+            Tracer::instance().record(_name, _category, _start, Tracer::clock::now(), _layer_nr, _async_id);
+        }
+    }
+
+private:
+    std::string_view _name;
+    std::string_view _category;
+    int _layer_nr;
+    std::uint64_t _async_id;
+    bool _active;
+    Tracer::clock::time_point _start;
+};
+
+#endif
@@ -0,0 +1,531 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include "process.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Thrown when an existing volume holds patterns of another size than asked for, e.g. of another print head
+class VolumeMismatch : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * The rasterized layers of one print, kept in a memory-mapped file so the
+ * print can be generated again with other motion settings without parsing
+ * its g-code, and any layer can be read back at once for a preview.
+ *
+ * The file is a header followed by one fixed-size slot per layer number.
+ * A slot holds a marker and the spray pattern packed to one byte per eight
+ * valves. The file grows by doubling when a layer beyond its end is stored.
+ * Integers are in the byte order of the machine, the file is not meant to
+ * be moved to another architecture. Storing and loading may happen from any
+ * number of threads; a store is only opened by one process at a time.
+ * */
+class VolumeStore
+{
+public:
+    static constexpr std::string_view MAGIC = "ONLYFANS-VOLUME1";
+
+    // Opens the volume at path, or creates it for patterns of rows by width bytes.
+    // Throws VolumeMismatch when the existing volume holds patterns of another size.
+    VolumeStore(const std::filesystem::path& path, size_t rows, size_t width)
+        : _path(path)
+    {
+        try
+        {
+            open(true);
+            if (_size == 0)
+            {
+                Header header{};
+                std::memcpy(header.magic.data(), MAGIC.data(), MAGIC.size());
+                header.rows = static_cast<std::uint32_t>(rows);
+                header.width = static_cast<std::uint32_t>(width);
+                header.capacity = 0;
+                resize(sizeof(Header));
+                std::memcpy(_data, &header, sizeof(Header));
+            }
+            read_header();
+            if (_rows != rows || _width != width)
+            {
+                throw VolumeMismatch(std::format("{} holds layers of {} rows by {} bytes, not {} by {}", path.string(), _rows, _width, rows, width));
+            }
+        }
+        catch (...)
+        {
+            unmap();
+            close();
+            throw;
+        }
+    }
+
+    // Opens an existing volume, for regenerating or previewing it
+    explicit VolumeStore(const std::filesystem::path& path)
+        : _path(path)
+    {
+        try
+        {
+            open(false);
+            read_header();
+        }
+        catch (...)
+        {
+            unmap();
+            close();
+            throw;
+        }
+    }
+
+    VolumeStore(const VolumeStore&) = delete;
+    VolumeStore& operator=(const VolumeStore&) = delete;
+
+    ~VolumeStore()
+    {
+        unmap();
+        close();
+    }
+
+    size_t rows() const
+    {
+        return _rows;
+    }
+
+    size_t width() const
+    {
+        return _width;
+    }
+
+    // Packs the pattern of a layer into its slot, replacing what was stored for it before
+    void store(int layer_nr, const SprayPattern& sp)
+    {
+        check(layer_nr, sp);
+        if (! _writable)
+        {
+            throw std::logic_error("The volume was opened for reading");
+        }
+        std::unique_lock lock(_mutex);
+        if (static_cast<size_t>(layer_nr) >= _capacity)
+        {
+            grow(static_cast<size_t>(layer_nr) + 1);
+        }
+        auto* slot = this->slot(layer_nr);
+        auto* bytes = slot + SLOT_HEADER_BYTES;
+        for (size_t row = 0; row < _rows; row++)
+        {
+            const auto valves = sp.pattern[row];
+            for (size_t byte = 0; byte < _width; byte++)
+            {
+                *bytes++ = static_cast<char>(valves[byte].to_ulong());
+            }
+        }
+        // written last, a slot is never marked before its pattern is complete
+        std::memcpy(slot, &SLOT_MARKER, sizeof(SLOT_MARKER));
+    }
+
+    // Unpacks a stored layer into sp, false when the layer was never stored
+    bool load(int layer_nr, SprayPattern& sp) const
+    {
+        check(layer_nr, sp);
+        std::shared_lock lock(_mutex);
+        if (! present(layer_nr))
+        {
+            return false;
+        }
+        const auto* bytes = slot(layer_nr) + SLOT_HEADER_BYTES;
+        for (size_t row = 0; row < _rows; row++)
+        {
+            auto valves = sp.pattern[row];
+            for (size_t byte = 0; byte < _width; byte++)
+            {
+                valves[byte] = static_cast<unsigned char>(*bytes++);
+            }
+        }
+        return true;
+    }
+
+    bool contains(int layer_nr) const
+    {
+        std::shared_lock lock(_mutex);
+        return present(layer_nr);
+    }
+
+    // the numbers of all stored layers, in order
+    std::vector<int> layers() const
+    {
+        std::shared_lock lock(_mutex);
+        std::vector<int> stored;
+        for (size_t layer = 0; layer < _capacity; layer++)
+        {
+            if (present(static_cast<int>(layer)))
+            {
+                stored.push_back(static_cast<int>(layer));
+            }
+        }
+        return stored;
+    }
+
+private:
+    struct Header
+    {
+        std::array<char, 16> magic;
+        std::uint32_t rows;
+        std::uint32_t width;
+        std::uint64_t capacity; // layer slots in the file
+        std::array<char, 32> reserved;
+    };
+    static_assert(sizeof(Header) == 64);
+
+    static constexpr std::uint64_t SLOT_MARKER = 0x5245594c'41594c4fULL;
+    static constexpr size_t SLOT_HEADER_BYTES = sizeof(SLOT_MARKER);
+    static constexpr size_t INITIAL_CAPACITY = 256;
+
+    size_t stride() const
+    {
+        // slots start on a cache line
+        return (SLOT_HEADER_BYTES + _rows * _width + 63) / 64 * 64;
+    }
+
+    char* slot(int layer_nr) const
+    {
+        return _data + sizeof(Header) + static_cast<size_t>(layer_nr) * stride();
+    }
+
+    bool present(int layer_nr) const
+    {
+        if (layer_nr < 0 || static_cast<size_t>(layer_nr) >= _capacity)
+        {
+            return false;
+        }
+        std::uint64_t marker = 0;
+        std::memcpy(&marker, slot(layer_nr), sizeof(marker));
+        return marker == SLOT_MARKER;
+    }
+
+    void check(int layer_nr, const SprayPattern& sp) const
+    {
+        if (layer_nr < 0)
+        {
+            throw std::invalid_argument(std::format("Layer {} cannot be stored, layers are numbered from 0", layer_nr));
+        }
+        if (sp.pattern.size() != _rows || sp.pattern.width() != _width)
+        {
+            throw std::invalid_argument("The pattern does not have the size of the layers in the volume");
+        }
+    }
+
+    void read_header()
+    {
+        Header header{};
+        if (_size < sizeof(Header))
+        {
+            throw std::runtime_error(std::format("{} is not a volume", _path.string()));
+        }
+        std::memcpy(&header, _data, sizeof(Header));
+        if (std::string_view(header.magic.data(), header.magic.size()) != MAGIC)
+        {
+            throw std::runtime_error(std::format("{} is not a volume", _path.string()));
+        }
+        _rows = header.rows;
+        _width = header.width;
+        _capacity = header.capacity;
+        if (_size < sizeof(Header) + _capacity * stride())
+        {
+            throw std::runtime_error(std::format("{} is shorter than its layers", _path.string()));
+        }
+    }
+
+    // makes room for at least layers slots, the new slots read as empty
+    void grow(size_t layers)
+    {
+        auto capacity = std::max(_capacity, INITIAL_CAPACITY);
+        while (capacity < layers)
+        {
+            capacity *= 2;
+        }
+        resize(sizeof(Header) + capacity * stride());
+        _capacity = capacity;
+        const std::uint64_t stored = capacity;
+        std::memcpy(_data + offsetof(Header, capacity), &stored, sizeof(stored));
+    }
+
+#ifdef _WIN32
+    void open(bool create)
+    {
+        _file = CreateFileW(_path.c_str(), GENERIC_READ | (create ? GENERIC_WRITE : 0), FILE_SHARE_READ, nullptr, create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (_file == INVALID_HANDLE_VALUE)
+        {
+            throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), "Could not open " + _path.string());
+        }
+        _writable = create;
+        LARGE_INTEGER size;
+        if (! GetFileSizeEx(_file, &size))
+        {
+            throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), "Could not read the size of " + _path.string());
+        }
+        _size = static_cast<size_t>(size.QuadPart);
+        map();
+    }
+
+    void resize(size_t size)
+    {
+        unmap();
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(size);
+        if (! SetFilePointerEx(_file, end, nullptr, FILE_BEGIN) || ! SetEndOfFile(_file))
+        {
+            throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), "Could not grow " + _path.string());
+        }
+        _size = size;
+        map();
+    }
+
+    void map()
+    {
+        if (_size == 0)
+        {
+            return;
+        }
+        _mapping = CreateFileMappingW(_file, nullptr, _writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+        if (_mapping == nullptr)
+        {
+            throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), "Could not map " + _path.string());
+        }
+        _data = static_cast<char*>(MapViewOfFile(_mapping, _writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+        if (_data == nullptr)
+        {
+            const auto error = GetLastError();
+            CloseHandle(_mapping);
+            _mapping = nullptr;
+            throw std::system_error(static_cast<int>(error), std::system_category(), "Could not map " + _path.string());
+        }
+    }
+
+    void unmap()
+    {
+        if (_data != nullptr)
+        {
+            UnmapViewOfFile(_data);
+            _data = nullptr;
+        }
+        if (_mapping != nullptr)
+        {
+            CloseHandle(_mapping);
+            _mapping = nullptr;
+        }
+    }
+
+    void close()
+    {
+        if (_file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(_file);
+            _file = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    HANDLE _file = INVALID_HANDLE_VALUE;
+    HANDLE _mapping = nullptr;
+#else
+    void open(bool create)
+    {
+        _file = ::open(_path.c_str(), (create ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+        if (_file < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "Could not open " + _path.string());
+        }
+        _writable = create;
+        struct stat status = {};
+        if (::fstat(_file, &status) != 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "Could not read the size of " + _path.string());
+        }
+        _size = static_cast<size_t>(status.st_size);
+        map();
+    }
+
+    void resize(size_t size)
+    {
+        unmap();
+        if (::ftruncate(_file, static_cast<off_t>(size)) != 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "Could not grow " + _path.string());
+        }
+#ifndef __APPLE__
+        // reserves the blocks now, a full disk fails here instead of raising SIGBUS on a write to the mapping
+        if (const auto error = ::posix_fallocate(_file, 0, static_cast<off_t>(size)); error != 0)
+        {
+            throw std::system_error(error, std::generic_category(), "Could not grow " + _path.string());
+        }
+#endif
+        _size = size;
+        map();
+    }
+
+    void map()
+    {
+        if (_size == 0)
+        {
+            return;
+        }
+        auto* data = ::mmap(nullptr, _size, PROT_READ | (_writable ? PROT_WRITE : 0), MAP_SHARED, _file, 0);
+        if (data == MAP_FAILED)
+        {
+            throw std::system_error(errno, std::generic_category(), "Could not map " + _path.string());
+        }
+        // previews jump to any layer
+        ::madvise(data, _size, MADV_RANDOM);
+        _data = static_cast<char*>(data);
+    }
+
+    void unmap()
+    {
+        if (_data != nullptr)
+        {
+            ::munmap(_data, _size);
+            _data = nullptr;
+        }
+    }
+
+    void close()
+    {
+        if (_file >= 0)
+        {
+            ::close(_file);
+            _file = -1;
+        }
+    }
+
+    int _file = -1;
+#endif
+
+    std::filesystem::path _path;
+    mutable std::shared_mutex _mutex;
+    char* _data = nullptr;
+    size_t _size = 0;
+    bool _writable = false;
+    size_t _rows = 0;
+    size_t _width = 0;
+    size_t _capacity = 0;
+};
+
+/**
+ * The volumes of the prints the plugin converts, one file per print named
+ * after its uuid. The most recently used volumes are kept open. A print
+ * sliced again for a bed or print head of another size starts a new volume.
+ * */
+class VolumeDirectory
+{
+public:
+    explicit VolumeDirectory(std::filesystem::path directory, size_t max_open = 8)
+        : _directory(std::move(directory))
+        , _max_open(std::max<size_t>(max_open, 1))
+    {
+        std::filesystem::create_directories(_directory);
+    }
+
+    // rows and width of the patterns PrintManager rasterizes for the profile, which always has two passes
+    static std::pair<size_t, size_t> geometry(const PrinterProfile& profile)
+    {
+        return { static_cast<size_t>(profile.bed_rows()), 2 * profile.bytes_per_pass() };
+    }
+
+    std::filesystem::path path(std::string_view uuid) const
+    {
+        std::string name;
+        for (const auto c : uuid)
+        {
+            name += std::isalnum(static_cast<unsigned char>(c)) || c == '-' ? c : '_';
+        }
+        if (name.empty())
+        {
+            name = "unknown";
+        }
+        return _directory / (name + std::string{ EXTENSION });
+    }
+
+    std::shared_ptr<VolumeStore> open(std::string_view uuid, const PrinterProfile& profile)
+    {
+        const auto [rows, width] = geometry(profile);
+        std::scoped_lock lock(_mutex);
+        const std::string key{ uuid };
+        if (const auto it = _open.find(key); it != _open.end())
+        {
+            _order.splice(_order.begin(), _order, it->second.second);
+            if (it->second.first->rows() == rows && it->second.first->width() == width)
+            {
+                return it->second.first;
+            }
+            _order.erase(it->second.second);
+            _open.erase(it);
+        }
+
+        const auto file = path(uuid);
+        std::shared_ptr<VolumeStore> volume;
+        try
+        {
+            volume = std::make_shared<VolumeStore>(file, rows, width);
+        }
+        catch (const VolumeMismatch&)
+        {
+            // rasterized for another printer, the print starts over
+            std::filesystem::remove(file);
+            volume = std::make_shared<VolumeStore>(file, rows, width);
+        }
+        _order.push_front(key);
+        _open.emplace(key, std::make_pair(volume, _order.begin()));
+        while (_open.size() > _max_open)
+        {
+            _open.erase(_order.back());
+            _order.pop_back();
+        }
+        return volume;
+    }
+
+private:
+    static constexpr std::string_view EXTENSION = ".volume";
+
+    std::filesystem::path _directory;
+    size_t _max_open;
+    std::mutex _mutex;
+    std::list<std::string> _order; // most recently used first
+    std::unordered_map<std::string, std::pair<std::shared_ptr<VolumeStore>, std::list<std::string>::iterator>> _open;
+};
+
+#endif
@@ -0,0 +1,199 @@
+
+// Replaces the global operator new and delete of an instrumentation build, see AllocationTracker.
+// Every block is preceded by a header holding its size, so the unsized deletes can count it too.
+
+#include "processor/allocations.h" // Allocation counters
+
+#ifdef ONLYFANS_TRACK_ALLOCATIONS
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace
+{
+
+constexpr std::size_t DEFAULT_ALIGNMENT = alignof(std::max_align_t);
+
+constexpr std::size_t header_bytes(std::size_t alignment) noexcept
+{
+    return std::max(alignment, DEFAULT_ALIGNMENT);
+}
+
+void* aligned_block(std::size_t alignment, std::size_t bytes) noexcept
+{
+#ifdef _WIN32
+    return _aligned_malloc(bytes, alignment);
+#else
+    return std::aligned_alloc(alignment, bytes);
+#endif
+}
+
+void free_aligned_block(void* block) noexcept
+{
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    std::free(block);
+#endif
+}
+
+void* allocate(std::size_t bytes, std::size_t alignment) noexcept
+{
+    const auto header = header_bytes(alignment);
+    // aligned_alloc wants a multiple of the alignment
+    const auto total = (header + bytes + alignment - 1) / alignment * alignment;
+    auto* block = static_cast<char*>(alignment > DEFAULT_ALIGNMENT ? aligned_block(alignment, total) : std::malloc(total));
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+    *reinterpret_cast<std::size_t*>(block + header - sizeof(std::size_t)) = bytes;
+    AllocationTracker::allocated(bytes);
+    return block + header;
+}
+
+void* allocate_or_throw(std::size_t bytes, std::size_t alignment)
+{
+    while (true)
+    {
+        if (auto* p = allocate(bytes, alignment))
+        {
+            return p;
+        }
+        const auto handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void release(void* p, std::size_t alignment) noexcept
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+    const auto header = header_bytes(alignment);
+    auto* block = static_cast<char*>(p) - header;
+    AllocationTracker::freed(*reinterpret_cast<std::size_t*>(block + header - sizeof(std::size_t)));
+    if (alignment > DEFAULT_ALIGNMENT)
+    {
+        free_aligned_block(block);
+    }
+    else
+    {
+        std::free(block);
+    }
+}
+
+} // namespace
+
+void* operator new(std::size_t bytes)
+{
+    return allocate_or_throw(bytes, DEFAULT_ALIGNMENT);
+}
+
+void* operator new[](std::size_t bytes)
+{
+    return allocate_or_throw(bytes, DEFAULT_ALIGNMENT);
+}
+
+void* operator new(std::size_t bytes, std::align_val_t alignment)
+{
+    return allocate_or_throw(bytes, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t bytes, std::align_val_t alignment)
+{
+    return allocate_or_throw(bytes, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t bytes, const std::nothrow_t&) noexcept
+{
+    return allocate(bytes, DEFAULT_ALIGNMENT);
+}
+
+void* operator new[](std::size_t bytes, const std::nothrow_t&) noexcept
+{
+    return allocate(bytes, DEFAULT_ALIGNMENT);
+}
+
+void* operator new(std::size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocate(bytes, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocate(bytes, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept
+{
+    release(p, DEFAULT_ALIGNMENT);
+}
+
+void operator delete[](void* p) noexcept
+{
+    release(p, DEFAULT_ALIGNMENT);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    release(p, DEFAULT_ALIGNMENT);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    release(p, DEFAULT_ALIGNMENT);
+}
+
+void operator delete(void* p, std::align_val_t alignment) noexcept
+{
+    release(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* p, std::align_val_t alignment) noexcept
+{
+    release(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept
+{
+    release(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t alignment) noexcept
+{
+    release(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    release(p, DEFAULT_ALIGNMENT);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    release(p, DEFAULT_ALIGNMENT);
+}
+
+void operator delete(void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    release(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    release(p, static_cast<std::size_t>(alignment));
+}
+
+#endif
@@ -0,0 +1,376 @@
+#include <benchmark/benchmark.h>
+
+#include "cura/plugins/slots/postprocess/v0/modify.grpc.pb.h"
+#include "cura/plugins/slots/postprocess/v0/modify.pb.h"
+#include "plugin/cmdline.h"
+#include "plugin/modify.h"
+#include "plugin/plugin.h"
+#include "plugin/registry.h"
+#include "processor/emulator.h"
+#include "processor/process.h"
+#include "processor/synthetic.h"
+#include "processor/volume.h"
+
+#include <grpcpp/create_channel.h>
+#include <grpcpp/security/credentials.h>
+#include <grpcpp/security/server_credentials.h>
+
+#include <algorithm>
+#include <bitset>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace cura::plugins::slots::postprocess::v0;
+
+// A layer of state.range(0) spray lines, with the fill density and diagonal fraction in percent as the next arguments
+static std::string benchmarkLayer(const benchmark::State& state)
+{
+    return synthetic_layer(
+        PrinterProfile::defaults()->parameters(),
+        SyntheticLayerOptions{ .lines = static_cast<size_t>(state.range(0)),
+                               .fill_density = state.range(1) / 100.0,
+                               .diagonal_fraction = state.range(2) / 100.0 });
+}
+
+// The layer sizes and shapes the conversion benchmarks run on: lines, fill density %, diagonal fraction %
+static void layerShapes(benchmark::internal::Benchmark* benchmark)
+{
+    benchmark->ArgNames({ "lines", "fill", "diagonal" });
+    for (const auto lines : { 1000, 10000, 100000 })
+    {
+        benchmark->Args({ lines, 25, 10 });
+    }
+    benchmark->Args({ 10000, 5, 10 });
+    benchmark->Args({ 10000, 75, 10 });
+    benchmark->Args({ 10000, 25, 50 });
+}
+
+
+// A handful of slices, as many as a busy print farm host keeps open
+static std::shared_ptr<plugin::SessionRegistry<std::string>> makeRegistry(std::vector<std::string>& uuids)
+{
+    auto registry = std::make_shared<plugin::SessionRegistry<std::string>>();
+    for (int n = 0; n < 8; n++)
+    {
+        uuids.push_back("b6f1c2a4-3d5e-4f60-8a7b-9c0d1e2f30" + std::to_string(10 + n));
+        registry->publish(uuids.back(), "settings of slice " + std::to_string(n));
+    }
+    return registry;
+}
+
+// Every layer call looks up the settings of its slice, this should scale with the number of threads
+static void BM_registry_visit(benchmark::State& state)
+{
+    static std::vector<std::string> uuids;
+    static std::shared_ptr<plugin::SessionRegistry<std::string>> registry;
+    if (state.thread_index() == 0)
+    {
+        uuids.clear();
+        registry = makeRegistry(uuids);
+    }
+
+    size_t n = state.thread_index();
+    for (auto _ : state)
+    {
+        registry->visit(
+            uuids[n++ % uuids.size()],
+            [](const std::string& settings)
+            {
+                benchmark::DoNotOptimize(settings.data());
+            });
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_registry_visit)->ThreadRange(1, 16)->UseRealTime();
+
+// Same lookups while a writer publishes new settings every 100 reads of the first thread
+static void BM_registry_visit_while_publishing(benchmark::State& state)
+{
+    static std::vector<std::string> uuids;
+    static std::shared_ptr<plugin::SessionRegistry<std::string>> registry;
+    if (state.thread_index() == 0)
+    {
+        uuids.clear();
+        registry = makeRegistry(uuids);
+    }
+
+    size_t n = state.thread_index();
+    for (auto _ : state)
+    {
+        if (state.thread_index() == 0 && n % 100 == 0)
+        {
+            registry->publish(uuids[n % uuids.size()], "updated settings");
+        }
+        registry->visit(
+            uuids[n++ % uuids.size()],
+            [](const std::string& settings)
+            {
+                benchmark::DoNotOptimize(settings.data());
+            });
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_registry_visit_while_publishing)->ThreadRange(1, 16)->UseRealTime();
+
+static void BM_get_g_move(benchmark::State& state)
+{
+    const auto layer = benchmarkLayer(state);
+    std::vector<std::string_view> moves;
+    for (const auto line : splitLines(layer))
+    {
+        if (line.starts_with("G0") || line.starts_with("G1"))
+        {
+            moves.push_back(line);
+        }
+    }
+
+    for (auto _ : state)
+    {
+        for (const auto line : moves)
+        {
+            benchmark::DoNotOptimize(get_g_move(line));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * moves.size());
+}
+BENCHMARK(BM_get_g_move)->Args({ 10000, 25, 10 })->ArgNames({ "lines", "fill", "diagonal" });
+
+// Rasterizing the spray lines of a layer into a pattern that is cleared up front
+static void BM_set_valves(benchmark::State& state)
+{
+    const auto layer = benchmarkLayer(state);
+    std::vector<std::pair<GCodeMove, GCodeMove>> spray_lines;
+    GCodeMove previous;
+    for (const auto line : splitLines(layer))
+    {
+        if (auto move = try_get_g_move(line))
+        {
+            if (move->isExtrusionMove())
+            {
+                // the parser skips extrusions that are not along Y, and does not start the next line from them
+                if (! SprayPattern::along_y(previous, *move))
+                {
+                    continue;
+                }
+                spray_lines.emplace_back(previous, *move);
+            }
+            previous = *move;
+        }
+    }
+
+    const auto& parameters = PrinterProfile::defaults()->parameters();
+    const PrintHead head(parameters.valve_spacing, parameters.nr_of_blocks, parameters.nozzles_per_block);
+    SprayPattern pattern(head, parameters.y_end - parameters.y_start - 1, parameters.nr_passes);
+    for (auto _ : state)
+    {
+        for (const auto& [begin, end] : spray_lines)
+        {
+            pattern.set_valves(begin.X, std::min(begin.Y, end.Y), std::max(begin.Y, end.Y));
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * spray_lines.size());
+}
+BENCHMARK(BM_set_valves)->Apply(layerShapes);
+
+// One row of the default print head, both passes
+static void BM_interlace_and_separate(benchmark::State& state)
+{
+    GCodeGenerator generator;
+    const auto width = PrinterProfile::defaults()->bytes_per_pass() * PrinterProfile::defaults()->parameters().nr_passes;
+    std::vector<std::bitset<8>> row(width);
+    std::vector<std::bitset<8>> interlaced(width);
+    for (size_t n = 0; n < row.size(); n++)
+    {
+        row[n] = static_cast<unsigned long>(n * 37 + 11);
+    }
+
+    for (auto _ : state)
+    {
+        generator.interlace_and_separate(row, interlaced);
+        benchmark::DoNotOptimize(interlaced.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_interlace_and_separate);
+
+static void BM_reverse(benchmark::State& state)
+{
+    GCodeGenerator generator;
+    std::bitset<8> valves{ 0b10110010 };
+    for (auto _ : state)
+    {
+        generator.reverse(valves);
+        benchmark::DoNotOptimize(valves);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_reverse);
+
+// Interlacing and emitting a parsed layer, the pattern is reused
+static void BM_generate(benchmark::State& state)
+{
+    const auto layer = benchmarkLayer(state);
+    const auto lines = splitLines(layer);
+    PrintManager manager(PrinterProfile::defaults());
+    manager.parse(lines);
+
+    size_t bytes = 0;
+    for (auto _ : state)
+    {
+        const auto gcode = manager.generate(1);
+        bytes += gcode.size();
+        benchmark::DoNotOptimize(gcode.data());
+    }
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_generate)->Apply(layerShapes);
+
+// The same with the rows written on several threads, the latency of a single large layer
+static void BM_generate_row_blocks(benchmark::State& state)
+{
+    const auto layer = benchmarkLayer(state);
+    const auto lines = splitLines(layer);
+    PrintManager manager(PrinterProfile::defaults());
+    manager.parse(lines);
+    GCodeGenerator::set_emit_threads(static_cast<size_t>(state.range(3)));
+
+    size_t bytes = 0;
+    for (auto _ : state)
+    {
+        const auto gcode = manager.generate(1);
+        bytes += gcode.size();
+        benchmark::DoNotOptimize(gcode.data());
+    }
+    GCodeGenerator::set_emit_threads(1);
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_generate_row_blocks)->ArgsProduct({ { 10000 }, { 25 }, { 10 }, { 1, 2, 4 } })->ArgNames({ "lines", "fill", "diagonal", "threads" })->UseRealTime();
+
+// Everything a layer call does on the compute pool
+static void BM_filterLines(benchmark::State& state)
+{
+    const auto layer = benchmarkLayer(state);
+    const auto profile = PrinterProfile::defaults();
+    for (auto _ : state)
+    {
+        const auto gcode = filterLines(layer, profile);
+        benchmark::DoNotOptimize(gcode.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * layer.size());
+}
+BENCHMARK(BM_filterLines)->Apply(layerShapes);
+
+// Running a generated layer on the emulated printer, items are g-code lines
+static void BM_emulate(benchmark::State& state)
+{
+    const auto layer = benchmarkLayer(state);
+    PrintManager manager(PrinterProfile::defaults());
+    manager.parse(splitLines(layer));
+    const auto gcode = manager.generate(1);
+    const auto lines = std::count(gcode.begin(), gcode.end(), '\n');
+
+    PrinterEmulator emulator(PrinterProfile::defaults());
+    for (auto _ : state)
+    {
+        emulator.feed(gcode);
+        benchmark::DoNotOptimize(emulator.elapsed());
+    }
+    state.SetItemsProcessed(state.iterations() * lines);
+    state.SetBytesProcessed(state.iterations() * gcode.size());
+}
+BENCHMARK(BM_emulate)->Apply(layerShapes);
+
+// Generating a layer again from its pattern kept in a volume, without parsing it
+static void BM_volume_regenerate(benchmark::State& state)
+{
+    const auto layer = benchmarkLayer(state);
+    const auto profile = PrinterProfile::defaults();
+    const auto path = std::filesystem::temp_directory_path() / "onlyfans_bench.volume";
+    std::filesystem::remove(path);
+    const auto [rows, width] = VolumeDirectory::geometry(*profile);
+    VolumeStore volume(path, rows, width);
+    {
+        PrintManager manager(profile);
+        manager.parse(splitLines(layer));
+        volume.store(1, manager.gcodeparser.pattern);
+    }
+
+    PrintManager manager(profile);
+    size_t bytes = 0;
+    for (auto _ : state)
+    {
+        volume.load(1, manager.gcodeparser.pattern);
+        const auto gcode = manager.generate(1);
+        bytes += gcode.size();
+        benchmark::DoNotOptimize(gcode.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(static_cast<int64_t>(bytes));
+    std::filesystem::remove(path);
+}
+BENCHMARK(BM_volume_regenerate)->Apply(layerShapes);
+
+// A layer call from a client on this machine, through the plugin as it is served, without the cache
+static void BM_grpc_roundtrip(benchmark::State& state)
+{
+    using generate_t = plugin::onlyfans::Generate<modify::PostprocessModifyService::AsyncService, modify::CallResponse, modify::CallRequest>;
+    // port 0 lets the system pick a free one, so parallel runs do not collide
+    plugin::Plugin<generate_t> server{ "127.0.0.1", "0", grpc::InsecureServerCredentials(), 1, 4 };
+    server.addHandshakeService(plugin::Handshake{ .metadata = server.metadata });
+    server.addGenerateService(generate_t{ .metadata = server.metadata });
+    server.start();
+    if (server.port() == 0)
+    {
+        state.SkipWithError("Could not bind a port on 127.0.0.1");
+        return;
+    }
+    std::thread serving(
+        [&server]
+        {
+            server.run();
+        });
+
+    const auto channel = grpc::CreateChannel(fmt::format("127.0.0.1:{}", server.port()), grpc::InsecureChannelCredentials());
+    const auto stub = modify::PostprocessModifyService::NewStub(channel);
+    modify::CallRequest request;
+    request.set_gcode_word(benchmarkLayer(state));
+    for (auto _ : state)
+    {
+        grpc::ClientContext context;
+        context.AddMetadata("cura-engine-uuid", "benchmark");
+        modify::CallResponse response;
+        const auto status = stub->Call(&context, request, &response);
+        if (! status.ok())
+        {
+            state.SkipWithError(status.error_message().c_str());
+            break;
+        }
+        benchmark::DoNotOptimize(response.gcode_word().data());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * request.gcode_word().size());
+
+    server.stop();
+    serving.join();
+}
+BENCHMARK(BM_grpc_roundtrip)->Args({ 1000, 25, 10 })->Args({ 10000, 25, 10 })->ArgNames({ "lines", "fill", "diagonal" })->UseRealTime();
+
+// The version goes into the context of the results, so runs of different releases can be told apart
+int main(int argc, char** argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+    benchmark::AddCustomContext("onlyfans_version", std::string{ plugin::cmdline::VERSION });
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,211 @@
+
+#include "plugin/cmdline.h" // Custom command line argument definitions
+#include "processor/batch.h" // Parallel conversion of whole files
+#include "processor/mapped.h" // Memory mapped input
+#include "processor/profile.h" // Printer settings
+#include "processor/volume.h" // Rasterized layers of a print
+
+#include <docopt/docopt.h> // Library for parsing command line arguments
+#include <fmt/format.h> // Formatting library
+#include <spdlog/spdlog.h> // Logging library
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Writes the print write(out) produces to output, through a temporary file so an interrupted run never leaves half a print behind
+template<class Write>
+static BatchResult writeFile(const std::filesystem::path& output, size_t buffer_bytes, const Write& write)
+{
+    auto temporary = output;
+    temporary += ".tmp";
+    try
+    {
+        // the buffer must be in place before the file is opened
+        std::vector<char> buffer(std::max<size_t>(buffer_bytes, 4096));
+        std::ofstream file;
+        file.rdbuf()->pubsetbuf(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        file.open(temporary, std::ios::binary | std::ios::trunc);
+        if (! file)
+        {
+            throw std::runtime_error("Could not create " + temporary.string());
+        }
+        const auto result = write(file);
+        file.close();
+        if (! file)
+        {
+            throw std::runtime_error("Could not write " + temporary.string());
+        }
+        std::filesystem::rename(temporary, output);
+        return result;
+    }
+    catch (...)
+    {
+        std::error_code ec;
+        std::filesystem::remove(temporary, ec);
+        throw;
+    }
+}
+
+// Converts input to output, keeping the rasterized layers in volume when given
+static bool convertFile(
+    const std::filesystem::path& input,
+    const std::filesystem::path& output,
+    const std::shared_ptr<const PrinterProfile>& profile,
+    size_t threads,
+    size_t buffer_bytes,
+    VolumeStore* volume,
+    bool deduplicate)
+{
+    try
+    {
+        const auto started = std::chrono::steady_clock::now();
+        const MappedFile gcode(input);
+        const auto result = writeFile(
+            output,
+            buffer_bytes,
+            [&](std::ostream& out)
+            {
+                return convert_gcode(gcode.view(), profile, out, threads, volume, deduplicate);
+            });
+
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        spdlog::info(
+            "Converted {} layers of {} to {} in {:.2f} s, {:.1f} MB/s, {} layers repeat the one before, the print takes {:.0f} s",
+            result.layers,
+            input.string(),
+            output.string(),
+            seconds,
+            static_cast<double>(gcode.size()) / 1e6 / std::max(seconds, 1e-9),
+            result.deduplicated,
+            result.print_time);
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        spdlog::error("Could not convert {}: {}", input.string(), e.what());
+        return false;
+    }
+}
+
+// Generates the print of the layers kept in a volume again, with the settings of profile
+static bool regenerateFile(
+    const std::filesystem::path& input,
+    const std::filesystem::path& output,
+    const std::shared_ptr<const PrinterProfile>& profile,
+    size_t threads,
+    size_t buffer_bytes,
+    bool deduplicate)
+{
+    try
+    {
+        const auto started = std::chrono::steady_clock::now();
+        const VolumeStore volume(input);
+        const auto result = writeFile(
+            output,
+            buffer_bytes,
+            [&](std::ostream& out)
+            {
+                return regenerate_volume(volume, profile, out, threads, deduplicate);
+            });
+
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        spdlog::info(
+            "Generated {} layers of {} to {} in {:.2f} s, {} layers repeat the one before, the print takes {:.0f} s",
+            result.layers,
+            input.string(),
+            output.string(),
+            seconds,
+            result.deduplicated,
+            result.print_time);
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        spdlog::error("Could not generate {}: {}", input.string(), e.what());
+        return false;
+    }
+}
+
+int main(int argc, const char** argv)
+{
+    constexpr bool show_help = true;
+    const std::map<std::string, docopt::value> args
+        = docopt::docopt(fmt::format(plugin::cmdline::CONVERT_USAGE, plugin::cmdline::NAME), { argv + 1, argv + argc }, show_help, plugin::cmdline::VERSION_ID);
+
+    std::shared_ptr<const PrinterProfile> profile;
+    try
+    {
+        profile = std::make_shared<const PrinterProfile>(PrinterParameters::from_assignments(args.at("--set").asStringList()));
+    }
+    catch (const std::exception& e)
+    {
+        spdlog::error("Invalid printer settings: {}", e.what());
+        return 1;
+    }
+
+    const auto threads = args.at("--threads").asLong() > 0 ? static_cast<size_t>(args.at("--threads").asLong()) : std::max(std::thread::hardware_concurrency(), 1U);
+    const auto buffer_bytes = static_cast<size_t>(std::max(args.at("--write-buffer-mb").asLong(), 0L)) * 1024 * 1024;
+    const auto deduplicate = args.at("--dedup-layers").asBool();
+
+    if (args.at("--from-volume"))
+    {
+        return regenerateFile(args.at("--from-volume").asString(), args.at("<output>").asString(), profile, threads, buffer_bytes, deduplicate) ? 0 : 1;
+    }
+
+    // the rasterized layers of every input go to the same volume, so it is only meant for a single input
+    std::unique_ptr<VolumeStore> volume;
+    if (args.at("--save-volume"))
+    {
+        try
+        {
+            const auto [rows, width] = VolumeDirectory::geometry(*profile);
+            volume = std::make_unique<VolumeStore>(args.at("--save-volume").asString(), rows, width);
+        }
+        catch (const std::exception& e)
+        {
+            spdlog::error("Could not open the volume: {}", e.what());
+            return 1;
+        }
+    }
+
+    std::vector<std::pair<std::filesystem::path, std::filesystem::path>> files;
+    if (args.at("--output-dir"))
+    {
+        const std::filesystem::path directory{ args.at("--output-dir").asString() };
+        std::filesystem::create_directories(directory);
+        for (const auto& input : args.at("<input>").asStringList())
+        {
+            files.emplace_back(input, directory / std::filesystem::path{ input }.filename());
+        }
+    }
+    else
+    {
+        files.emplace_back(args.at("<input>").asStringList().front(), args.at("<output>").asString());
+    }
+
+    // the layers of one file are converted in parallel, the files one after the other
+    size_t failed = 0;
+    for (const auto& [input, output] : files)
+    {
+        if (! convertFile(input, output, profile, threads, buffer_bytes, volume.get(), deduplicate))
+        {
+            failed++;
+        }
+    }
+    if (failed > 0)
+    {
+        spdlog::error("{} of {} files could not be converted", failed, files.size());
+        return 1;
+    }
+    return 0;
+}
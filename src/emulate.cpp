@@ -0,0 +1,191 @@
+
+#include "plugin/cmdline.h" // Custom command line argument definitions
+#include "processor/emulator.h" // Printer emulation
+#include "processor/layer.h" // Layers of the sliced file
+#include "processor/mapped.h" // Memory mapped input
+#include "processor/profile.h" // Printer settings
+
+#include <docopt/docopt.h> // Library for parsing command line arguments
+#include <fmt/format.h> // Formatting library
+#include <spdlog/spdlog.h> // Logging library
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Rasterizes a layer of the sliced file the way the plugin does before generating it
+static SprayComparison compareWithSource(const PrinterEmulator& emulator, std::string_view layer, const std::shared_ptr<const PrinterProfile>& profile)
+{
+    PrintManager manager(profile);
+    std::vector<std::string_view> lines;
+    bool found = false;
+    while (! layer.empty())
+    {
+        const auto end = layer.find('\n');
+        const auto line = layer.substr(0, end == std::string_view::npos ? layer.size() : end + 1);
+        layer.remove_prefix(line.size());
+        if (found)
+        {
+            lines.push_back(line);
+        }
+        found = found || get_layer_nr(line) >= 0;
+    }
+    manager.parse(lines);
+    return emulator.compare(manager.gcodeparser.pattern);
+}
+
+int main(int argc, const char** argv)
+{
+    constexpr bool show_help = true;
+    const std::map<std::string, docopt::value> args
+        = docopt::docopt(fmt::format(plugin::cmdline::EMULATE_USAGE, plugin::cmdline::NAME), { argv + 1, argv + argc }, show_help, plugin::cmdline::VERSION_ID);
+
+    std::shared_ptr<const PrinterProfile> profile;
+    try
+    {
+        profile = std::make_shared<const PrinterProfile>(PrinterParameters::from_assignments(args.at("--set").asStringList()));
+    }
+    catch (const std::exception& e)
+    {
+        spdlog::error("Invalid printer settings: {}", e.what());
+        return 1;
+    }
+    const auto tolerance = std::stod(args.at("--tolerance").asString());
+    const bool per_layer = args.at("--layers").asBool();
+
+    try
+    {
+        const MappedFile gcode(args.at("<gcode>").asString());
+
+        // the layers of the sliced file by their number, CURRENT_LAYER counts from one
+        std::optional<MappedFile> source;
+        std::unordered_map<int, std::string_view> source_layers;
+        if (args.at("--source"))
+        {
+            source.emplace(args.at("--source").asString());
+            for (const auto layer : split_layers(source->view()))
+            {
+                source_layers.emplace(find_layer_nr(layer) + 1, layer);
+            }
+        }
+
+        size_t layers = 0;
+        size_t compared_rows = 0;
+        size_t mismatched_bits = 0;
+        size_t mismatched_layers = 0;
+        size_t slow_layers = 0;
+        size_t stray_bits = 0;
+        double fastest_switching = 0.0;
+        double largest_deviation = 0.0;
+        std::chrono::steady_clock::duration comparing{};
+
+        PrinterEmulator emulator(profile);
+        emulator.on_layer = [&](const PrinterEmulator& emulated)
+        {
+            const auto& layer = emulated.layer();
+            layers++;
+            stray_bits += layer.stray_bits;
+            fastest_switching = std::max(fastest_switching, layer.max_valve_frequency);
+
+            const auto deviation = layer.estimated ? std::abs(layer.time() - *layer.estimated) : 0.0;
+            largest_deviation = std::max(largest_deviation, deviation);
+            if (deviation > tolerance)
+            {
+                slow_layers++;
+                spdlog::warn("Layer {} takes {:.3f} s, {:.3f} s were estimated", layer.layer_nr, layer.time(), *layer.estimated);
+            }
+
+            std::optional<SprayComparison> comparison;
+            if (source)
+            {
+                const auto source_layer = source_layers.find(layer.layer_nr);
+                if (source_layer == source_layers.end())
+                {
+                    spdlog::warn("Layer {} is not in the sliced file", layer.layer_nr);
+                }
+                else
+                {
+                    const auto compared = std::chrono::steady_clock::now();
+                    comparison = compareWithSource(emulated, source_layer->second, profile);
+                    comparing += std::chrono::steady_clock::now() - compared;
+                    compared_rows += comparison->rows;
+                    mismatched_bits += comparison->mismatched_bits;
+                    if (comparison->mismatched_bits > 0)
+                    {
+                        mismatched_layers++;
+                        spdlog::warn("Layer {} sprays {} valve bits differently from its pattern, first in row {}", layer.layer_nr, comparison->mismatched_bits, *comparison->first_mismatch_row);
+                    }
+                }
+            }
+
+            if (per_layer)
+            {
+                fmt::print(
+                    "layer {:5}: {:10.3f} s (moves {:.3f}, dwell {:.3f}, macros {:.3f}), {} valve sets, {} toggles{}\n",
+                    layer.layer_nr,
+                    layer.time(),
+                    layer.moves,
+                    layer.dwell,
+                    layer.macros,
+                    layer.valve_sets,
+                    layer.valve_toggles,
+                    comparison ? fmt::format(", {} rows compared, {} bits differ", comparison->rows, comparison->mismatched_bits) : "");
+            }
+        };
+
+        const auto started = std::chrono::steady_clock::now();
+        emulator.feed(gcode.view());
+        emulator.finish();
+        // rasterizing the sliced file is not part of the emulation
+        const auto seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - started - comparing).count(), 1e-9);
+
+        const auto toggles = emulator.toggles();
+        const auto busiest = std::max_element(toggles.begin(), toggles.end());
+        uint64_t total_toggles = 0;
+        for (const auto count : toggles)
+        {
+            total_toggles += count;
+        }
+        const auto machine_time = emulator.elapsed();
+        fmt::print(
+            "Emulated {} lines, {} layers in {:.2f} s, {:.1f} million lines/s\n",
+            emulator.lines(),
+            layers,
+            seconds,
+            static_cast<double>(emulator.lines()) / 1e6 / seconds);
+        fmt::print(
+            "Machine time {:.3f} s ({}:{:02}:{:02}), largest difference with the estimate {:.3f} s\n",
+            machine_time,
+            static_cast<long>(machine_time) / 3600,
+            static_cast<long>(machine_time) / 60 % 60,
+            static_cast<long>(machine_time) % 60,
+            largest_deviation);
+        fmt::print(
+            "{} valve toggles, at most {} for valve {}, a valve switched at up to {:.1f} Hz\n",
+            total_toggles,
+            busiest == toggles.end() ? 0 : *busiest,
+            busiest == toggles.end() ? 0 : busiest - toggles.begin(),
+            fastest_switching);
+        if (stray_bits > 0)
+        {
+            fmt::print("{} valve bits open outside the bed\n", stray_bits);
+        }
+        if (source)
+        {
+            fmt::print("{} rows compared with the sliced file, {} bits differ in {} layers\n", compared_rows, mismatched_bits, mismatched_layers);
+        }
+        return mismatched_bits > 0 || slow_layers > 0 ? 1 : 0;
+    }
+    catch (const std::exception& e)
+    {
+        spdlog::error("Could not emulate {}: {}", args.at("<gcode>").asString(), e.what());
+        return 1;
+    }
+}
@@ -1,35 +1,146 @@
 
 #include "cura/plugins/slots/postprocess/v0/modify.grpc.pb.h"
 #include "cura/plugins/slots/postprocess/v0/modify.pb.h"
+#include "plugin/admission.h" // Bounds on the conversions in flight
+#include "plugin/capture.h" // Request capture
 #include "plugin/cmdline.h" // Custom command line argument definitions
 #include "plugin/handshake.h" // Handshake interface
+#include "plugin/logging.h" // Asynchronous logger
 #include "plugin/plugin.h" // Plugin interface
+#include "plugin/stats.h" // Metrics service
+#include "plugin/transfer.h" // Message limits and compression
+#include "plugin/workers.h" // Worker processes
 
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <docopt/docopt.h> // Library for parsing command line arguments
 #include <fmt/format.h> // Formatting library
 #include <grpcpp/server.h>
 #include <spdlog/spdlog.h> // Logging library
 
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
 #include <map>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace cura::plugins::slots::postprocess::v0;
 
+// The value of a numeric option, or minimum with a warning when it is below, e.g. no threads would never serve a call
+long optionAtLeast(const std::map<std::string, docopt::value>& args, const std::string& option, long minimum)
+{
+    const auto value = args.at(option).asLong();
+    if (value < minimum)
+    {
+        spdlog::warn("{} cannot be {}, using {}", option, value, minimum);
+        return minimum;
+    }
+    return value;
+}
+
 int main(int argc, const char** argv)
 {
-    spdlog::set_level(spdlog::level::debug);
     constexpr bool show_help = true;
     const std::map<std::string, docopt::value> args
         = docopt::docopt(fmt::format(plugin::cmdline::USAGE, plugin::cmdline::NAME), { argv + 1, argv + argc }, show_help, plugin::cmdline::VERSION_ID);
+    const auto log_level = plugin::parseLogLevel(args.at("--log-level").asString());
+    plugin::setupAsyncLogging(static_cast<std::size_t>(std::max(args.at("--log-queue").asLong(), 1L)), log_level.value_or(spdlog::level::info));
+    if (! log_level.has_value())
+    {
+        spdlog::warn("Unknown log level {}, logging at info", args.at("--log-level").asString());
+    }
+    if (args.at("--worker-fd"))
+    {
+        const auto status = plugin::runWorker(static_cast<int>(args.at("--worker-fd").asLong()));
+        spdlog::shutdown();
+        return status;
+    }
 
     using generate_t = plugin::onlyfans::Generate<modify::PostprocessModifyService::AsyncService, modify::CallResponse, modify::CallRequest>;
-    plugin::Plugin<generate_t> plugin{ args.at("--address").asString(), args.at("--port").asString(), grpc::InsecureServerCredentials() };
+    // the gRPC threads only move messages, the cores are left to the compute pool
+    const auto threads = static_cast<std::size_t>(optionAtLeast(args, "--threads", 1));
+    const auto calls = static_cast<std::size_t>(optionAtLeast(args, "--calls", 1));
+    plugin::Plugin<generate_t> plugin{ args.at("--address").asString(), args.at("--port").asString(), grpc::InsecureServerCredentials(), threads, calls };
+    const plugin::TransferOptions transfer{ .max_message_bytes = static_cast<std::size_t>(std::max(args.at("--max-message-mb").asLong(), 0L)) * 1024 * 1024,
+                                            .compression = plugin::TransferOptions::parseAlgorithm(args.at("--compression").asString()),
+                                            .compress_min_bytes = static_cast<std::size_t>(std::max(args.at("--compress-min-kb").asLong(), 0L)) * 1024 };
+    plugin.setTransferOptions(transfer);
     plugin.addHandshakeService(plugin::Handshake{ .metadata = plugin.metadata, .broadcast_subscriptions = { cura::plugins::v0::SlotID::SETTINGS_BROADCAST } });
 
-    auto broadcast_settings = std::make_shared<plugin::Broadcast::settings_t>();
-    plugin.addBroadcastService(plugin::Broadcast{ .settings = broadcast_settings, .metadata = plugin.metadata });
-    plugin.addGenerateService(generate_t{ .settings = broadcast_settings, .metadata = plugin.metadata });
+    // with worker processes the compute threads only wait for them, one per worker
+    const auto worker_processes = static_cast<std::size_t>(std::max(args.at("--worker-processes").asLong(), 0L));
+    const auto compute_threads = args.at("--compute-threads").asLong() > 0 ? static_cast<std::size_t>(args.at("--compute-threads").asLong())
+                               : worker_processes > 0                      ? worker_processes
+                                                                           : std::max(std::thread::hardware_concurrency(), 1U);
+    auto compute_pool = std::make_shared<boost::asio::thread_pool>(compute_threads);
+    GCodeGenerator::set_emit_threads(static_cast<std::size_t>(optionAtLeast(args, "--emit-threads", 1)));
+
+    auto admission = std::make_shared<plugin::Admission>(plugin::AdmissionLimits{
+        .max_conversions = static_cast<std::size_t>(std::max(args.at("--max-conversions").asLong(), 0L)),
+        .max_inflight_bytes = static_cast<std::size_t>(std::max(args.at("--max-inflight-mb").asLong(), 0L)) * 1024 * 1024,
+        .queue_timeout = std::chrono::milliseconds{ optionAtLeast(args, "--queue-timeout", 0) },
+        .queue = ! args.at("--reject-when-busy").asBool() });
+
+    // either tier can be used without the other
+    std::shared_ptr<LayerCache> cache;
+    if (args.at("--cache-mb").asLong() > 0 || args.at("--cache-dir"))
+    {
+        const auto cache_dir = args.at("--cache-dir") ? std::filesystem::path{ args.at("--cache-dir").asString() } : std::filesystem::path{};
+        cache = std::make_shared<LayerCache>(
+            static_cast<std::size_t>(std::max(args.at("--cache-mb").asLong(), 0L)) * 1024 * 1024,
+            cache_dir,
+            static_cast<std::size_t>(std::max(args.at("--cache-disk-mb").asLong(), 0L)) * 1024 * 1024);
+    }
+
+    auto broadcast_settings = std::make_shared<plugin::Broadcast::settings_t>(plugin::Broadcast::settings_t::Limits{
+        .ttl = std::chrono::seconds{ args.at("--session-ttl").asLong() },
+        .max_sessions = static_cast<std::size_t>(std::max(args.at("--max-sessions").asLong(), 1L)) });
+    // every request is written to the capture file, for replaying it later
+    std::shared_ptr<plugin::Capture> capture;
+    if (args.at("--capture"))
+    {
+        capture = std::make_shared<plugin::Capture>(args.at("--capture").asString());
+    }
+    plugin.addBroadcastService(plugin::Broadcast{ .settings = broadcast_settings, .metadata = plugin.metadata, .capture = capture });
+
+    const auto trace_file = args.at("--trace") ? std::filesystem::path{ args.at("--trace").asString() } : std::filesystem::path{};
+    if (! trace_file.empty())
+    {
+        Tracer::instance().enable();
+    }
+    auto stats = plugin::Stats{ .file = args.at("--metrics-file") ? std::filesystem::path{ args.at("--metrics-file").asString() } : std::filesystem::path{},
+                                .trace_file = trace_file,
+                                .interval = std::chrono::seconds{ std::max(args.at("--metrics-interval").asLong(), 1L) } };
+    const auto converter = std::make_shared<const LayerConverter>(cache, converter_version());
+    auto generate = generate_t{ .settings = broadcast_settings, .metadata = plugin.metadata, .compute_pool = compute_pool, .admission = admission, .converter = converter, .transfer = transfer, .capture = capture };
+    generate.transfer_stats = std::make_shared<plugin::TransferStats>(static_cast<std::uint64_t>(std::max(args.at("--compression-sample").asLong(), 0L)));
+    if (worker_processes > 0)
+    {
+        generate.workers = std::make_shared<plugin::WorkerPool>(
+            worker_processes,
+            std::chrono::seconds{ std::max(args.at("--worker-timeout").asLong(), 0L) },
+            std::vector<std::string>{ "--log-level=" + args.at("--log-level").asString() });
+        if (args.at("--volume-dir"))
+        {
+            spdlog::warn("The rasterized layers are not kept with worker processes, ignoring --volume-dir");
+        }
+    }
+    else if (args.at("--volume-dir"))
+    {
+        generate.volumes = std::make_shared<VolumeDirectory>(args.at("--volume-dir").asString());
+    }
+    generate.addMetrics(*stats.registry);
+    plugin.addGenerateService(std::move(generate));
+    plugin.addStatsService(std::move(stats));
     plugin.start();
     plugin.run();
     plugin.stop();
+    compute_pool->join();
+    if (! trace_file.empty())
+    {
+        Tracer::instance().write(trace_file);
+    }
+    spdlog::shutdown();
 }
\ No newline at end of file
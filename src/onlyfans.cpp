@@ -0,0 +1,218 @@
+
+#include "onlyfans/onlyfans.h" // The C interface implemented here
+#include "plugin/cmdline.h" // Version of the converter
+#include "processor/cache.h" // Converted layers
+#include "processor/converter.h" // Layer conversion
+#include "processor/profile.h" // Printer settings
+
+#include <algorithm>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+struct onlyfans_profile
+{
+    std::shared_ptr<const PrinterProfile> profile;
+};
+
+struct onlyfans_cache
+{
+    std::shared_ptr<LayerCache> cache;
+};
+
+namespace
+{
+
+constexpr size_t WRITE_CHUNK_BYTES = 64 * 1024;
+
+thread_local std::string last_error;
+
+onlyfans_status fail(onlyfans_status status, std::string_view message)
+{
+    last_error = message;
+    return status;
+}
+
+// Converts with the same cache keys as the plugin, so both can share a cache directory
+LayerConverter converter(onlyfans_cache* cache)
+{
+    return LayerConverter(cache == nullptr ? nullptr : cache->cache, converter_version());
+}
+
+// Runs a conversion without letting an exception out of the C interface
+template<class F>
+onlyfans_status guarded(F&& convert)
+{
+    try
+    {
+        last_error.clear();
+        return convert();
+    }
+    catch (const std::bad_alloc&)
+    {
+        return fail(ONLYFANS_CONVERSION_FAILED, "Out of memory");
+    }
+    catch (const std::exception& e)
+    {
+        return fail(ONLYFANS_CONVERSION_FAILED, e.what());
+    }
+    catch (...)
+    {
+        return fail(ONLYFANS_CONVERSION_FAILED, "Unknown error");
+    }
+}
+
+} // namespace
+
+extern "C"
+{
+
+uint32_t onlyfans_api_version(void)
+{
+    return ONLYFANS_API_VERSION;
+}
+
+const char* onlyfans_version(void)
+{
+    static const std::string version{ plugin::cmdline::VERSION };
+    return version.c_str();
+}
+
+const char* onlyfans_last_error(void)
+{
+    return last_error.c_str();
+}
+
+onlyfans_status onlyfans_profile_create(const char* const* names, const char* const* values, size_t count, onlyfans_profile** profile)
+{
+    if (profile == nullptr || (count > 0 && (names == nullptr || values == nullptr)))
+    {
+        return fail(ONLYFANS_INVALID_ARGUMENT, "Missing profile or settings");
+    }
+    *profile = nullptr;
+    try
+    {
+        std::unordered_map<std::string_view, std::string_view> settings;
+        for (size_t n = 0; n < count; n++)
+        {
+            if (names[n] == nullptr || values[n] == nullptr)
+            {
+                return fail(ONLYFANS_INVALID_ARGUMENT, "Missing setting name or value");
+            }
+            settings.insert_or_assign(names[n], values[n]);
+        }
+        const auto parameters = PrinterParameters::from_settings(
+            [&settings](std::string_view key) -> std::optional<std::string>
+            {
+                const auto setting = settings.find(key);
+                if (setting == settings.end())
+                {
+                    return std::nullopt;
+                }
+                return std::string{ setting->second };
+            });
+        *profile = new onlyfans_profile{ std::make_shared<const PrinterProfile>(parameters) };
+        last_error.clear();
+        return ONLYFANS_OK;
+    }
+    catch (const std::exception& e)
+    {
+        return fail(ONLYFANS_INVALID_ARGUMENT, e.what());
+    }
+}
+
+void onlyfans_profile_destroy(onlyfans_profile* profile)
+{
+    delete profile;
+}
+
+size_t onlyfans_profile_max_output(const onlyfans_profile* profile)
+{
+    return profile == nullptr ? 0 : profile->profile->max_layer_bytes();
+}
+
+onlyfans_status onlyfans_cache_create(size_t memory_bytes, const char* directory, size_t disk_bytes, onlyfans_cache** cache)
+{
+    if (cache == nullptr)
+    {
+        return fail(ONLYFANS_INVALID_ARGUMENT, "Missing cache");
+    }
+    *cache = nullptr;
+    try
+    {
+        *cache = new onlyfans_cache{ std::make_shared<LayerCache>(memory_bytes, directory == nullptr ? std::filesystem::path{} : std::filesystem::path{ directory }, disk_bytes) };
+        last_error.clear();
+        return ONLYFANS_OK;
+    }
+    catch (const std::exception& e)
+    {
+        return fail(ONLYFANS_INVALID_ARGUMENT, e.what());
+    }
+}
+
+void onlyfans_cache_destroy(onlyfans_cache* cache)
+{
+    delete cache;
+}
+
+onlyfans_status onlyfans_convert(
+    const onlyfans_profile* profile,
+    onlyfans_cache* cache,
+    const char* layer,
+    size_t layer_size,
+    char* output,
+    size_t output_capacity,
+    size_t* output_size)
+{
+    if (profile == nullptr || (layer == nullptr && layer_size > 0) || (output == nullptr && output_capacity > 0) || output_size == nullptr)
+    {
+        return fail(ONLYFANS_INVALID_ARGUMENT, "Missing profile, layer or output");
+    }
+    return guarded(
+        [&]()
+        {
+            const auto gcode = converter(cache).convert({ layer, layer_size }, profile->profile);
+            *output_size = gcode.size();
+            if (gcode.size() > output_capacity)
+            {
+                return fail(ONLYFANS_BUFFER_TOO_SMALL, "The output buffer is too small for the converted layer");
+            }
+            std::copy(gcode.begin(), gcode.end(), output);
+            return ONLYFANS_OK;
+        });
+}
+
+onlyfans_status onlyfans_convert_stream(
+    const onlyfans_profile* profile,
+    onlyfans_cache* cache,
+    const char* layer,
+    size_t layer_size,
+    onlyfans_write_fn write,
+    void* user_data)
+{
+    if (profile == nullptr || (layer == nullptr && layer_size > 0) || write == nullptr)
+    {
+        return fail(ONLYFANS_INVALID_ARGUMENT, "Missing profile, layer or write callback");
+    }
+    return guarded(
+        [&]()
+        {
+            const auto gcode = converter(cache).convert({ layer, layer_size }, profile->profile);
+            for (size_t written = 0; written < gcode.size(); written += WRITE_CHUNK_BYTES)
+            {
+                if (write(user_data, gcode.data() + written, std::min(WRITE_CHUNK_BYTES, gcode.size() - written)) != 0)
+                {
+                    return fail(ONLYFANS_ABORTED, "The write callback stopped the conversion");
+                }
+            }
+            return ONLYFANS_OK;
+        });
+}
+
+} // extern "C"
@@ -0,0 +1,232 @@
+
+#include "cura/plugins/slots/broadcast/v0/broadcast.grpc.pb.h"
+#include "cura/plugins/slots/postprocess/v0/modify.grpc.pb.h"
+#include "cura/plugins/slots/postprocess/v0/modify.pb.h"
+#include "plugin/capture.h" // Captured requests
+#include "plugin/cmdline.h" // Custom command line argument definitions
+#include "plugin/logging.h" // Rate-limited errors
+#include "processor/metrics.h" // Latency histogram
+
+#include <docopt/docopt.h> // Library for parsing command line arguments
+#include <fmt/format.h> // Formatting library
+#include <google/protobuf/empty.pb.h>
+#include <grpcpp/channel.h>
+#include <grpcpp/client_context.h>
+#include <grpcpp/create_channel.h>
+#include <grpcpp/security/credentials.h>
+#include <spdlog/spdlog.h> // Logging library
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+using namespace cura::plugins::slots::postprocess::v0;
+using BroadcastRequest = cura::plugins::slots::broadcast::v0::BroadcastServiceSettingsRequest;
+
+// A captured request, parsed up front so parsing is not part of the measured latency
+struct Replayed
+{
+    std::chrono::nanoseconds offset;
+    std::string uuid;
+    std::variant<modify::CallRequest, BroadcastRequest> request;
+};
+
+// A layer call waiting for a free slot, with the time it should have been sent
+struct Pending
+{
+    const Replayed* replayed;
+    std::chrono::steady_clock::time_point scheduled;
+};
+
+int main(int argc, const char** argv)
+{
+    constexpr bool show_help = true;
+    const std::map<std::string, docopt::value> args
+        = docopt::docopt(fmt::format(plugin::cmdline::REPLAY_USAGE, plugin::cmdline::NAME), { argv + 1, argv + argc }, show_help, plugin::cmdline::VERSION_ID);
+
+    std::vector<Replayed> requests;
+    try
+    {
+        plugin::CaptureReader reader(args.at("<capture>").asString());
+        while (auto captured = reader.next())
+        {
+            Replayed replayed{ .offset = captured->offset, .uuid = std::move(captured->uuid) };
+            bool parsed = false;
+            if (captured->kind == plugin::CapturedRequest::CALL)
+            {
+                parsed = replayed.request.emplace<modify::CallRequest>().ParseFromString(captured->payload);
+            }
+            else
+            {
+                parsed = replayed.request.emplace<BroadcastRequest>().ParseFromString(captured->payload);
+            }
+            if (! parsed)
+            {
+                throw std::runtime_error("Capture holds a request that cannot be parsed");
+            }
+            requests.push_back(std::move(replayed));
+        }
+    }
+    catch (const std::exception& e)
+    {
+        spdlog::error("Could not read the capture: {}", e.what());
+        return 1;
+    }
+
+    const auto concurrency = static_cast<std::size_t>(std::max(args.at("--concurrency").asLong(), 1L));
+    const auto speed = std::max(std::stod(args.at("--speed").asString()), 0.0);
+    const auto repeat = static_cast<std::size_t>(std::max(args.at("--repeat").asLong(), 1L));
+
+    grpc::ChannelArguments channel_arguments;
+    channel_arguments.SetMaxReceiveMessageSize(-1);
+    channel_arguments.SetMaxSendMessageSize(-1);
+    const auto channel = grpc::CreateCustomChannel(
+        fmt::format("{}:{}", args.at("--address").asString(), args.at("--port").asString()),
+        grpc::InsecureChannelCredentials(),
+        channel_arguments);
+    const auto broadcast_stub = cura::plugins::slots::broadcast::v0::BroadcastService::NewStub(channel);
+    const auto modify_stub = modify::PostprocessModifyService::NewStub(channel);
+
+    Histogram latency;
+    std::atomic<std::size_t> failed{ 0 };
+    std::atomic<std::size_t> sent_bytes{ 0 };
+    std::atomic<std::size_t> received_bytes{ 0 };
+
+    // a call takes a slot before it is queued and frees it once answered, so at most concurrency calls are in flight
+    std::counting_semaphore<> slots(static_cast<std::ptrdiff_t>(concurrency));
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::deque<Pending> queue;
+    bool dispatched = false;
+
+    const auto work = [&]()
+    {
+        static plugin::LogRateLimit errors;
+        while (true)
+        {
+            Pending pending;
+            {
+                std::unique_lock lock(mutex);
+                queued.wait(
+                    lock,
+                    [&]()
+                    {
+                        return ! queue.empty() || dispatched;
+                    });
+                if (queue.empty())
+                {
+                    return;
+                }
+                pending = queue.front();
+                queue.pop_front();
+            }
+
+            const auto& request = std::get<modify::CallRequest>(pending.replayed->request);
+            grpc::ClientContext context;
+            context.AddMetadata("cura-engine-uuid", pending.replayed->uuid);
+            modify::CallResponse response;
+            const auto sent = std::chrono::steady_clock::now();
+            const auto status = modify_stub->Call(&context, request, &response);
+            const auto answered = std::chrono::steady_clock::now();
+            slots.release();
+
+            if (! status.ok())
+            {
+                failed++;
+                errors.log(spdlog::level::warn, "Layer call failed with status {}: {}", static_cast<int>(status.error_code()), status.error_message());
+                continue;
+            }
+            // paced calls are timed from when they should have been sent, so a slow server is not hidden by the client waiting for it
+            latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(answered - (speed > 0.0 ? pending.scheduled : sent)).count());
+            sent_bytes += request.gcode_word().size();
+            received_bytes += response.gcode_word().size();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(concurrency);
+    for (std::size_t n = 0; n < concurrency; n++)
+    {
+        workers.emplace_back(work);
+    }
+
+    // broadcasts are sent in order from this thread, before any call that was captured after them
+    const auto started = std::chrono::steady_clock::now();
+    const auto length = requests.empty() ? std::chrono::nanoseconds{} : requests.back().offset + std::chrono::milliseconds{ 1 };
+    std::size_t calls = 0;
+    std::size_t broadcasts = 0;
+    for (std::size_t round = 0; round < repeat; round++)
+    {
+        for (const auto& replayed : requests)
+        {
+            auto scheduled = started;
+            if (speed > 0.0)
+            {
+                scheduled += std::chrono::duration_cast<std::chrono::steady_clock::duration>((length * static_cast<double>(round) + replayed.offset) / speed);
+                std::this_thread::sleep_until(scheduled);
+            }
+
+            if (const auto* broadcast = std::get_if<BroadcastRequest>(&replayed.request))
+            {
+                grpc::ClientContext context;
+                context.AddMetadata("cura-engine-uuid", replayed.uuid);
+                google::protobuf::Empty response;
+                const auto status = broadcast_stub->BroadcastSettings(&context, *broadcast, &response);
+                if (! status.ok())
+                {
+                    spdlog::warn("Settings broadcast failed with status {}: {}", static_cast<int>(status.error_code()), status.error_message());
+                }
+                broadcasts++;
+                continue;
+            }
+
+            slots.acquire();
+            {
+                std::scoped_lock lock(mutex);
+                queue.push_back(Pending{ .replayed = &replayed, .scheduled = scheduled });
+            }
+            queued.notify_one();
+            calls++;
+        }
+    }
+    {
+        std::scoped_lock lock(mutex);
+        dispatched = true;
+    }
+    queued.notify_all();
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+
+    const auto seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(), 1e-9);
+    const auto milliseconds = [&latency](double q)
+    {
+        return static_cast<double>(latency.quantile(q)) / 1e6;
+    };
+    fmt::print(
+        "Replayed {} layer calls and {} broadcasts in {:.2f} s: {:.1f} calls/s, {:.1f} MB/s sent, {:.1f} MB/s received\n",
+        calls,
+        broadcasts,
+        seconds,
+        static_cast<double>(latency.count()) / seconds,
+        static_cast<double>(sent_bytes.load()) / 1e6 / seconds,
+        static_cast<double>(received_bytes.load()) / 1e6 / seconds);
+    fmt::print("Latency p50 {:.2f} ms, p99 {:.2f} ms, p999 {:.2f} ms, max {:.2f} ms\n", milliseconds(0.5), milliseconds(0.99), milliseconds(0.999), milliseconds(1.0));
+    if (failed > 0)
+    {
+        fmt::print("{} layer calls failed\n", failed.load());
+        return 1;
+    }
+    return 0;
+}
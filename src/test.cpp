@@ -1,6 +1,36 @@
 #include <gtest/gtest.h>
 
+#include "cura/plugins/slots/postprocess/v0/modify.grpc.pb.h"
+#include "cura/plugins/slots/postprocess/v0/modify.pb.h"
+#include "onlyfans/onlyfans.h"
+#include "plugin/admission.h"
+#include "plugin/capture.h"
+#include "plugin/logging.h"
+#include "plugin/modify.h"
+#include "plugin/plugin.h"
+#include "plugin/registry.h"
+#include "plugin/transfer.h"
+#include "plugin/workers.h"
+#include "processor/allocations.h"
+#include "processor/arena.h"
+#include "processor/batch.h"
+#include "processor/cache.h"
+#include "processor/dedup.h"
+#include "processor/emulator.h"
+#include "processor/layer.h"
+#include "processor/metrics.h"
+#include "processor/trace.h"
 #include "processor/process.h"
+#include "processor/synthetic.h"
+#include "processor/volume.h"
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <grpcpp/create_channel.h>
+#include <grpcpp/security/credentials.h>
+#include <grpcpp/security/server_credentials.h>
+#include <spdlog/sinks/ringbuffer_sink.h>
 
 
 // Define your test cases here
@@ -36,6 +66,19 @@ TEST(basic_values, get_g_move)
     EXPECT_TRUE(res.isExtrusionMove());
 }
 
+TEST(non_moves, try_get_g_move)
+{
+    EXPECT_FALSE(try_get_g_move(";LAYER:1\n").has_value());
+    EXPECT_FALSE(try_get_g_move("M107").has_value());
+    EXPECT_FALSE(try_get_g_move("G0 F1500").has_value());
+
+    const auto move = try_get_g_move("G1 F1500 X10.5 Y-3 E0.25\n");
+    ASSERT_TRUE(move.has_value());
+    EXPECT_FLOAT_EQ(move->X, 10.5);
+    EXPECT_FLOAT_EQ(move->Y, -3);
+    EXPECT_FLOAT_EQ(move->E, 0.25);
+}
+
 TEST(constructor, printhead)
 {
     auto ph = PrintHead(5, 11, 8);
@@ -169,6 +212,1178 @@ TEST(conversion, gcodegenerator)
     EXPECT_TRUE(true);
 }
 
+TEST(row_blocks, gcodegenerator)
+{
+    const auto profile = std::make_shared<const PrinterProfile>(PrinterParameters{ .max_valve_frequency = 60.0f });
+    const auto layer = synthetic_layer(profile->parameters(), SyntheticLayerOptions{ .lines = 3000, .layer_nr = 2, .seed = 5 });
+    const auto generate = [&](size_t threads)
+    {
+        GCodeGenerator::set_emit_threads(threads);
+        PrintManager manager(profile);
+        const auto lines = splitLines(layer);
+        manager.parse(std::span(lines).subspan(1));
+        return manager.generate_layer(2);
+    };
+
+    const auto single = generate(1);
+    const auto blocks = generate(4);
+    GCodeGenerator::set_emit_threads(1);
+    EXPECT_EQ(blocks.gcode, single.gcode);
+    EXPECT_EQ(blocks.body_begin, single.body_begin);
+    EXPECT_EQ(blocks.body_end, single.body_end);
+    EXPECT_EQ(blocks.time, single.time);
+}
+
+TEST(moves, timeestimator)
+{
+    TimeEstimator te(MacroCosts{ .pause_printer = 10.0f });
+    te.begin_layer();
+    te.move(0, 100, 6000); // 100 mm at 100 mm/s
+    te.move_x(300, 6000);
+    te.dwell(3000);
+    te.pause_printer();
+    EXPECT_DOUBLE_EQ(te.layer_moves(), 4.0);
+    EXPECT_DOUBLE_EQ(te.layer_dwell(), 3.0);
+    EXPECT_DOUBLE_EQ(te.layer_macros(), 10.0);
+    EXPECT_DOUBLE_EQ(te.elapsed(), 0.0);
+    te.end_layer();
+    EXPECT_DOUBLE_EQ(te.elapsed(), 17.0);
+}
+
+TEST(time_elapsed, gcodegenerator)
+{
+    PrintHead ph(5, 11, 8);
+    GCodeParser gp(ph, ph.printhead_size() * 2, 10);
+    gp.parse("G0 X0 Y0 E0");
+    gp.parse("G1 X0 Y10 E12.1231");
+
+    GCodeGenerator gg;
+    auto out = gg.generate(gp.pattern, 0, 0, 10);
+    EXPECT_EQ(out.rfind(";ESTIMATED_LAYER_TIME:", 0), 0);
+    // a single layer does not know the time of the layers before it
+    EXPECT_EQ(out.find(";TIME_ELAPSED:"), std::string::npos);
+    EXPECT_DOUBLE_EQ(gg.estimator.layer_dwell(), 3.0);
+    const double first_layer = gg.estimator.elapsed();
+    EXPECT_GT(first_layer, 3.0);
+
+    gg.generate(gp.pattern, 1, 0, 10);
+    EXPECT_GT(gg.estimator.elapsed(), first_layer);
+
+    // the summary keeps its width whatever the times are
+    EXPECT_EQ(gg.layer_time_cmd(1e12, 1e12, -1.0, 0.0).size(), gg.layer_time_cmd(0.0, 0.0, 0.0, 0.0).size());
+}
+
+TEST(valve_frequency, feedrateplanner)
+{
+    const PrinterParameters fixed{ .base_feedrate = 1000, .joint_feedrate = 1000 };
+    auto planned = fixed;
+    planned.max_valve_frequency = 20.0f;
+    planned.acceleration = 500.0f;
+    const auto layer = synthetic_layer(fixed, SyntheticLayerOptions{ .lines = 3000, .fill_density = 0.1, .layer_nr = 2, .seed = 3 });
+
+    const auto emulate = [&layer](const PrinterParameters& parameters)
+    {
+        const auto profile = std::make_shared<const PrinterProfile>(parameters);
+        const auto gcode = filterLines(layer, profile);
+        PrinterEmulator emulator(profile);
+        std::optional<EmulatedLayer> emulated;
+        emulator.on_layer = [&](const PrinterEmulator& done)
+        {
+            emulated = done.layer();
+        };
+        emulator.feed(gcode);
+        emulator.finish();
+        return std::make_pair(gcode, *emulated);
+    };
+    const auto [slow_gcode, slow] = emulate(fixed);
+    const auto [fast_gcode, fast] = emulate(planned);
+
+    // faster, with no valve switching faster than allowed and the estimate still right
+    EXPECT_LT(fast.time(), slow.time());
+    EXPECT_GT(slow.max_valve_frequency, 0.0);
+    EXPECT_LE(fast.max_valve_frequency, 20.0 + 1e-6);
+    ASSERT_TRUE(fast.estimated.has_value());
+    EXPECT_NEAR(fast.time(), *fast.estimated, 1e-3);
+    EXPECT_EQ(fast.valve_toggles, slow.valve_toggles);
+
+    // from one row of the first pass to the next, the speed changes no more than the acceleration allows over 1 mm
+    std::vector<double> speeds;
+    std::istringstream lines(fast_gcode);
+    for (std::string line; std::getline(lines, line);)
+    {
+        if (line.starts_with("G1 Y") && line.find(" X") != std::string::npos && line.find(" F") != std::string::npos)
+        {
+            speeds.push_back(std::stod(line.substr(line.find(" F") + 2)) / 60.0);
+        }
+    }
+    ASSERT_GT(speeds.size(), 100);
+    EXPECT_GT(*std::max_element(speeds.begin(), speeds.end()), 1000.0 / 60.0);
+    for (size_t row = 2; row < speeds.size(); row++)
+    {
+        EXPECT_LE(std::abs(speeds[row] * speeds[row] - speeds[row - 1] * speeds[row - 1]), 2.0 * 500.0 + 1.0) << "row " << row;
+    }
+
+    // without a valve frequency every row keeps its fixed feedrate
+    EXPECT_EQ(filterLines(layer), filterLines(layer, std::make_shared<const PrinterProfile>(PrinterParameters{ .max_feedrate = 1 })));
+}
+
+// Each admission test drives its calls from coroutines on a GrpcContext of its own, run() returns once all of them are done
+TEST(fifo_order, admission)
+{
+    agrpc::GrpcContext grpc_context{ std::make_unique<grpc::CompletionQueue>() };
+    auto admission = std::make_shared<plugin::Admission>(plugin::AdmissionLimits{ .max_conversions = 1 });
+    std::vector<int> order;
+    boost::asio::co_spawn(
+        grpc_context,
+        [&]() -> boost::asio::awaitable<void>
+        {
+            auto first = co_await admission->acquire(1);
+            EXPECT_TRUE(first.has_value());
+            for (int i = 0; i < 3; i++)
+            {
+                boost::asio::co_spawn(
+                    grpc_context,
+                    [&, i]() -> boost::asio::awaitable<void>
+                    {
+                        const auto permit = co_await admission->acquire(1);
+                        EXPECT_TRUE(permit.has_value());
+                        order.push_back(i);
+                    },
+                    boost::asio::detached);
+            }
+
+            // let the others line up behind the first permit
+            agrpc::Alarm alarm{ grpc_context };
+            co_await alarm.wait(std::chrono::system_clock::now() + std::chrono::milliseconds{ 50 }, boost::asio::use_awaitable);
+            EXPECT_EQ(admission->stats().queue_depth, 3U);
+            EXPECT_TRUE(order.empty());
+            first.reset();
+        },
+        boost::asio::detached);
+    grpc_context.run();
+
+    EXPECT_EQ(order, (std::vector<int>{ 0, 1, 2 }));
+    const auto stats = admission->stats();
+    EXPECT_EQ(stats.admitted, 4U);
+    EXPECT_EQ(stats.queued, 3U);
+    EXPECT_EQ(stats.active, 0U);
+    EXPECT_EQ(stats.queue_depth, 0U);
+}
+
+TEST(withdraw, admission)
+{
+    agrpc::GrpcContext grpc_context{ std::make_unique<grpc::CompletionQueue>() };
+    auto admission = std::make_shared<plugin::Admission>(plugin::AdmissionLimits{ .max_inflight_bytes = 100 });
+    std::vector<std::string> events;
+    boost::asio::co_spawn(
+        grpc_context,
+        [&]() -> boost::asio::awaitable<void>
+        {
+            auto first = co_await admission->acquire(60);
+            const auto cancelled = plugin::Admission::ticket();
+            boost::asio::co_spawn(
+                grpc_context,
+                [&]() -> boost::asio::awaitable<void>
+                {
+                    const auto permit = co_await admission->acquire(50, cancelled);
+                    events.push_back(permit.has_value() ? "cancelled admitted" : "cancelled withdrawn");
+                },
+                boost::asio::detached);
+            boost::asio::co_spawn(
+                grpc_context,
+                [&]() -> boost::asio::awaitable<void>
+                {
+                    const auto permit = co_await admission->acquire(30);
+                    events.push_back(permit.has_value() ? "behind admitted" : "behind rejected");
+                },
+                boost::asio::detached);
+
+            // the call behind fits next to the first one, but waits for the cancelled one ahead of it
+            agrpc::Alarm alarm{ grpc_context };
+            co_await alarm.wait(std::chrono::system_clock::now() + std::chrono::milliseconds{ 50 }, boost::asio::use_awaitable);
+            EXPECT_EQ(admission->stats().queue_depth, 2U);
+            admission->withdraw(cancelled);
+            co_await alarm.wait(std::chrono::system_clock::now() + std::chrono::milliseconds{ 50 }, boost::asio::use_awaitable);
+            EXPECT_EQ(events, (std::vector<std::string>{ "cancelled withdrawn", "behind admitted" }));
+            EXPECT_EQ(admission->stats().admitted, 2U);
+
+            // a call cancelled before it asks is not admitted either
+            const auto early = plugin::Admission::ticket();
+            admission->withdraw(early);
+            EXPECT_FALSE((co_await admission->acquire(1, early)).has_value());
+            first.reset();
+        },
+        boost::asio::detached);
+    grpc_context.run();
+
+    const auto stats = admission->stats();
+    EXPECT_EQ(stats.withdrawn, 2U);
+    EXPECT_EQ(stats.timed_out, 0U);
+    EXPECT_EQ(stats.active, 0U);
+    EXPECT_EQ(stats.inflight_bytes, 0U);
+}
+
+TEST(queue_timeout, admission)
+{
+    agrpc::GrpcContext grpc_context{ std::make_unique<grpc::CompletionQueue>() };
+    auto admission = std::make_shared<plugin::Admission>(plugin::AdmissionLimits{ .max_conversions = 1, .queue_timeout = std::chrono::milliseconds{ 20 } });
+    boost::asio::co_spawn(
+        grpc_context,
+        [&]() -> boost::asio::awaitable<void>
+        {
+            const auto first = co_await admission->acquire(1);
+            EXPECT_TRUE(first.has_value());
+
+            const auto queued = std::chrono::steady_clock::now();
+            const auto second = co_await admission->acquire(1);
+            EXPECT_FALSE(second.has_value());
+            EXPECT_GE(std::chrono::steady_clock::now() - queued, std::chrono::milliseconds{ 20 });
+        },
+        boost::asio::detached);
+    grpc_context.run();
+
+    const auto stats = admission->stats();
+    EXPECT_EQ(stats.admitted, 1U);
+    EXPECT_EQ(stats.timed_out, 1U);
+    EXPECT_EQ(stats.queue_depth, 0U);
+    EXPECT_EQ(stats.active, 0U);
+}
+
+TEST(reject_when_busy, admission)
+{
+    agrpc::GrpcContext grpc_context{ std::make_unique<grpc::CompletionQueue>() };
+    auto admission = std::make_shared<plugin::Admission>(plugin::AdmissionLimits{ .max_conversions = 1, .queue = false });
+    boost::asio::co_spawn(
+        grpc_context,
+        [&]() -> boost::asio::awaitable<void>
+        {
+            auto first = co_await admission->acquire(1);
+            EXPECT_TRUE(first.has_value());
+            EXPECT_FALSE((co_await admission->acquire(1)).has_value());
+
+            first.reset();
+            EXPECT_TRUE((co_await admission->acquire(1)).has_value());
+        },
+        boost::asio::detached);
+    grpc_context.run();
+
+    const auto stats = admission->stats();
+    EXPECT_EQ(stats.admitted, 2U);
+    EXPECT_EQ(stats.rejected, 1U);
+    EXPECT_EQ(stats.queued, 0U);
+}
+
+TEST(larger_than_budget, admission)
+{
+    agrpc::GrpcContext grpc_context{ std::make_unique<grpc::CompletionQueue>() };
+    auto admission = std::make_shared<plugin::Admission>(plugin::AdmissionLimits{ .max_inflight_bytes = 100 });
+    bool small_admitted{ false };
+    boost::asio::co_spawn(
+        grpc_context,
+        [&]() -> boost::asio::awaitable<void>
+        {
+            // nothing else runs, so it is admitted even though it exceeds the whole budget
+            auto large = co_await admission->acquire(1000);
+            EXPECT_TRUE(large.has_value());
+            EXPECT_EQ(admission->stats().inflight_bytes, 1000U);
+
+            boost::asio::co_spawn(
+                grpc_context,
+                [&]() -> boost::asio::awaitable<void>
+                {
+                    small_admitted = (co_await admission->acquire(10)).has_value();
+                },
+                boost::asio::detached);
+            agrpc::Alarm alarm{ grpc_context };
+            co_await alarm.wait(std::chrono::system_clock::now() + std::chrono::milliseconds{ 50 }, boost::asio::use_awaitable);
+            EXPECT_FALSE(small_admitted);
+            EXPECT_EQ(admission->stats().queue_depth, 1U);
+            large.reset();
+        },
+        boost::asio::detached);
+    grpc_context.run();
+
+    EXPECT_TRUE(small_admitted);
+    EXPECT_EQ(admission->stats().inflight_bytes, 0U);
+}
+
+TEST(cancellation, printmanager)
+{
+    PrintManager pm(PrintHead(5, 11, 8), 0, 100);
+    auto token = CancellationToken::create();
+    pm.set_cancellation(token);
+    pm.parse("G0 X0 Y0");
+    EXPECT_NO_THROW(pm.generate(0));
+
+    token.cancel();
+    EXPECT_THROW(pm.generate(0), Cancelled);
+    EXPECT_THROW(
+        {
+            for (int i = 0; i < 2048; i++)
+            {
+                pm.parse("G1 X0 Y10 E1");
+            }
+        },
+        Cancelled);
+}
+
+TEST(reuse, conversionarena)
+{
+    ConversionArena arena(1024);
+    {
+        PrintManager pm(PrintHead(5, 11, 8), 0, 100, PrinterProfile::defaults(), arena.resource());
+        PrintManager heap(PrintHead(5, 11, 8), 0, 100);
+        for (auto* manager : { &pm, &heap })
+        {
+            manager->parse("G0 X0 Y0");
+            manager->parse("G1 X0 Y10 E1");
+        }
+        EXPECT_EQ(pm.generate(0), heap.generate(0));
+    }
+    EXPECT_GT(arena.overflow(), 0);
+    arena.release();
+    EXPECT_EQ(arena.overflow(), 0);
+    EXPECT_GT(arena.capacity(), 1024);
+
+    // the second conversion fits in the grown buffer
+    {
+        PrintManager pm(PrintHead(5, 11, 8), 0, 100, PrinterProfile::defaults(), arena.resource());
+        pm.generate(0);
+    }
+    EXPECT_EQ(arena.overflow(), 0);
+}
+
+TEST(quantile, histogram)
+{
+    Histogram histogram;
+    EXPECT_EQ(histogram.quantile(0.5), 0);
+    for (std::uint64_t value = 1; value <= 1000; value++)
+    {
+        histogram.record(value * 1000);
+    }
+    EXPECT_EQ(histogram.count(), 1000);
+    EXPECT_EQ(histogram.max(), 1000000);
+    EXPECT_NEAR(static_cast<double>(histogram.quantile(0.5)), 500000.0, 500000.0 / 16);
+    EXPECT_NEAR(static_cast<double>(histogram.quantile(0.99)), 990000.0, 990000.0 / 16);
+    EXPECT_EQ(histogram.quantile(1.0), 1000000);
+}
+
+TEST(prometheus, metricsregistry)
+{
+    MetricsRegistry registry;
+    auto& layers = registry.counter("layers_total", "Layers");
+    EXPECT_EQ(&layers, &registry.counter("layers_total", "Layers"));
+    layers.add(3);
+    registry.histogram("stage_seconds", "Stages", 1e-9, "stage=\"parse\"").record(2000000000);
+    registry.histogram("stage_seconds", "Stages", 1e-9, "stage=\"emit\"");
+    auto& gauge = registry.gauge("depth", "Depth");
+    registry.collect(
+        [&gauge]()
+        {
+            gauge.set(7);
+        });
+
+    const auto text = registry.prometheus();
+    EXPECT_NE(text.find("# TYPE layers_total counter\nlayers_total 3\n"), std::string::npos);
+    EXPECT_EQ(text.find("# TYPE stage_seconds summary"), text.rfind("# TYPE stage_seconds summary"));
+    EXPECT_NE(text.find("stage_seconds{stage=\"parse\",quantile=\"1\"} 2\n"), std::string::npos);
+    EXPECT_NE(text.find("stage_seconds_count{stage=\"emit\"} 0\n"), std::string::npos);
+    EXPECT_NE(text.find("depth 7\n"), std::string::npos);
+}
+
+TEST(stats, printmanager)
+{
+    PrintManager pm(PrintHead(5, 11, 8), 0, 100);
+    PipelineStats stats;
+    pm.set_stats(&stats);
+    const std::vector<std::string_view> lines = { "G0 X0 Y0\n", "M107\n", "G1 X0 Y10 E1\n", "G1 X5 Y10\n", "G1 X5 Y0 E2\n" };
+    pm.parse(lines);
+    const auto out = pm.generate(0);
+
+    EXPECT_EQ(stats.lines, 5);
+    EXPECT_EQ(stats.moves, 4);
+    EXPECT_EQ(stats.spray_lines, 2);
+    EXPECT_EQ(stats.output_bytes, out.size());
+    EXPECT_EQ(stats.open_valve_bits, 20);
+    EXPECT_EQ(stats.valve_bits, 99 * 22 * 8);
+}
+
+TEST(conversion, allocationscope)
+{
+    if (! AllocationTracker::enabled())
+    {
+        GTEST_SKIP() << "allocations are only counted when built with ONLYFANS_TRACK_ALLOCATIONS";
+    }
+    {
+        const AllocationScope outer;
+        {
+            const AllocationScope inner;
+            const auto block = std::make_unique<std::array<char, 1000>>();
+            EXPECT_EQ(inner.counted().allocations, 1);
+            EXPECT_GE(inner.counted().peak_live_bytes, 1000);
+        }
+        EXPECT_EQ(outer.counted().allocations, 1);
+        EXPECT_EQ(outer.counted().live_bytes, 0);
+        EXPECT_GE(outer.counted().peak_live_bytes, 1000);
+    }
+
+    // the arena of the thread is warm after the first layer, the next ones allocate little beyond their output
+    const auto profile = PrinterProfile::defaults();
+    const auto layer = synthetic_layer(profile->parameters(), SyntheticLayerOptions{ .lines = 2000, .layer_nr = 5, .seed = 3 });
+    filterLines(layer, profile);
+    PipelineStats stats;
+    std::string gcode;
+    {
+        const AllocationScope scope;
+        gcode = filterLines(layer, profile, {}, &stats);
+        stats.allocations = scope.counted();
+    }
+    EXPECT_LE(stats.allocations.allocations, 16);
+    EXPECT_GE(stats.allocations.live_bytes, static_cast<std::int64_t>(gcode.size()));
+    EXPECT_GE(stats.allocations.peak_live_bytes, stats.allocations.live_bytes);
+    std::uint64_t staged = 0;
+    for (const auto& stage : stats.stage_allocations)
+    {
+        staged += stage.allocations;
+    }
+    EXPECT_LE(staged, stats.allocations.allocations);
+}
+
+TEST(roundtrip, capture)
+{
+    const auto path = std::filesystem::temp_directory_path() / "onlyfans_test.capture";
+    const std::string payload{ "\x0a\x03G1\x00X", 7 };
+    {
+        plugin::Capture capture(path);
+        capture.record(plugin::CapturedRequest::BROADCAST, "slice", "settings");
+        capture.record(plugin::CapturedRequest::CALL, "slice", payload);
+        capture.record(plugin::CapturedRequest::CALL, "", "");
+    }
+
+    plugin::CaptureReader reader(path);
+    const auto broadcast = reader.next();
+    ASSERT_TRUE(broadcast.has_value());
+    EXPECT_EQ(broadcast->kind, plugin::CapturedRequest::BROADCAST);
+    EXPECT_EQ(broadcast->uuid, "slice");
+    EXPECT_EQ(broadcast->payload, "settings");
+    const auto call = reader.next();
+    ASSERT_TRUE(call.has_value());
+    EXPECT_EQ(call->kind, plugin::CapturedRequest::CALL);
+    EXPECT_EQ(call->payload, payload);
+    EXPECT_GE(call->offset, broadcast->offset);
+    const auto empty = reader.next();
+    ASSERT_TRUE(empty.has_value());
+    EXPECT_TRUE(empty->uuid.empty() && empty->payload.empty());
+    EXPECT_FALSE(reader.next().has_value());
+
+    // cut off in the middle of the last request
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 3);
+    plugin::CaptureReader truncated(path);
+    truncated.next();
+    truncated.next();
+    EXPECT_THROW(truncated.next(), std::runtime_error);
+    std::filesystem::remove(path);
+}
+
+TEST(ordered, convert_gcode)
+{
+    std::string gcode = ";FLAVOR:Griffin\nG28\n";
+    for (int layer_nr = 0; layer_nr < 12; layer_nr++)
+    {
+        gcode += synthetic_layer(PrinterProfile::defaults()->parameters(), SyntheticLayerOptions{ .lines = 200, .layer_nr = layer_nr, .seed = static_cast<std::uint32_t>(layer_nr) });
+    }
+    const auto layers = split_layers(gcode);
+    ASSERT_EQ(layers.size(), 12);
+    EXPECT_TRUE(layers[3].starts_with(";LAYER:3\n"));
+    EXPECT_TRUE(layers[3].ends_with("\n"));
+
+    GCodeGenerator generator;
+    auto expected = generator.print_begin_cmd(12);
+    double elapsed = 0.0;
+    for (const auto layer : layers)
+    {
+        const auto converted = convert_layer(layer);
+        elapsed += converted.time;
+        expected += converted.gcode;
+        expected += generator.time_elapsed_cmd(elapsed);
+    }
+    expected += generator.print_time_cmd(elapsed);
+    expected += generator.print_end_cmd(12);
+
+    std::ostringstream out;
+    const auto result = convert_gcode(gcode, PrinterProfile::defaults(), out, 4);
+    EXPECT_EQ(result.layers, 12);
+    EXPECT_DOUBLE_EQ(result.print_time, elapsed);
+    EXPECT_EQ(result.output_bytes, expected.size());
+    EXPECT_EQ(out.str(), expected);
+
+    // an extrusion move that is not along Y cannot be sprayed, it is skipped and the next line starts where the one before it ended
+    const std::string diagonal = ";LAYER:0\nG0 X10 Y10\nG1 X20 Y20 E1\nG1 X10 Y30 E2\n";
+    EXPECT_EQ(filterLines(diagonal, PrinterProfile::defaults()), filterLines(";LAYER:0\nG0 X10 Y10\nG1 X10 Y30 E2\n", PrinterProfile::defaults()));
+    std::ostringstream skipped;
+    EXPECT_EQ(convert_gcode(gcode + ";LAYER:12\nG0 X10 Y10\nG1 X20 Y20 E1\n", PrinterProfile::defaults(), skipped, 4).layers, 13);
+}
+
+TEST(regenerate, volumestore)
+{
+    const auto path = std::filesystem::temp_directory_path() / "onlyfans_test.volume";
+    std::filesystem::remove(path);
+    const auto profile = PrinterProfile::defaults();
+    std::string gcode;
+    for (const int layer_nr : { 0, 1, 2, 300 }) // beyond the initial capacity of the file
+    {
+        gcode += synthetic_layer(profile->parameters(), SyntheticLayerOptions{ .lines = 200, .layer_nr = layer_nr, .seed = static_cast<std::uint32_t>(layer_nr) });
+    }
+
+    const auto [rows, width] = VolumeDirectory::geometry(*profile);
+    std::ostringstream converted;
+    {
+        VolumeStore volume(path, rows, width);
+        convert_gcode(gcode, profile, converted, 2, &volume);
+    }
+    const VolumeStore volume(path);
+    EXPECT_EQ(volume.layers(), (std::vector<int>{ 0, 1, 2, 300 }));
+    EXPECT_FALSE(volume.contains(3));
+
+    // the generated print is the same as the converted one, also for other motion settings
+    std::ostringstream regenerated;
+    const auto result = regenerate_volume(volume, profile, regenerated, 2);
+    EXPECT_EQ(result.layers, 4);
+    EXPECT_EQ(regenerated.str(), converted.str());
+
+    const auto slower = std::make_shared<const PrinterProfile>(PrinterParameters{ .base_feedrate = 3000, .pass_dwell = 1000 });
+    std::ostringstream expected;
+    convert_gcode(gcode, slower, expected, 2);
+    std::ostringstream changed;
+    regenerate_volume(volume, slower, changed, 2);
+    EXPECT_EQ(changed.str(), expected.str());
+    EXPECT_NE(changed.str(), converted.str());
+
+    // another print head rasterizes patterns of another size
+    const auto wider = std::make_shared<const PrinterProfile>(PrinterParameters{ .nr_of_blocks = 12 });
+    std::ostringstream rejected;
+    EXPECT_THROW(regenerate_volume(volume, wider, rejected), std::invalid_argument);
+    EXPECT_THROW(VolumeStore(path, rows, width + 1), VolumeMismatch);
+    std::filesystem::remove(path);
+}
+
+TEST(geometry, volumedirectory)
+{
+    const auto directory = std::filesystem::temp_directory_path() / "onlyfans_test_volumes";
+    std::filesystem::remove_all(directory);
+    VolumeDirectory volumes(directory);
+    const auto profile = PrinterProfile::defaults();
+    std::ostringstream converted;
+    convert_gcode(synthetic_layer(profile->parameters(), SyntheticLayerOptions{ .lines = 50 }), profile, converted, 1, volumes.open("print", *profile).get());
+    EXPECT_TRUE(volumes.open("print", *profile)->contains(1));
+
+    // a print sliced again for another print head starts a new volume
+    const auto wider = std::make_shared<const PrinterProfile>(PrinterParameters{ .nr_of_blocks = 12 });
+    {
+        const auto volume = VolumeDirectory(directory).open("print", *wider);
+        EXPECT_EQ(volume->width(), VolumeDirectory::geometry(*wider).second);
+        EXPECT_FALSE(volume->contains(1));
+    }
+
+    // anything else is not a reason to drop the file
+    std::filesystem::resize_file(volumes.path("print"), 4);
+    EXPECT_THROW(VolumeDirectory(directory).open("print", *wider), std::runtime_error);
+    EXPECT_TRUE(std::filesystem::exists(volumes.path("print")));
+    std::filesystem::remove_all(directory);
+}
+
+TEST(repeated_layers, layerdeduplicator)
+{
+    const auto profile = PrinterProfile::defaults();
+    const auto wall = synthetic_layer(profile->parameters(), SyntheticLayerOptions{ .lines = 300, .seed = 5 });
+    const auto other = synthetic_layer(profile->parameters(), SyntheticLayerOptions{ .lines = 300, .seed = 6 });
+    const auto body = [](std::string_view layer)
+    {
+        return layer.substr(layer.find('\n') + 1);
+    };
+    std::string gcode;
+    for (int layer_nr = 0; layer_nr < 10; layer_nr++)
+    {
+        // a wall of six layers, one other layer and a wall of three
+        gcode += std::format(";LAYER:{}\n", layer_nr);
+        gcode += body(layer_nr == 6 ? other : wall);
+    }
+
+    std::ostringstream plain;
+    convert_gcode(gcode, profile, plain, 2);
+    std::ostringstream deduplicated;
+    const auto result = convert_gcode(gcode, profile, deduplicated, 2, nullptr, true);
+    EXPECT_EQ(result.layers, 10);
+    EXPECT_EQ(result.deduplicated, 7);
+    EXPECT_EQ(result.output_bytes, deduplicated.str().size());
+    EXPECT_LT(deduplicated.str().size() * 3, plain.str().size());
+
+    // the printer does the same for both
+    const auto emulate = [&profile](const std::string& print)
+    {
+        PrinterEmulator emulator(profile);
+        std::vector<std::pair<EmulatedLayer, std::array<ValveRows, 2>>> layers;
+        emulator.on_layer = [&](const PrinterEmulator& emulated)
+        {
+            layers.emplace_back(emulated.layer(), std::array{ emulated.sprayed(0), emulated.sprayed(1) });
+        };
+        emulator.feed(print);
+        emulator.finish();
+        return layers;
+    };
+    const auto expected = emulate(plain.str());
+    const auto emulated = emulate(deduplicated.str());
+    ASSERT_EQ(emulated.size(), expected.size());
+    for (size_t layer = 0; layer < emulated.size(); layer++)
+    {
+        EXPECT_EQ(emulated[layer].first.layer_nr, expected[layer].first.layer_nr);
+        EXPECT_DOUBLE_EQ(emulated[layer].first.time(), expected[layer].first.time());
+        EXPECT_EQ(emulated[layer].first.valve_toggles, expected[layer].first.valve_toggles);
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (size_t row = 0; row < expected[layer].second[pass].size(); row++)
+            {
+                const auto sprayed = emulated[layer].second[pass][row];
+                const auto wanted = expected[layer].second[pass][row];
+                ASSERT_TRUE(std::equal(sprayed.begin(), sprayed.end(), wanted.begin())) << "layer " << layer << " row " << row;
+            }
+        }
+    }
+
+    PrinterEmulator emulator(profile);
+    EXPECT_THROW(emulator.execute("RUN_LAYER_MACRO NAME=LAYER_0"), std::invalid_argument);
+}
+
+TEST(c_interface, onlyfans_convert)
+{
+    const char* names[] = { "onlyfans_pass_dwell" };
+    const char* values[] = { "1500" };
+    onlyfans_profile* profile = nullptr;
+    ASSERT_EQ(onlyfans_profile_create(names, values, 1, &profile), ONLYFANS_OK);
+    onlyfans_cache* cache = nullptr;
+    ASSERT_EQ(onlyfans_cache_create(1024 * 1024, nullptr, 0, &cache), ONLYFANS_OK);
+
+    const auto layer = synthetic_layer(PrinterProfile::defaults()->parameters(), SyntheticLayerOptions{ .lines = 300, .layer_nr = 2 });
+    const auto expected = filterLines(layer, std::make_shared<const PrinterProfile>(PrinterParameters{ .pass_dwell = 1500 }));
+
+    // too small a buffer reports the size it needs
+    size_t size = 0;
+    std::string output(16, '\0');
+    EXPECT_EQ(onlyfans_convert(profile, cache, layer.data(), layer.size(), output.data(), output.size(), &size), ONLYFANS_BUFFER_TOO_SMALL);
+    EXPECT_EQ(size, expected.size());
+    EXPECT_NE(std::string_view{ onlyfans_last_error() }, "");
+    output.resize(onlyfans_profile_max_output(profile));
+    ASSERT_EQ(onlyfans_convert(profile, cache, layer.data(), layer.size(), output.data(), output.size(), &size), ONLYFANS_OK);
+    EXPECT_EQ(std::string_view(output.data(), size), expected);
+    EXPECT_EQ(std::string_view{ onlyfans_last_error() }, "");
+
+    std::string streamed;
+    const auto append = [](void* user_data, const char* data, size_t length) -> int
+    {
+        static_cast<std::string*>(user_data)->append(data, length);
+        return 0;
+    };
+    ASSERT_EQ(onlyfans_convert_stream(profile, nullptr, layer.data(), layer.size(), append, &streamed), ONLYFANS_OK);
+    EXPECT_EQ(streamed, expected);
+    const auto stop = [](void*, const char*, size_t) -> int
+    {
+        return 1;
+    };
+    EXPECT_EQ(onlyfans_convert_stream(profile, cache, layer.data(), layer.size(), stop, nullptr), ONLYFANS_ABORTED);
+
+    // an extrusion that is not along Y is skipped, not an error
+    const std::string_view diagonal = ";LAYER:0\nG0 X10 Y10\nG1 X20 Y20 E1\n";
+    EXPECT_EQ(onlyfans_convert(profile, cache, diagonal.data(), diagonal.size(), output.data(), output.size(), &size), ONLYFANS_OK);
+    EXPECT_EQ(std::string_view{ onlyfans_last_error() }, "");
+
+    // a line past the end of the bed or the print head fails instead of writing outside the pattern
+    const std::string_view past_bed = ";LAYER:0\nG0 X10 Y10\nG1 X10 Y5000 E1\n";
+    EXPECT_EQ(onlyfans_convert(profile, cache, past_bed.data(), past_bed.size(), output.data(), output.size(), &size), ONLYFANS_CONVERSION_FAILED);
+    EXPECT_NE(std::string_view{ onlyfans_last_error() }, "");
+    for (const std::string_view outside : { ";LAYER:0\nG0 X-10 Y10\nG1 X-10 Y20 E1\n", ";LAYER:0\nG0 X5000 Y10\nG1 X5000 Y20 E1\n" })
+    {
+        EXPECT_EQ(onlyfans_convert(profile, cache, outside.data(), outside.size(), output.data(), output.size(), &size), ONLYFANS_CONVERSION_FAILED);
+    }
+
+    onlyfans_profile* invalid = nullptr;
+    values[0] = "three seconds";
+    EXPECT_EQ(onlyfans_profile_create(names, values, 1, &invalid), ONLYFANS_INVALID_ARGUMENT);
+    EXPECT_EQ(invalid, nullptr);
+
+    onlyfans_cache_destroy(cache);
+    onlyfans_profile_destroy(profile);
+}
+
+TEST(seeded, synthetic_layer)
+{
+    const auto& parameters = PrinterProfile::defaults()->parameters();
+    const SyntheticLayerOptions options{ .lines = 500, .fill_density = 0.3, .diagonal_fraction = 0.2, .layer_nr = 4, .seed = 7 };
+    const auto layer = synthetic_layer(parameters, options);
+    EXPECT_EQ(layer, synthetic_layer(parameters, options));
+    EXPECT_NE(layer, synthetic_layer(parameters, SyntheticLayerOptions{ .lines = 500, .seed = 8 }));
+    EXPECT_TRUE(layer.starts_with(";LAYER:4\n"));
+
+    PrintManager manager(PrinterProfile::defaults());
+    PipelineStats stats;
+    manager.set_stats(&stats);
+    const auto lines = splitLines(layer);
+    ASSERT_NO_THROW(manager.parse(lines));
+    EXPECT_EQ(stats.spray_lines, options.lines);
+    EXPECT_GT(stats.moves, 2 * options.lines);
+}
+
+TEST(generated_layers, printeremulator)
+{
+    const auto profile = std::make_shared<const PrinterProfile>(PrinterParameters{ .macro_costs = { .fill_hopper = 2.0f, .set_pass = 0.5f } });
+    PrintManager manager(profile);
+    const auto layer = synthetic_layer(profile->parameters(), SyntheticLayerOptions{ .lines = 2000, .layer_nr = 3, .seed = 11 });
+    const auto lines = splitLines(layer);
+    manager.parse(std::span(lines).subspan(1));
+
+    GCodeGenerator generator(profile);
+    std::string gcode = generator.print_begin_cmd(2);
+    gcode += manager.generate(3);
+    gcode += manager.generate(4);
+    gcode += generator.print_end_cmd(2);
+
+    PrinterEmulator emulator(profile);
+    std::vector<EmulatedLayer> layers;
+    emulator.on_layer = [&](const PrinterEmulator& emulated)
+    {
+        layers.push_back(emulated.layer());
+        const auto comparison = emulated.compare(manager.gcodeparser.pattern);
+        EXPECT_EQ(comparison.mismatched_bits, 0);
+        // every other row of both passes has its own valves
+        EXPECT_GE(comparison.rows, static_cast<size_t>(profile->bed_rows()) - 2);
+    };
+    emulator.feed(gcode);
+    emulator.finish();
+
+    ASSERT_EQ(layers.size(), 2);
+    EXPECT_EQ(emulator.total_layers(), 2);
+    EXPECT_EQ(layers[0].layer_nr, 4);
+    for (const auto& emulated : layers)
+    {
+        ASSERT_TRUE(emulated.estimated.has_value());
+        EXPECT_NEAR(emulated.time(), *emulated.estimated, 1e-3);
+        EXPECT_DOUBLE_EQ(emulated.dwell, 3.0);
+        EXPECT_DOUBLE_EQ(emulated.macros, 5.0);
+        EXPECT_GT(emulated.valve_toggles, 0);
+    }
+    EXPECT_NEAR(emulator.elapsed(), manager.gg.estimator.elapsed(), 1e-3);
+
+    // the printer rejects what it does not know
+    EXPECT_THROW(emulator.execute("G1 Y10 Q3"), std::invalid_argument);
+    EXPECT_THROW(emulator.execute("VALVES_SET VALUES=1,2"), std::invalid_argument);
+    EXPECT_THROW(emulator.execute("SPRAY_EVERYTHING"), std::invalid_argument);
+}
+
+TEST(suppression, logratelimit)
+{
+    auto sink = std::make_shared<spdlog::sinks::ringbuffer_sink_mt>(16);
+    auto previous = spdlog::default_logger();
+    spdlog::set_default_logger(std::make_shared<spdlog::logger>("test", sink));
+
+    plugin::LogRateLimit limit{ std::chrono::hours{ 1 } };
+    for (int i = 0; i < 5; i++)
+    {
+        limit.log(spdlog::level::err, "parse error {}", i);
+    }
+    limit.log(spdlog::level::trace, "below the level, not counted");
+    EXPECT_EQ(sink->last_raw().size(), 1);
+    EXPECT_EQ(limit.suppressed(), 4);
+
+    plugin::LogRateLimit unlimited{ std::chrono::seconds{ 0 } };
+    unlimited.log(spdlog::level::err, "first");
+    unlimited.log(spdlog::level::err, "second");
+    EXPECT_EQ(sink->last_raw().size(), 3);
+    EXPECT_EQ(unlimited.suppressed(), 0);
+
+    EXPECT_EQ(plugin::parseLogLevel("warning"), spdlog::level::warn);
+    EXPECT_EQ(plugin::parseLogLevel("off"), spdlog::level::off);
+    EXPECT_FALSE(plugin::parseLogLevel("loud").has_value());
+    spdlog::set_default_logger(previous);
+}
+
+TEST(spans, tracer)
+{
+    {
+        const TraceSpan disabled("disabled", "test");
+    }
+    EXPECT_EQ(Tracer::instance().json().find("disabled"), std::string::npos);
+
+    Tracer::instance().enable(2);
+    Tracer::set_layer(7);
+    {
+        const TraceSpan span("outer", "test");
+        const TraceSpan call("call", "rpc", 8, 42);
+    }
+    const auto json = Tracer::instance().json();
+    EXPECT_NE(json.find("\"name\":\"outer\",\"cat\":\"test\",\"ph\":\"X\""), std::string::npos);
+    EXPECT_NE(json.find("\"args\":{\"layer\":7}"), std::string::npos);
+    EXPECT_NE(json.find("\"ph\":\"b\",\"id\":42"), std::string::npos);
+    EXPECT_NE(json.find("\"ph\":\"e\",\"id\":42"), std::string::npos);
+
+    // the ring keeps the last events only
+    {
+        const TraceSpan newest("newest", "test");
+    }
+    EXPECT_NE(Tracer::instance().json().find("newest"), std::string::npos);
+    EXPECT_EQ(Tracer::instance().json().find("\"call\""), std::string::npos);
+}
+
+TEST(lru, layercache)
+{
+    LayerCache cache(10);
+    const auto a = LayerCache::key(";LAYER:1\nG1 X0 Y10 E1", 1, 0);
+    const auto b = LayerCache::key(";LAYER:2\nG1 X0 Y10 E1", 2, 0);
+    EXPECT_FALSE(a == b);
+    EXPECT_FALSE(a == LayerCache::key(";LAYER:1\nG1 X0 Y10 E1", 1, 1));
+
+    EXPECT_EQ(cache.find(a), nullptr);
+    cache.insert(a, std::make_shared<const std::string>("aaaaaa"));
+    ASSERT_NE(cache.find(a), nullptr);
+    EXPECT_EQ(*cache.find(a), "aaaaaa");
+    cache.insert(b, std::make_shared<const std::string>("bbbbbb"));
+    EXPECT_EQ(cache.find(a), nullptr);
+    EXPECT_NE(cache.find(b), nullptr);
+
+    const auto stats = cache.stats();
+    EXPECT_EQ(stats.hits, 3);
+    EXPECT_EQ(stats.misses, 2);
+    EXPECT_EQ(stats.evictions, 1);
+    EXPECT_EQ(stats.bytes, 6);
+}
+
+TEST(disk, layercache)
+{
+    const auto directory = std::filesystem::temp_directory_path() / "onlyfans_test_layercache";
+    std::filesystem::remove_all(directory);
+    const auto key = LayerCache::key(";LAYER:3\n", 3, 42);
+    {
+        LayerCache cache(1024, directory);
+        cache.insert(key, std::make_shared<const std::string>("G1 Y0\n"));
+    }
+    LayerCache restarted(1024, directory);
+    auto value = restarted.find(key);
+    ASSERT_NE(value, nullptr);
+    EXPECT_EQ(*value, "G1 Y0\n");
+    EXPECT_EQ(restarted.stats().disk_hits, 1);
+    std::filesystem::remove_all(directory);
+}
+
+TEST(disk_only, layercache)
+{
+    const auto directory = std::filesystem::temp_directory_path() / "onlyfans_test_layercache_disk_only";
+    std::filesystem::remove_all(directory);
+    const auto key = LayerCache::key(";LAYER:4\n", 4, 42);
+    const auto value = std::make_shared<const std::string>("G1 Y0\nG1 Y1\n");
+    {
+        // nothing fits in memory, the layer is still written to disk, and only once
+        LayerCache cache(0, directory);
+        cache.insert(key, value);
+        cache.insert(key, value);
+        const auto stats = cache.stats();
+        EXPECT_EQ(stats.entries, 0);
+        EXPECT_EQ(stats.disk_writes, 1);
+        EXPECT_EQ(stats.disk_bytes, value->size());
+    }
+    LayerCache restarted(0, directory);
+    ASSERT_NE(restarted.find(key), nullptr);
+    EXPECT_EQ(restarted.stats().disk_bytes, value->size());
+    std::filesystem::remove_all(directory);
+}
+
+TEST(layer_nr, layercache)
+{
+    EXPECT_EQ(find_layer_nr(";FLAVOR:Marlin\n;LAYER:12\nG1 X0"), 12);
+    EXPECT_EQ(find_layer_nr("G1 X0 Y0"), -1);
+}
+
+TEST(from_settings, printerprofile)
+{
+    const std::unordered_map<std::string_view, std::string> settings{ { "onlyfans_bed_y_start", "100" }, { "onlyfans_base_feedrate", "4000.0" } };
+    const auto parameters = PrinterParameters::from_settings(
+        [&settings](std::string_view key) -> std::optional<std::string>
+        {
+            const auto setting = settings.find(key);
+            if (setting == settings.end())
+            {
+                return std::nullopt;
+            }
+            return setting->second;
+        });
+    EXPECT_EQ(parameters.y_start, 100);
+    EXPECT_EQ(parameters.base_feedrate, 4000);
+    EXPECT_EQ(parameters.joint_feedrate, 7691);
+
+    const PrinterProfile profile(parameters);
+    EXPECT_EQ(profile.bytes_per_pass(), 11);
+    EXPECT_EQ(profile.bed_rows(), 1462 - 100 - 1);
+    EXPECT_NE(profile.fingerprint(), PrinterProfile::defaults()->fingerprint());
+    EXPECT_EQ(profile.valve_value(std::bitset<8>("00000001")), "128,");
+    EXPECT_EQ(profile.closed_valves(), "VALVES_SET VALUES=0,0,0,0,0,0,0,0,0,0,0\n");
+
+    EXPECT_THROW(
+        PrinterParameters::from_settings(
+            [](std::string_view) -> std::optional<std::string>
+            {
+                return "fast";
+            }),
+        std::invalid_argument);
+}
+
+#ifdef __linux__
+TEST(shared_memory, workerchannel)
+{
+    // both ends in this process, the worker end on a mapping of its own like in a worker process
+    auto channel = plugin::WorkerChannel::create(8192);
+    plugin::WorkerChannel worker{ dup(channel.fd()) };
+    std::atomic_bool running{ true };
+    std::thread serving(
+        [&]()
+        {
+            worker.serve(
+                [&]()
+                {
+                    return running.load();
+                });
+        });
+
+    const PrinterParameters parameters{ .max_valve_frequency = 60.0f };
+    const auto profile = std::make_shared<const PrinterProfile>(parameters);
+    const auto layer = synthetic_layer(parameters, SyntheticLayerOptions{ .lines = 1000, .layer_nr = 3, .seed = 9 });
+    PipelineStats stats;
+    const auto gcode = channel.call(layer, parameters, {}, &stats); // grows the memfd for the layer and for the g-code
+    EXPECT_EQ(gcode, filterLines(layer, profile));
+    EXPECT_TRUE(stats.converted);
+    EXPECT_EQ(stats.output_bytes, gcode.size());
+    EXPECT_EQ(channel.call(layer, parameters), gcode);
+
+    EXPECT_THROW(channel.call(";LAYER:1\nG1 X10 Y10 E1 ;a line across the bed\n", PrinterParameters{ .y_end = 10 }), std::runtime_error);
+    const auto cancelled = CancellationToken::create();
+    cancelled.cancel();
+    EXPECT_THROW(channel.call(layer, parameters, cancelled), Cancelled);
+    EXPECT_EQ(channel.call(layer, parameters), gcode);
+
+    running = false;
+    serving.join();
+}
+
+TEST(deadline, workerchannel)
+{
+    auto channel = plugin::WorkerChannel::create(8192);
+    plugin::WorkerChannel worker{ dup(channel.fd()) };
+    const PrinterParameters parameters{};
+    const auto layer = synthetic_layer(parameters, SyntheticLayerOptions{ .lines = 10 });
+    const auto message = [&](const CancellationToken& cancellation, std::chrono::milliseconds timeout, const std::function<void()>& stuck = {})
+    {
+        try
+        {
+            channel.call(layer, parameters, cancellation, nullptr, timeout, stuck);
+        }
+        catch (const Cancelled&)
+        {
+            return std::string{ "cancelled" };
+        }
+        catch (const std::runtime_error& e)
+        {
+            return std::string{ e.what() };
+        }
+        return std::string{};
+    };
+
+    // a layer no worker took is withdrawn
+    EXPECT_EQ(message({}, std::chrono::milliseconds{ 50 }), "The worker process took longer than 50 ms to convert the layer");
+    EXPECT_EQ(channel.header().state.load(), plugin::WorkerChannel::IDLE);
+
+    // a worker that takes layers and never finishes them; ending it stands in for the kill and the supervisor
+    const auto cancellation = CancellationToken::create();
+    std::atomic_bool cancel_on_take{ false };
+    std::atomic_bool running{ true };
+    std::thread stuck(
+        [&]()
+        {
+            while (running)
+            {
+                auto state = static_cast<std::uint32_t>(plugin::WorkerChannel::REQUEST);
+                if (worker.header().state.compare_exchange_strong(state, plugin::WorkerChannel::CONVERTING) && cancel_on_take)
+                {
+                    cancellation.cancel();
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+            }
+        });
+    int ended = 0;
+    const auto end = [&]()
+    {
+        ++ended;
+        worker.abandon();
+    };
+    EXPECT_EQ(message({}, std::chrono::milliseconds{ 50 }, end), "The worker process took longer than 50 ms to convert the layer");
+    EXPECT_EQ(ended, 1);
+    cancel_on_take = true;
+    EXPECT_EQ(message(cancellation, {}, end), "cancelled");
+    EXPECT_EQ(ended, 2);
+    EXPECT_EQ(channel.header().state.load(), plugin::WorkerChannel::IDLE);
+
+    running = false;
+    stuck.join();
+}
+#endif
+
+// Whole calls through the plugin on a single call slot: every layer is converted on the compute pool, and the calls
+// after the first are read into messages on the arena the call before them reset
+TEST(roundtrip, generate)
+{
+    namespace modify = cura::plugins::slots::postprocess::v0::modify;
+    using generate_t = plugin::onlyfans::Generate<modify::PostprocessModifyService::AsyncService, modify::CallResponse, modify::CallRequest>;
+    plugin::Plugin<generate_t> server{ "127.0.0.1", "0", grpc::InsecureServerCredentials(), 1, 1 };
+    const auto compute_pool = std::make_shared<boost::asio::thread_pool>(2);
+    server.addHandshakeService(plugin::Handshake{ .metadata = server.metadata });
+    server.addGenerateService(generate_t{ .metadata = server.metadata, .compute_pool = compute_pool });
+    server.start();
+    ASSERT_NE(server.port(), 0);
+    std::thread serving(
+        [&server]()
+        {
+            server.run();
+        });
+
+    const auto stub = modify::PostprocessModifyService::NewStub(grpc::CreateChannel(std::format("127.0.0.1:{}", server.port()), grpc::InsecureChannelCredentials()));
+    const auto profile = PrinterProfile::defaults();
+    // the layer of the first call again last, a larger one in between grows the arena past its initial block
+    for (const auto [lines, seed] : { std::pair{ 200U, 1U }, std::pair{ 3000U, 2U }, std::pair{ 200U, 1U } })
+    {
+        const auto layer = synthetic_layer(profile->parameters(), SyntheticLayerOptions{ .lines = lines, .seed = seed });
+        modify::CallRequest request;
+        request.set_gcode_word(layer);
+        grpc::ClientContext context;
+        context.AddMetadata("cura-engine-uuid", "roundtrip");
+        modify::CallResponse response;
+        const auto status = stub->Call(&context, request, &response);
+        EXPECT_TRUE(status.ok()) << status.error_message();
+        if (! status.ok())
+        {
+            break; // the server still has to be stopped
+        }
+        EXPECT_EQ(response.gcode_word(), filterLines(layer, profile));
+    }
+
+    server.stop();
+    serving.join();
+    compute_pool->join();
+}
+
+TEST(publish, sessionregistry)
+{
+    plugin::SessionRegistry<int> registry({ .ttl = std::chrono::seconds(3600), .max_sessions = 2 });
+    EXPECT_EQ(registry.find("a"), nullptr);
+    registry.publish("a", 1);
+    registry.publish("b", 2);
+    ASSERT_NE(registry.find("a"), nullptr);
+    EXPECT_EQ(*registry.find("a"), 1);
+
+    // a snapshot taken before a write stays valid after it
+    const auto before = registry.find("a");
+    registry.publish("a", 3);
+    EXPECT_EQ(*before, 1);
+    EXPECT_EQ(*registry.find("a"), 3);
+
+    registry.publish("c", 4);
+    EXPECT_EQ(registry.size(), 2);
+    // one of a and b is evicted, they were used in the same second; it is remembered
+    const std::string evicted = registry.find("a") == nullptr ? "a" : "b";
+    const std::string kept = evicted == "a" ? "b" : "a";
+    EXPECT_EQ(registry.find(evicted), nullptr);
+    EXPECT_TRUE(registry.forgotten(evicted));
+    EXPECT_FALSE(registry.forgotten(kept));
+    EXPECT_FALSE(registry.forgotten("never"));
+    int value = 0;
+    EXPECT_TRUE(registry.visit(
+        "c",
+        [&value](int session)
+        {
+            value = session;
+        }));
+    EXPECT_EQ(value, 4);
+
+    registry.erase("c");
+    EXPECT_EQ(registry.find("c"), nullptr);
+    EXPECT_FALSE(registry.forgotten("c"));
+
+    // published again, it is found instead of forgotten
+    registry.publish(evicted, 5);
+    EXPECT_FALSE(registry.forgotten(evicted));
+    EXPECT_EQ(*registry.find(evicted), 5);
+}
+
+TEST(ttl, sessionregistry)
+{
+    plugin::SessionRegistry<int> registry({ .ttl = std::chrono::seconds(-1), .max_sessions = 16 });
+    registry.publish("a", 1);
+    registry.publish("b", 2);
+    // a is dropped by the write, b is still published but has expired for readers
+    EXPECT_EQ(registry.size(), 1);
+    EXPECT_EQ(registry.find("a"), nullptr);
+    EXPECT_EQ(registry.find("b"), nullptr);
+    EXPECT_FALSE(registry.visit(
+        "b",
+        [](int)
+        {
+        }));
+    // both were published, neither is mistaken for a slice that never sent its settings
+    EXPECT_TRUE(registry.forgotten("a"));
+    EXPECT_TRUE(registry.forgotten("b"));
+    EXPECT_FALSE(registry.forgotten("c"));
+}
+
+TEST(options, transfer)
+{
+    EXPECT_EQ(plugin::TransferOptions::parseAlgorithm("gzip"), GRPC_COMPRESS_GZIP);
+    EXPECT_EQ(plugin::TransferOptions::parseAlgorithm("none"), GRPC_COMPRESS_NONE);
+    EXPECT_THROW(plugin::TransferOptions::parseAlgorithm("zstd"), std::invalid_argument);
+
+    const plugin::TransferOptions options{ .compression = GRPC_COMPRESS_DEFLATE, .compress_min_bytes = 100 };
+    EXPECT_FALSE(options.compresses(99));
+    EXPECT_TRUE(options.compresses(100));
+    EXPECT_FALSE(plugin::TransferOptions{}.compresses(1 << 20));
+}
+
+TEST(estimate, transferstats)
+{
+    std::string layer;
+    for (int row = 0; row < 2000; row++)
+    {
+        layer += std::format("G1 Y{} F3000\nVALVES_SET VALUES=0,0,0,0,0,0,0,0,0,0,0\n", row);
+    }
+
+    // nothing is deflated unless asked for
+    plugin::TransferStats counted;
+    EXPECT_FALSE(counted.estimates());
+    counted.recordRequest(10);
+    counted.recordResponse(layer, true);
+    counted.recordResponse("G1 Y0\n", false);
+    auto stats = counted.snapshot();
+    EXPECT_EQ(stats.requests, 1U);
+    EXPECT_EQ(stats.request_bytes, 10U);
+    EXPECT_EQ(stats.responses, 2U);
+    EXPECT_EQ(stats.response_bytes, layer.size() + 6);
+    EXPECT_EQ(stats.compressed_responses, 1U);
+    EXPECT_EQ(stats.compressed_raw_bytes, layer.size());
+    EXPECT_EQ(stats.estimated_compressed_bytes, 0U);
+
+    // only the first of every two is deflated, its ratio applies to both
+    plugin::TransferStats sampled(2);
+    EXPECT_TRUE(sampled.estimates());
+    sampled.recordResponse(layer, true);
+    sampled.recordResponse(layer, true);
+    stats = sampled.snapshot();
+    EXPECT_EQ(stats.compressed_raw_bytes, 2 * layer.size());
+    EXPECT_GT(stats.estimated_compressed_bytes, 0U);
+    EXPECT_LT(stats.estimated_compressed_bytes, layer.size());
+}
+
 int main(int argc, char** argv)
 {
     // Initialize the Google Test framework